@@ -0,0 +1,699 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "kiuru.h"
+#include "screen.h"
+
+/*
+ * Benchmarks of the buffer and renderer hot paths, run by make bench. Each
+ * result is a JSON object on its own line, so runs on two commits can be
+ * compared line by line. Every case runs in its own process and reports the
+ * peak RSS of that process. Arguments pick the cases whose name contains
+ * one of them, e.g. ./build/bench load save
+ */
+
+/* Load and save cases run this many times and the best run is reported,
+ * so the page cache is warm after the first */
+#define BENCH_RUNS 5
+
+static char tmp_dir[] = "/tmp/kiuru-bench-XXXXXX";
+
+/* Test file, written the first time a case needs it */
+struct bench_file {
+	const char *name;
+	size_t size;
+	void (*gen)(const char *path, size_t size);
+	char path[PATH_MAX];
+	int made;
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* quit_editor is in main.c, which the benchmark does not link. No case
+ * quits */
+void quit_editor(struct editor *e, int status)
+{
+	exit(status);
+}
+
+/* Prints the result line of a case, fields given by fmt */
+static void emit(const char *name, const char *fmt, ...)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+
+	va_list ap;
+	va_start(ap, fmt);
+	printf("{\"bench\": \"%s\", ", name);
+	vprintf(fmt, ap);
+	printf(", \"peak_rss_kb\": %ld}\n", ru.ru_maxrss);
+	va_end(ap);
+}
+
+static FILE *create(const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (!f)
+		die("bench: cannot create %s", path);
+	return f;
+}
+
+/* Writes size bytes of short lines, 40 chars on average, ending in eol */
+static void gen_lines(const char *path, size_t size, const char *eol)
+{
+	FILE *f = create(path);
+	size_t written = 0;
+	unsigned seed = 1;
+	while (written < size) {
+		int len = rand_r(&seed) % 80;
+		for (int i = 0; i < len; i++)
+			fputc('a' + i % 26, f);
+		fputs(eol, f);
+		written += len + strlen(eol);
+	}
+	fclose(f);
+}
+
+static void gen_short_lines(const char *path, size_t size)
+{
+	gen_lines(path, size, "\n");
+}
+
+static void gen_crlf_lines(const char *path, size_t size)
+{
+	gen_lines(path, size, "\r\n");
+}
+
+/* Writes lines of code-like text 200 chars wide, indented with tabs and
+ * with tabs between columns if tabs is set */
+static void gen_wide(const char *path, size_t size, int tabs)
+{
+	FILE *f = create(path);
+	int lines = size / 201;
+
+	for (int i = 0; i < lines; i++) {
+		int col = 0;
+		for (int t = 0; tabs && t < i % 4; t++, col += 8)
+			fputc('\t', f);
+		while (col < 200) {
+			if (tabs && col % 24 == 20) {
+				fputc('\t', f);
+				col += 8 - col % 8;
+			} else {
+				fputc('a' + col % 26, f);
+				col++;
+			}
+		}
+		fputc('\n', f);
+	}
+	fclose(f);
+}
+
+static void gen_wide_lines(const char *path, size_t size)
+{
+	gen_wide(path, size, 0);
+}
+
+static void gen_tab_lines(const char *path, size_t size)
+{
+	gen_wide(path, size, 1);
+}
+
+/* Writes one line of size bytes of minified code, with a tab every 10 */
+static void gen_huge_line(const char *path, size_t size)
+{
+	FILE *f = create(path);
+	for (size_t i = 0; i < size; i++)
+		fputc(i % 10 == 0 ? '\t' : 'a' + i % 26, f);
+	fputc('\n', f);
+	fclose(f);
+}
+
+enum { F_SMALL, F_BIG, F_CRLF, F_WIDE, F_TABS, F_HUGE };
+
+/* Short lines below and above the size where files are mapped, a screen
+ * of wide lines with and without tabs and one huge line */
+static struct bench_file files[] = {
+	[F_SMALL] = { "small.txt", 8 << 20, gen_short_lines },
+	[F_BIG] = { "big.txt", 256 << 20, gen_short_lines },
+	[F_CRLF] = { "crlf.txt", 8 << 20, gen_crlf_lines },
+	[F_WIDE] = { "wide.txt", 200 * 201, gen_wide_lines },
+	[F_TABS] = { "tabs.txt", 200 * 201, gen_tab_lines },
+	[F_HUGE] = { "huge.txt", 64 << 20, gen_huge_line },
+};
+
+/* Loads a file and splits all of it into lines */
+static struct buffer *load_all(struct editor *e, const char *path)
+{
+	memset(e, 0, sizeof(*e));
+	load_file(e, path);
+	buffer_scan(e->active_buf, INT_MAX);
+	return e->active_buf;
+}
+
+/* Puts the cursor at line y, column x */
+static void set_cursor(struct buffer *b, int y, int x)
+{
+	b->cy = y;
+	b->cx = x;
+	b->current = buffer_line(b, y);
+}
+
+static void bench_load(const char *name, struct bench_file *f, int arg)
+{
+	double best = 0;
+
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		struct editor e;
+		double start = now_ns();
+		struct buffer *b = load_all(&e, f->path);
+		double ns = now_ns() - start;
+
+		buffer_free(b);
+		if (run == 0 || ns < best)
+			best = ns;
+	}
+	emit(name, "\"bytes\": %zu, \"ns\": %.0f, \"mb_per_s\": %.1f", f->size,
+	     best, f->size / (best / 1e9) / (1024 * 1024));
+}
+
+/* Saves a file back after an edit on its first line. The file is split as
+ * far as the first screen, like right after opening it */
+static void bench_save(const char *name, struct bench_file *f, int arg)
+{
+	double best = 0;
+
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		struct editor e = { 0 };
+		load_file(&e, f->path);
+		struct buffer *b = e.active_buf;
+		buffer_scan(b, 100);
+		set_cursor(b, 0, 0);
+		insert_char(&e, 'x');
+		delete_char(&e, 0);
+
+		double start = now_ns();
+		save_file(&e);
+		save_wait(&e);
+		double ns = now_ns() - start;
+
+		if (e.message[0] != '"')
+			die("bench: %s", e.message);
+		buffer_free(b);
+		if (run == 0 || ns < best)
+			best = ns;
+	}
+	emit(name, "\"bytes\": %zu, \"ns\": %.0f, \"mb_per_s\": %.1f", f->size,
+	     best, f->size / (best / 1e9) / (1024 * 1024));
+}
+
+/* Edits at random places of a loaded file, each kind of edit timed on its
+ * own. Putting the cursor on the line is part of the time, like jumping
+ * there before the edit */
+static void bench_edits(const char *name, struct bench_file *f, int ops)
+{
+	static const char *kinds[] = { "edit_insert_char",
+				       "edit_insert_newline",
+				       "edit_delete_char", "edit_join_lines" };
+	struct editor e;
+	struct buffer *b = load_all(&e, f->path);
+	e.mode = MODE_INSERT;
+	unsigned seed = 1;
+
+	for (int kind = 0; kind < 4; kind++) {
+		double start = now_ns();
+		for (int i = 0; i < ops; i++) {
+			int y = 1 + rand_r(&seed) % (b->line_count - 1);
+			set_cursor(b, y, 0);
+			int size = b->current->size;
+
+			switch (kind) {
+			case 0:
+				b->cx = rand_r(&seed) % (size + 1);
+				insert_char(&e, 'x');
+				break;
+			case 1:
+				b->cx = rand_r(&seed) % (size + 1);
+				insert_newline(&e);
+				break;
+			case 2:
+				if (size > 0) {
+					b->cx = 1 + rand_r(&seed) % size;
+					delete_char(&e, 1);
+				}
+				break;
+			case 3:
+				delete_char(&e, 1);
+				break;
+			}
+		}
+		double ns = (now_ns() - start) / ops;
+		emit(kinds[kind], "\"ops\": %d, \"ns_per_op\": %.0f", ops, ns);
+	}
+	buffer_free(b);
+}
+
+/* Render column lookups at random places of lines with tabs */
+static void bench_cx_to_rx(const char *name, struct bench_file *f, int ops)
+{
+	struct editor e;
+	struct buffer *b = load_all(&e, f->path);
+	unsigned seed = 1;
+	long sum = 0;
+
+	double start = now_ns();
+	for (int i = 0; i < ops; i++) {
+		struct line *l = buffer_line(b, rand_r(&seed) % b->line_count);
+		sum += cx_to_rx(b, l, rand_r(&seed) % (l->size + 1));
+	}
+	double ns = (now_ns() - start) / ops;
+
+	emit(name, "\"ops\": %d, \"ns_per_op\": %.0f, \"check\": %d", ops, ns,
+	     sum != 0);
+	buffer_free(b);
+}
+
+/* Typing in the middle of one long line with tabs, like a minified file.
+ * Each key looks up the cursor's render column three times, the way the
+ * main loop, status bar and column scrolling do */
+static void bench_long_line(const char *name, struct bench_file *f, int size)
+{
+	struct editor e = { 0 };
+	struct buffer *b = buffer_new();
+	e.buf_head = b;
+	e.active_buf = b;
+
+	for (int i = 0; i < size; i++)
+		insert_char(&e, i % 10 == 0 ? '\t' : 'a');
+	b->cx = size / 2;
+
+	int keys = 2000;
+	int sum = 0;
+	double start = now_ns();
+	for (int i = 0; i < keys; i++) {
+		insert_char(&e, 'x');
+		for (int j = 0; j < 3; j++)
+			sum += cx_to_rx(b, b->current, b->cx);
+	}
+	double ns = (now_ns() - start) / keys;
+
+	emit(name, "\"bytes\": %d, \"ns_per_key\": %.0f, \"check\": %d", size,
+	     ns, sum != 0);
+	buffer_free(b);
+}
+
+/* A long insert session in the middle of a wide line that stays below the
+ * chunking threshold. Reports the average and the slowest key */
+static void bench_wide_line(const char *name, struct bench_file *f, int size)
+{
+	struct editor e = { 0 };
+	struct buffer *b = buffer_new();
+	e.buf_head = b;
+	e.active_buf = b;
+	e.mode = MODE_INSERT;
+
+	for (int i = 0; i < size; i++)
+		insert_char(&e, 'a' + i % 26);
+	buffer_gap_close(b);
+	b->cx = size / 2;
+
+	int keys = size / 2;
+	double worst = 0;
+	double start = now_ns();
+	for (int i = 0; i < keys; i++) {
+		double key_start = now_ns();
+		insert_char(&e, 'x');
+		double ns = now_ns() - key_start;
+		if (ns > worst)
+			worst = ns;
+	}
+	double ns = (now_ns() - start) / keys;
+
+	emit(name,
+	     "\"bytes\": %d, \"keys\": %d, \"ns_per_key\": %.0f, "
+	     "\"max_ns\": %.0f",
+	     size, keys, ns, worst);
+	buffer_free(b);
+}
+
+/* Typing and backspacing in the middle of a huge line loaded from a file,
+ * with the cursor's render column looked up after each key. The first key
+ * is timed on its own, it sets the line up */
+static void bench_huge_line(const char *name, struct bench_file *f, int arg)
+{
+	struct editor e = { 0 };
+	load_file(&e, f->path);
+	struct buffer *b = e.active_buf;
+	b->cx = f->size / 2;
+
+	double start = now_ns();
+	insert_char(&e, 'x');
+	double first_ns = now_ns() - start;
+	int sum = cx_to_rx(b, b->current, b->cx);
+
+	int keys = 2000;
+	start = now_ns();
+	for (int i = 0; i < keys; i++) {
+		if (i % 4 == 3)
+			delete_char(&e, 1);
+		else
+			insert_char(&e, 'x');
+		sum += cx_to_rx(b, b->current, b->cx);
+	}
+	double ns = (now_ns() - start) / keys;
+
+	emit(name,
+	     "\"bytes\": %zu, \"first_key_ns\": %.0f, \"ns_per_key\": %.0f, "
+	     "\"check\": %d",
+	     f->size, first_ns, ns, sum != 0);
+	buffer_free(b);
+}
+
+/* Pastes size bytes of short lines into the middle of a loaded file, then
+ * types the same text there key by key to compare */
+static void bench_paste(const char *name, struct bench_file *f, int size)
+{
+	char *text = xmalloc(size);
+	for (int i = 0; i < size; i++)
+		text[i] = (i % 40 == 39) ? '\n' : 'a' + i % 26;
+
+	double ns[2];
+	for (int typed = 0; typed < 2; typed++) {
+		struct editor e;
+		struct buffer *b = load_all(&e, f->path);
+		e.mode = MODE_INSERT;
+		set_cursor(b, b->line_count / 2, 5);
+
+		double start = now_ns();
+		if (typed) {
+			for (int i = 0; i < size; i++) {
+				if (text[i] == '\n')
+					insert_newline(&e);
+				else
+					insert_char(&e, text[i]);
+			}
+		} else {
+			insert_text(&e, text, size);
+		}
+		ns[typed] = now_ns() - start;
+		buffer_free(b);
+	}
+
+	emit(name,
+	     "\"bytes\": %d, \"ns\": %.0f, \"mb_per_s\": %.1f, "
+	     "\"typed_ns\": %.0f",
+	     size, ns[0], size / (ns[0] / 1e9) / (1024 * 1024), ns[1]);
+	free(text);
+}
+
+/* Searches every line of a loaded file for a pattern that is not there.
+ * Its first byte is common, so the filter has work to do */
+static void bench_search(const char *name, struct bench_file *f, int arg)
+{
+	struct editor e;
+	struct buffer *b = load_all(&e, f->path);
+	strcpy(e.search.pattern, "zyx");
+	e.search.len = 3;
+
+	double best = 0;
+	int found = 0;
+	int len;
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		double start = now_ns();
+		for (struct line *l = buffer_line(b, 0); l;
+		     l = buffer_next_line(b, l))
+			found += search_find(&e, l, 0, l->size, &len) >= 0;
+		double ns = now_ns() - start;
+		if (run == 0 || ns < best)
+			best = ns;
+	}
+	emit(name,
+	     "\"bytes\": %zu, \"ns\": %.0f, \"mb_per_s\": %.1f, "
+	     "\"found\": %d",
+	     f->size, best, f->size / (best / 1e9) / (1024 * 1024), found);
+	buffer_free(b);
+}
+
+/* Searches the whole file for a regex that is not there, in worker
+ * threads like / with \\v does. The event loop runs on the headless
+ * screen so the chunks come back the way they do in the editor */
+static void bench_regex(const char *name, struct bench_file *f, int arg)
+{
+	struct editor e;
+	struct buffer *b = load_all(&e, f->path);
+	headless_open(24, 80, "", 0);
+	strcpy(e.search.pattern, "\\vzy[x-z]+q");
+	e.search.len = strlen(e.search.pattern);
+	e.search.dir = 1;
+
+	double best = 0;
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		double start = now_ns();
+		search_next(&e, 1);
+		while (e.search.job) {
+			event_key(&e);
+			usleep(100);
+		}
+		double ns = now_ns() - start;
+		if (run == 0 || ns < best)
+			best = ns;
+	}
+	regex_wait();
+	emit(name,
+	     "\"bytes\": %zu, \"ns\": %.0f, \"mb_per_s\": %.1f, "
+	     "\"threads\": %ld",
+	     f->size, best, f->size / (best / 1e9) / (1024 * 1024),
+	     sysconf(_SC_NPROCESSORS_ONLN));
+	buffer_free(b);
+}
+
+/* Types lines of 0 to 30 chars into an empty buffer, like writing code */
+static void bench_mem_typed(const char *name, struct bench_file *f, int lines)
+{
+	struct editor e = { 0 };
+	struct buffer *b = buffer_new();
+	unsigned seed = 1;
+	e.buf_head = b;
+	e.active_buf = b;
+
+	for (int i = 0; i < lines; i++) {
+		int len = rand_r(&seed) % 31;
+		for (int j = 0; j < len; j++)
+			insert_char(&e, 'a' + j % 26);
+		insert_newline(&e);
+	}
+
+	size_t bytes = buffer_mem_usage(b);
+	emit(name, "\"lines\": %d, \"bytes\": %zu, \"bytes_per_line\": %.1f",
+	     b->line_count, bytes, (double)bytes / b->line_count);
+	buffer_free(b);
+}
+
+/* Memory held after loading a file and editing every line of it once */
+static void bench_mem_loaded(const char *name, struct bench_file *f, int arg)
+{
+	struct editor e;
+	struct buffer *b = load_all(&e, f->path);
+
+	size_t loaded = buffer_mem_usage(b);
+	for (int i = 0; i < b->line_count; i++) {
+		set_cursor(b, i, 0);
+		insert_char(&e, 'x');
+	}
+	size_t edited = buffer_mem_usage(b);
+
+	emit(name,
+	     "\"lines\": %d, \"bytes_per_line\": %.1f, "
+	     "\"edited_bytes_per_line\": %.1f",
+	     b->line_count, (double)loaded / b->line_count,
+	     (double)edited / b->line_count);
+	buffer_free(b);
+}
+
+/* Time to draw a full frame of the file on an 80 x cols terminal whose
+ * output goes to /dev/null */
+static void bench_frame(const char *name, struct bench_file *f, int cols)
+{
+	int rows = 80;
+	char size[16];
+	snprintf(size, sizeof(size), "%d", rows);
+	setenv("LINES", size, 1);
+	snprintf(size, sizeof(size), "%d", cols);
+	setenv("COLUMNS", size, 1);
+
+	FILE *out = fopen("/dev/null", "w");
+	FILE *in = fopen("/dev/null", "r");
+	SCREEN *scr = newterm("xterm", out, in);
+	if (!scr)
+		die("bench: newterm failed");
+
+	struct editor e = { 0 };
+	load_file(&e, f->path);
+
+	/* Scroll a line per frame so every frame sends new text */
+	int frames = 2000;
+	double draw_ns = 0;
+	double start = now_ns();
+	for (int i = 0; i < frames; i++) {
+		e.drawn_buf = NULL;
+		buffer_scroll(e.active_buf, i % 100);
+		double draw_start = now_ns();
+		draw_ui(&e);
+		draw_ns += now_ns() - draw_start;
+		refresh();
+	}
+	double ns = (now_ns() - start) / frames;
+	draw_ns /= frames;
+
+	endwin();
+	delscreen(scr);
+	fclose(out);
+	fclose(in);
+	buffer_free(e.active_buf);
+
+	/* draw_ui alone, and with ncurses sending the frame out */
+	emit(name,
+	     "\"rows\": %d, \"cols\": %d, \"draw_ns\": %.0f, "
+	     "\"ns_per_frame\": %.0f",
+	     rows, cols, draw_ns, ns);
+}
+
+/* Replays a key script on the headless screen, timing each key from its
+ * read to the end of the frame it leads to, like the main loop runs it */
+static void bench_replay(const char *name, struct bench_file *f, int rows)
+{
+	/* Moves, a small edit and a page down now and then */
+	int rounds = 1000;
+	const char *round = "jjjiab<CR>x<BS><Esc>";
+	size_t len = 0;
+	char *script = xmalloc(rounds * (strlen(round) + 16));
+	for (int i = 0; i < rounds; i++)
+		len += sprintf(script + len, "%s%s", round,
+			       i % 20 == 19 ? "<PageDown>" : "");
+	headless_open(rows, 200, script, len);
+	free(script);
+
+	struct editor e = { 0 };
+	load_file(&e, f->path);
+	draw_ui(&e);
+
+	int keys = 0;
+	double worst = 0;
+	double start = now_ns();
+	for (;;) {
+		double key_start = now_ns();
+		int c = screen_key(-1);
+		if (c == KEY_EOF)
+			break;
+		handle_input(&e, c);
+		draw_ui(&e);
+		screen_flush();
+		double ns = now_ns() - key_start;
+		if (ns > worst)
+			worst = ns;
+		keys++;
+	}
+	double ns = (now_ns() - start) / keys;
+
+	emit(name,
+	     "\"rows\": %d, \"cols\": 200, \"keys\": %d, "
+	     "\"ns_per_key\": %.0f, \"max_ns\": %.0f",
+	     rows, keys, ns, worst);
+	buffer_free(e.active_buf);
+}
+
+struct bench_case {
+	const char *name;
+	void (*run)(const char *name, struct bench_file *f, int arg);
+	int file;
+	/* Index in files, -1 if the case makes its own text */
+	int arg;
+};
+
+static const struct bench_case cases[] = {
+	{ "load_read", bench_load, F_SMALL },
+	{ "load_mmap", bench_load, F_BIG },
+	{ "load_crlf", bench_load, F_CRLF },
+	{ "load_huge_line", bench_load, F_HUGE },
+	{ "save_read", bench_save, F_SMALL },
+	{ "save_mmap", bench_save, F_BIG },
+	{ "save_crlf", bench_save, F_CRLF },
+	{ "edit", bench_edits, F_SMALL, 100000 },
+	{ "paste_1mb", bench_paste, F_SMALL, 1 << 20 },
+	{ "search_lines", bench_search, F_BIG },
+	{ "search_huge_line", bench_search, F_HUGE },
+	{ "regex_lines", bench_regex, F_BIG },
+	{ "cx_to_rx", bench_cx_to_rx, F_TABS, 1000000 },
+	{ "mem_typed", bench_mem_typed, -1, 1000000 },
+	{ "mem_loaded", bench_mem_loaded, F_SMALL },
+	{ "long_line_typing", bench_long_line, -1, 100 * 1024 },
+	{ "wide_line_typing", bench_wide_line, -1, 32 * 1024 },
+	{ "huge_line_typing", bench_huge_line, F_HUGE },
+	{ "frame_80x300", bench_frame, F_WIDE, 300 },
+	{ "frame_80x300_tabs", bench_frame, F_TABS, 300 },
+	{ "replay_keys", bench_replay, F_SMALL, 80 },
+};
+
+static int selected(const char *name, int argc, char **argv)
+{
+	if (argc < 2)
+		return 1;
+	for (int i = 1; i < argc; i++)
+		if (strstr(name, argv[i]))
+			return 1;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (!mkdtemp(tmp_dir))
+		die("bench: cannot create temp dir");
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		const struct bench_case *c = &cases[i];
+		if (!selected(c->name, argc, argv))
+			continue;
+
+		struct bench_file *f = NULL;
+		if (c->file >= 0) {
+			f = &files[c->file];
+			if (!f->made) {
+				snprintf(f->path, sizeof(f->path), "%s/%s",
+					 tmp_dir, f->name);
+				f->gen(f->path, f->size);
+				f->made = 1;
+			}
+		}
+
+		/* Own process per case, so peak RSS is the case's own */
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid < 0)
+			die("bench: fork failed");
+		if (pid == 0) {
+			c->run(c->name, f, c->arg);
+			fflush(stdout);
+			_exit(0);
+		}
+		int status;
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			fprintf(stderr, "bench: %s failed\n", c->name);
+	}
+
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+		if (files[i].made)
+			unlink(files[i].path);
+	rmdir(tmp_dir);
+	return 0;
+}
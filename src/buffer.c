@@ -1,31 +1,778 @@
-#include <errno.h>
-#include <stdio.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "kiuru.h"
 #include "util.h"
 
-/* Recalculate line numbers starting from a specific line */
-static void recalculate_linenos(struct line *start_node, int start_num)
+/* Blocks come from the arena's LINE_BLOCK_SIZE class, which is aligned to
+ * its size as long as that is a power of two up to the page size */
+_Static_assert(sizeof(struct line_block) <= LINE_BLOCK_SIZE,
+	       "line block does not fit its alignment");
+_Static_assert(sizeof(struct line) == 16, "inline text made lines bigger");
+
+/* Longest scroll that steps the viewport anchor instead of a lookup */
+#define ANCHOR_STEP_MAX 32
+
+/* Free bytes a new gap buffer starts with */
+#define GAP_MIN 64
+
+/* Files at least this big are mapped instead of read */
+#define MAP_MIN_SIZE (16 * 1024 * 1024)
+
+/* Most bytes and newlines buffer_scan looks at in one round */
+#define SCAN_WINDOW (256 * 1024)
+#define SCAN_BATCH 1024
+/* Lines split per round of idle work, between looks at the clock */
+#define SCAN_IDLE_LINES 4096
+
+/* Gives arena memory back, or holds on to it while a snapshot may still
+ * read it */
+void buffer_drop(struct buffer *b, void *ptr, size_t size)
 {
-	struct line *iter = start_node;
-	int num = start_num;
-	while (iter) {
-		iter->lineno = num++;
-		iter = iter->next;
+	if (!b->snapshots) {
+		xarena_free(&b->arena, ptr, size);
+		return;
+	}
+	if (b->held_count == b->held_cap) {
+		b->held_cap = b->held_cap ? b->held_cap * 2 : 64;
+		b->held = xrealloc(b->held, b->held_cap * sizeof(*b->held));
+	}
+	b->held[b->held_count].ptr = ptr;
+	b->held[b->held_count].size = size;
+	b->held_count++;
+}
+
+/* Gives up the text of a line that is not inline */
+static void line_free_text(struct buffer *b, struct line *l)
+{
+	rx_forget(b, l->data);
+	if (line_chunked(l)) {
+		chunks_free(b, l);
+	} else if (line_gapped(l)) {
+		struct line_gap *g = (struct line_gap *)l->data;
+		xarena_free(&b->arena, g, g->capacity);
+	} else if (l->capacity > 0) {
+		xarena_free(&b->arena, l->data, l->capacity);
+	} else if (l->capacity < 0) {
+		buffer_drop(b, l->data, -l->capacity);
+	}
+}
+
+/* Moves owned text to a bigger arena allocation, read-only text is copied
+ * to the arena on first edit */
+static void line_grow(struct buffer *b, struct line *l, int size)
+{
+	int cap = abs(l->capacity);
+	int new_cap = (cap == 0) ? 16 : cap * 2;
+	while (new_cap < size)
+		new_cap *= 2;
+
+	if (l->capacity > 0) {
+		rx_forget(b, l->data);
+		l->data = xarena_realloc(&b->arena, l->data, l->capacity,
+					 new_cap);
+	} else {
+		char *data = xarena_alloc(&b->arena, new_cap);
+		memcpy(data, l->data, l->size);
+		line_free_text(b, l);
+		l->data = data;
+	}
+	l->capacity = new_cap;
+}
+
+/* Sets line size, keeping the text up to the smaller of the two sizes.
+ * Text moves inline or out of it when the size crosses LINE_INLINE_MAX.
+ * Returns the text, writable unless the line shrank and is read-only.
+ * Chunked and gapped lines can only be resized to 0 */
+static char *line_resize(struct buffer *b, struct line *l, int size)
+{
+	char tmp[LINE_INLINE_MAX];
+
+	if (size <= LINE_INLINE_MAX) {
+		if (l->size > LINE_INLINE_MAX) {
+			/* Inline text overlaps data, copy out first */
+			memcpy(tmp, l->data, size);
+			line_free_text(b, l);
+			memcpy(l->text, tmp, size);
+		}
+		l->size = size;
+		return l->text;
+	}
+
+	if (l->size <= LINE_INLINE_MAX) {
+		int old = l->size;
+		memcpy(tmp, l->text, old);
+		l->capacity = 16;
+		while (l->capacity < size)
+			l->capacity *= 2;
+		l->data = xarena_alloc(&b->arena, l->capacity);
+		memcpy(l->data, tmp, old);
+	} else if (size > l->size && size > l->capacity) {
+		/* Shrinking read-only text keeps sharing it, owned text never
+		 * shrinks below its capacity */
+		line_grow(b, l, size);
+	}
+	l->size = size;
+	return l->data;
+}
+
+/* Returns line text made writable */
+static char *line_writable(struct buffer *b, struct line *l)
+{
+	if (l->size > LINE_INLINE_MAX && l->capacity <= 0)
+		line_grow(b, l, l->size);
+	return line_text(l);
+}
+
+/* Gives owned line text back to the arena */
+static void line_release(struct buffer *b, struct line *l)
+{
+	line_resize(b, l, 0);
+}
+
+/* Sets text of an empty line. Short text is copied inline, shared text is
+ * pointed to and the rest copied to the arena */
+static void line_set(struct buffer *b, struct line *l, char *text, int size,
+		     int shared)
+{
+	if (size <= LINE_INLINE_MAX || !shared) {
+		memcpy(line_resize(b, l, size), text, size);
+	} else {
+		l->data = text;
+		l->capacity = 0;
+		l->size = size;
 	}
 }
 
-/* Free a single line and its data */
-static void line_free(struct line *l)
+/* Copies n bytes of line text from byte off to out */
+void line_read(struct line *l, int off, int n, char *out)
 {
-	if (l) {
-		if (l->data)
-			free(l->data);
-		free(l);
+	while (n > 0) {
+		int len;
+		const char *p = line_span(l, off, &len);
+		if (len > n)
+			len = n;
+		memcpy(out, p, len);
+		out += len;
+		off += len;
+		n -= len;
 	}
 }
 
+/* Moves the text of a long line into chunks */
+static void line_chunk(struct buffer *b, struct line *l)
+{
+	struct line old = *l;
+	chunks_make(b, l);
+	rx_update(b, old.data, l, l->size);
+	line_free_text(b, &old);
+}
+
+/* Moves the text of a chunked line that got short back into one piece.
+ * It may be short enough to go inline, so the chunks are read directly
+ * instead of through line_span. The caller moves the rx index */
+static void line_unchunk(struct buffer *b, struct line *l)
+{
+	struct line old = *l;
+	l->size = 0;
+	char *text = line_resize(b, l, old.size);
+	for (int off = 0, len; off < old.size; off += len) {
+		const char *p = chunks_span(&old, off, &len);
+		memcpy(&text[off], p, len);
+	}
+	chunks_free(b, &old);
+}
+
+/* Gap buffer allocation with room for size bytes of text */
+static struct line_gap *gap_alloc(struct buffer *b, int size)
+{
+	int cap = 64;
+	while (cap < (int)sizeof(struct line_gap) + size)
+		cap *= 2;
+
+	struct line_gap *g = xarena_alloc(&b->arena, cap);
+	g->capacity = cap;
+	return g;
+}
+
+/* Moves the text of a plain line longer than LINE_INLINE_MAX to a gap
+ * buffer with the gap at byte at. It is line row of the buffer */
+static void gap_open(struct buffer *b, struct line *l, int row, int at)
+{
+	struct line_gap *g = gap_alloc(b, l->size + GAP_MIN);
+	g->gap = at;
+	g->gap_size = g->capacity - sizeof(*g) - l->size;
+	memcpy(g->text, l->data, at);
+	memcpy(&g->text[at + g->gap_size], &l->data[at], l->size - at);
+
+	struct line old = *l;
+	l->data = (char *)g;
+	l->capacity = LINE_GAPPED;
+	rx_update(b, old.data, l, l->size);
+	line_free_text(b, &old);
+	b->gap_row = row;
+}
+
+/* Moves the gap to byte off, carrying the bytes in between across it */
+static void gap_move(struct line_gap *g, int off)
+{
+	if (off < g->gap)
+		memmove(&g->text[off + g->gap_size], &g->text[off],
+			g->gap - off);
+	else
+		memmove(&g->text[g->gap], &g->text[g->gap + g->gap_size],
+			off - g->gap);
+	g->gap = off;
+}
+
+/* Makes the gap at least n bytes, doubling the allocation */
+static void gap_reserve(struct buffer *b, struct line *l, int n)
+{
+	struct line_gap *g = (struct line_gap *)l->data;
+	if (g->gap_size >= n)
+		return;
+
+	struct line_gap *ng = gap_alloc(b, 2 * (l->size + n));
+	int tail = l->size - g->gap;
+	ng->gap = g->gap;
+	ng->gap_size = ng->capacity - sizeof(*ng) - l->size;
+	memcpy(ng->text, g->text, g->gap);
+	memcpy(&ng->text[ng->gap + ng->gap_size],
+	       &g->text[g->gap + g->gap_size], tail);
+	xarena_free(&b->arena, g, g->capacity);
+	l->data = (char *)ng;
+}
+
+/* Moves the text of a gapped line back into one piece, which may be inline
+ * if the line got short. The caller moves the rx index */
+static void gap_compact(struct buffer *b, struct line *l)
+{
+	struct line_gap *g = (struct line_gap *)l->data;
+	int size = l->size;
+
+	l->size = 0;
+	char *text = line_resize(b, l, size);
+	memcpy(text, g->text, g->gap);
+	memcpy(&text[g->gap], &g->text[g->gap + g->gap_size], size - g->gap);
+	xarena_free(&b->arena, g, g->capacity);
+}
+
+/* Closes the gap of the line typed on last. Called when the cursor leaves
+ * the line or insert mode, and before saving, so only one line at a time
+ * has a gap and it is never in a save's snapshot */
+void buffer_gap_close(struct buffer *b)
+{
+	if (b->gap_row < 0)
+		return;
+	struct line *l = buffer_line(b, b->gap_row);
+	b->gap_row = -1;
+
+	char *old = l->data;
+	gap_compact(b, l);
+	rx_update(b, old, l, l->size);
+}
+
+/* Inserts n bytes of s at byte off. s must not be text of l */
+static void line_insert_text(struct buffer *b, struct line *l, int off,
+			     const char *s, int n)
+{
+	/* Inline text can't be chunked, a long insert into it makes one
+	 * piece that the next edit chunks */
+	if (!line_chunked(l) && l->size > LINE_INLINE_MAX &&
+	    l->size + n > LINE_CHUNK_MIN) {
+		if (line_gapped(l))
+			buffer_gap_close(b);
+		line_chunk(b, l);
+	}
+
+	char *old = line_text(l);
+	if (line_chunked(l)) {
+		chunks_insert(b, l, off, s, n);
+	} else if (line_gapped(l)) {
+		gap_reserve(b, l, n);
+		struct line_gap *g = (struct line_gap *)l->data;
+		gap_move(g, off);
+		memcpy(&g->text[off], s, n);
+		g->gap += n;
+		g->gap_size -= n;
+		l->size += n;
+	} else {
+		char *text = line_resize(b, l, l->size + n);
+		memmove(&text[off + n], &text[off], l->size - n - off);
+		memcpy(&text[off], s, n);
+	}
+	rx_update(b, old, l, off);
+}
+
+/* Removes n bytes from byte off */
+static void line_delete_text(struct buffer *b, struct line *l, int off, int n)
+{
+	/* Shrinking a long line from the file in the middle would copy all
+	 * of it, chunking it only points to it */
+	if (!line_chunked(l) && l->size > LINE_CHUNK_MIN && off + n < l->size)
+		line_chunk(b, l);
+
+	char *old = line_text(l);
+	if (line_chunked(l)) {
+		chunks_delete(b, l, off, n);
+		if (l->size <= LINE_CHUNK_MIN / 4)
+			line_unchunk(b, l);
+	} else if (line_gapped(l)) {
+		struct line_gap *g = (struct line_gap *)l->data;
+		gap_move(g, off + n);
+		g->gap = off;
+		g->gap_size += n;
+		l->size -= n;
+		if (l->size <= LINE_INLINE_MAX) {
+			gap_compact(b, l);
+			b->gap_row = -1;
+		}
+	} else {
+		char *text = (off + n < l->size) ? line_writable(b, l) :
+						   line_text(l);
+		memmove(&text[off], &text[off + n], l->size - off - n);
+		line_resize(b, l, l->size - n);
+	}
+	rx_update(b, old, l, off);
+}
+
+/* Moves the text of l from byte off on to the empty line dst. Text from
+ * the file is shared, chunks are handed over, and the rest is copied */
+static void line_split(struct buffer *b, struct line *l, int off,
+		       struct line *dst)
+{
+	int tail = l->size - off;
+	char *old = line_text(l);
+
+	if (line_chunked(l) && tail > LINE_CHUNK_MIN / 4) {
+		if (off > LINE_CHUNK_MIN / 4) {
+			chunks_split(b, l, off, dst);
+			rx_update(b, old, l, off);
+			return;
+		}
+		/* Short head, dst takes the chunks and l a copy of the head */
+		*dst = *l;
+		l->size = 0;
+		line_read(dst, 0, off, line_resize(b, l, off));
+		chunks_delete(b, dst, 0, off);
+		rx_update(b, old, dst, 0);
+		return;
+	}
+
+	if (line_chunked(l)) {
+		line_read(l, off, tail, line_resize(b, dst, tail));
+	} else {
+		int shared = l->size > LINE_INLINE_MAX && l->capacity == 0;
+		line_set(b, dst, line_text(l) + off, tail, shared);
+	}
+	line_delete_text(b, l, off, tail);
+}
+
+/* Appends the text of src to dst and leaves src empty */
+static void line_join(struct buffer *b, struct line *dst, struct line *src)
+{
+	int size = dst->size;
+
+	/* Long results are chunked, starting from the longer half so a
+	 * short line joined to a huge one costs the short one */
+	if (!line_chunked(dst) && !line_chunked(src) &&
+	    dst->size + src->size > LINE_CHUNK_MIN)
+		line_chunk(b, src->size > dst->size ? src : dst);
+
+	if (line_chunked(dst) && !line_chunked(src) &&
+	    src->size > LINE_CHUNK_MIN)
+		line_chunk(b, src);
+
+	if (line_chunked(dst)) {
+		char *old = dst->data;
+		if (line_chunked(src)) {
+			rx_forget(b, src->data);
+			chunks_append(b, dst, src);
+		} else {
+			chunks_insert(b, dst, size, line_text(src), src->size);
+			line_release(b, src);
+		}
+		rx_update(b, old, dst, size);
+	} else if (line_chunked(src)) {
+		/* dst goes in front of src's chunks, and src's line takes
+		 * its place. The index follows the chunks */
+		line_insert_text(b, src, 0, line_text(dst), dst->size);
+		line_release(b, dst);
+		*dst = *src;
+		src->size = 0;
+	} else {
+		char *old = line_text(dst);
+		char *text = line_resize(b, dst, size + src->size);
+		memcpy(&text[size], line_text(src), src->size);
+		rx_update(b, old, dst, size);
+		line_release(b, src);
+	}
+}
+
+/* Block that holds a line, found from the line's address */
+static struct line_block *line_block_of(struct line *l)
+{
+	return (struct line_block *)((uintptr_t)l &
+				     ~(uintptr_t)(LINE_BLOCK_SIZE - 1));
+}
+
+/* Numbers blocks from index from onwards and rebuilds the Fenwick tree. This
+ * is O(blocks), but only needed when a block is added or removed in the
+ * middle, which is at most once per LINE_BLOCK_MAX / 2 line edits */
+static void reindex_blocks(struct buffer *b, int from)
+{
+	for (int i = from; i < b->block_count; i++)
+		b->blocks[i]->index = i;
+	for (int i = 0; i < b->block_count; i++)
+		b->block_tree[i + 1] = b->blocks[i]->count;
+	fenwick_init(b->block_tree, b->block_count);
+}
+
+/* Makes room for n blocks in the block list and tree */
+static void blocks_reserve(struct buffer *b, int n)
+{
+	if (n <= b->block_cap)
+		return;
+	while (b->block_cap < n)
+		b->block_cap = b->block_cap ? b->block_cap * 2 : 16;
+	b->blocks = xrealloc(b->blocks, b->block_cap * sizeof(*b->blocks));
+	b->block_tree = xrealloc(b->block_tree,
+				 (b->block_cap + 1) * sizeof(int));
+}
+
+/* Adds an empty block to the store at block index i */
+static struct line_block *block_new(struct buffer *b, int i)
+{
+	blocks_reserve(b, b->block_count + 1);
+
+	struct line_block *blk = xarena_alloc(&b->arena, LINE_BLOCK_SIZE);
+	blk->count = 0;
+	blk->gen = b->gen;
+
+	memmove(&b->blocks[i + 1], &b->blocks[i],
+		(b->block_count - i) * sizeof(*b->blocks));
+	b->blocks[i] = blk;
+	b->block_count++;
+
+	if (i == b->block_count - 1) {
+		/* Appending only needs the new tree slot, which covers the
+		 * (n & -n) entries ending at it */
+		int n = b->block_count;
+		blk->index = i;
+		b->block_tree[n] = fenwick_sum(b->block_tree, n - 1) -
+				   fenwick_sum(b->block_tree, n - (n & -n));
+	} else {
+		reindex_blocks(b, i);
+	}
+	return blk;
+}
+
+/* Whether a block may belong to a snapshot still being read */
+static int block_frozen(struct buffer *b, struct line_block *blk)
+{
+	return b->snapshots && blk->gen != b->gen;
+}
+
+/* Copies n lines from block src. Owned text of a frozen block is still
+ * being written, so the copies take it as read-only and chunked lines get
+ * their own chunk table */
+static void lines_copy(struct buffer *b, struct line *dst,
+		       struct line_block *src, int from, int n)
+{
+	memcpy(dst, &src->lines[from], n * sizeof(struct line));
+	if (!block_frozen(b, src))
+		return;
+	for (int i = 0; i < n; i++) {
+		if (line_chunked(&dst[i])) {
+			char *old = dst[i].data;
+			chunks_thaw(b, &dst[i]);
+			rx_update(b, old, &dst[i], dst[i].size);
+		} else if (dst[i].size > LINE_INLINE_MAX &&
+			   dst[i].capacity > 0) {
+			dst[i].capacity = -dst[i].capacity;
+		}
+	}
+}
+
+/* Puts a copy of a frozen block in its place, so the store can change it
+ * while the save reads the original. Returns the block to use */
+static struct line_block *block_thaw(struct buffer *b, struct line_block *blk)
+{
+	if (!block_frozen(b, blk))
+		return blk;
+
+	struct line_block *copy = xarena_alloc(&b->arena, LINE_BLOCK_SIZE);
+	copy->count = blk->count;
+	copy->index = blk->index;
+	copy->gen = b->gen;
+	lines_copy(b, copy->lines, blk, 0, blk->count);
+	b->blocks[blk->index] = copy;
+
+	/* Anchors move to the copy with their lines */
+	if (b->current && line_block_of(b->current) == blk)
+		b->current = &copy->lines[b->current - blk->lines];
+	if (b->top && line_block_of(b->top) == blk)
+		b->top = &copy->lines[b->top - blk->lines];
+
+	buffer_drop(b, blk, LINE_BLOCK_SIZE);
+	return copy;
+}
+
+/* Returns l ready to be changed, which may be in a copy of its block */
+static struct line *line_edit(struct buffer *b, struct line *l)
+{
+	struct line_block *blk = line_block_of(l);
+	return &block_thaw(b, blk)->lines[l - blk->lines];
+}
+
+/* Removes block at index i from the store and frees it */
+static void block_free(struct buffer *b, int i)
+{
+	if (block_frozen(b, b->blocks[i]))
+		buffer_drop(b, b->blocks[i], LINE_BLOCK_SIZE);
+	else
+		xarena_free(&b->arena, b->blocks[i], LINE_BLOCK_SIZE);
+	memmove(&b->blocks[i], &b->blocks[i + 1],
+		(b->block_count - i - 1) * sizeof(*b->blocks));
+	b->block_count--;
+
+	/* Dropping the last block leaves the rest of the tree valid */
+	if (i < b->block_count)
+		reindex_blocks(b, i);
+}
+
+/* Finds block and slot for line n. n may be one past the last line, which
+ * gives the end of the last block */
+static struct line_block *locate(struct buffer *b, int n, int *slot)
+{
+	int k = n;
+	int i = fenwick_find(b->block_tree, b->block_count, &k);
+	if (i == b->block_count) {
+		i = b->block_count - 1;
+		k = b->blocks[i]->count;
+	}
+	*slot = k;
+	return b->blocks[i];
+}
+
+/* Returns line n, or NULL if out of range */
+struct line *buffer_line(struct buffer *b, int n)
+{
+	if (n >= b->line_count)
+		buffer_scan(b, n);
+	if (n < 0 || n >= b->line_count)
+		return NULL;
+
+	int slot;
+	struct line_block *blk = locate(b, n, &slot);
+	return &blk->lines[slot];
+}
+
+/* Returns line nro (0 based) of a line in the store */
+int buffer_lineno(struct buffer *b, struct line *l)
+{
+	struct line_block *blk = line_block_of(l);
+	return fenwick_sum(b->block_tree, blk->index) + (int)(l - blk->lines);
+}
+
+/* Returns the line after l, or NULL after the last line */
+struct line *buffer_next_line(struct buffer *b, struct line *l)
+{
+	struct line_block *blk = line_block_of(l);
+
+	/* Find more lines past the last one. They are appended, so l and its
+	 * block stay where they are */
+	if (blk->index + 1 == b->block_count &&
+	    l + 1 == &blk->lines[blk->count])
+		buffer_scan(b, b->line_count);
+
+	if (l + 1 < &blk->lines[blk->count])
+		return l + 1;
+	if (blk->index + 1 < b->block_count)
+		return &b->blocks[blk->index + 1]->lines[0];
+	return NULL;
+}
+
+/* Returns the line before l, or NULL before the first line */
+struct line *buffer_prev_line(struct buffer *b, struct line *l)
+{
+	struct line_block *blk = line_block_of(l);
+	if (l > blk->lines)
+		return l - 1;
+	if (blk->index > 0) {
+		blk = b->blocks[blk->index - 1];
+		return &blk->lines[blk->count - 1];
+	}
+	return NULL;
+}
+
+/* Sets row_offset and moves the viewport anchor with it. Scrolling by a few
+ * lines steps from the old anchor, bigger jumps look the line up */
+void buffer_scroll(struct buffer *b, int row_offset)
+{
+	int delta = row_offset - b->row_offset;
+
+	if (!b->top || delta > ANCHOR_STEP_MAX || delta < -ANCHOR_STEP_MAX) {
+		b->top = buffer_line(b, row_offset);
+	} else {
+		for (; delta > 0 && b->top; delta--)
+			b->top = buffer_next_line(b, b->top);
+		for (; delta < 0 && b->top; delta++)
+			b->top = buffer_prev_line(b, b->top);
+	}
+	b->row_offset = row_offset;
+}
+
+/* Marks lines from..to as changed, to is INT_MAX when everything after
+ * from moved */
+void buffer_damage(struct buffer *b, int from, int to)
+{
+	if (b->dirty_from > b->dirty_to) {
+		b->dirty_from = from;
+		b->dirty_to = to;
+		return;
+	}
+	if (from < b->dirty_from)
+		b->dirty_from = from;
+	if (to > b->dirty_to)
+		b->dirty_to = to;
+}
+
+/* Lines move inside and between blocks when lines are inserted or removed,
+ * so the cached line pointers are fetched again */
+static void refresh_anchors(struct buffer *b)
+{
+	b->current = buffer_line(b, b->cy);
+	b->top = buffer_line(b, b->row_offset);
+}
+
+/* Opens a slot for an empty line so that it becomes line n. Pointers to
+ * lines after it are invalidated */
+static struct line *line_insert(struct buffer *b, int n)
+{
+	if (b->block_count == 0)
+		block_new(b, 0);
+
+	int slot;
+	struct line_block *blk = block_thaw(b, locate(b, n, &slot));
+
+	if (blk->count == LINE_BLOCK_MAX) {
+		/* Split in half, appending to the last block starts a new
+		 * one so loading fills blocks completely */
+		int keep = (slot == LINE_BLOCK_MAX) ? LINE_BLOCK_MAX :
+						      LINE_BLOCK_MAX / 2;
+		int moved = blk->count - keep;
+		struct line_block *nb = block_new(b, blk->index + 1);
+		lines_copy(b, nb->lines, blk, keep, moved);
+		nb->count = moved;
+		blk->count = keep;
+		fenwick_add(b->block_tree, b->block_count, blk->index, -moved);
+		fenwick_add(b->block_tree, b->block_count, nb->index, moved);
+
+		if (slot >= keep) {
+			blk = nb;
+			slot -= keep;
+		}
+	}
+
+	memmove(&blk->lines[slot + 1], &blk->lines[slot],
+		(blk->count - slot) * sizeof(struct line));
+	blk->count++;
+	b->line_count++;
+	fenwick_add(b->block_tree, b->block_count, blk->index, 1);
+
+	struct line *l = &blk->lines[slot];
+	l->size = 0;
+	return l;
+}
+
+/* Opens count empty lines so that the first becomes line n, like as many
+ * line_insert calls. When they don't fit the block of line n, it is split
+ * there and full blocks of new lines go in between, with one rebuild of
+ * the block index for all of them. Pointers to lines after n are
+ * invalidated */
+static void lines_insert(struct buffer *b, int n, int count)
+{
+	int slot;
+	struct line_block *blk = block_thaw(b, locate(b, n, &slot));
+
+	if (blk->count + count <= LINE_BLOCK_MAX) {
+		memmove(&blk->lines[slot + count], &blk->lines[slot],
+			(blk->count - slot) * sizeof(struct line));
+		for (int i = slot; i < slot + count; i++)
+			blk->lines[i].size = 0;
+		blk->count += count;
+		b->line_count += count;
+		fenwick_add(b->block_tree, b->block_count, blk->index, count);
+		return;
+	}
+
+	/* New blocks go before blk if n is its first line. Otherwise they
+	 * go after it, followed by a block for its lines from n on */
+	int at = blk->index + (slot > 0);
+	int moved = (slot > 0) ? blk->count - slot : 0;
+	int fresh = (count + LINE_BLOCK_MAX - 1) / LINE_BLOCK_MAX;
+	int added = fresh + (moved > 0);
+
+	blocks_reserve(b, b->block_count + added);
+	memmove(&b->blocks[at + added], &b->blocks[at],
+		(b->block_count - at) * sizeof(*b->blocks));
+	b->block_count += added;
+
+	for (int i = 0; i < added; i++) {
+		struct line_block *nb = xarena_alloc(&b->arena, LINE_BLOCK_SIZE);
+		nb->gen = b->gen;
+		if (i == fresh) {
+			lines_copy(b, nb->lines, blk, slot, moved);
+			nb->count = moved;
+			blk->count = slot;
+		} else {
+			nb->count = count - i * (int)LINE_BLOCK_MAX;
+			if (nb->count > (int)LINE_BLOCK_MAX)
+				nb->count = LINE_BLOCK_MAX;
+			for (int j = 0; j < nb->count; j++)
+				nb->lines[j].size = 0;
+		}
+		b->blocks[at + i] = nb;
+	}
+	b->line_count += count;
+	reindex_blocks(b, at);
+}
+
+/* Removes line n from the store. The text is left where it is */
+static void line_remove(struct buffer *b, int n)
+{
+	int slot;
+	struct line_block *blk = block_thaw(b, locate(b, n, &slot));
+	int i = blk->index;
+
+	blk->count--;
+	memmove(&blk->lines[slot], &blk->lines[slot + 1],
+		(blk->count - slot) * sizeof(struct line));
+	b->line_count--;
+	fenwick_add(b->block_tree, b->block_count, i, -1);
+
+	/* Fold into the next block if both are small enough, so deleting
+	 * lots of lines does not leave mostly empty blocks behind */
+	if (i + 1 < b->block_count &&
+	    blk->count + b->blocks[i + 1]->count <= LINE_BLOCK_MAX / 2) {
+		struct line_block *next = b->blocks[i + 1];
+		lines_copy(b, &blk->lines[blk->count], next, 0, next->count);
+		blk->count += next->count;
+		fenwick_add(b->block_tree, b->block_count, i, next->count);
+		fenwick_add(b->block_tree, b->block_count, i + 1,
+			    -next->count);
+		block_free(b, i + 1);
+	}
+
+	if (blk->count == 0 && b->block_count > 1)
+		block_free(b, i);
+}
+
 /* Creates a empty buffer */
 struct buffer *buffer_new(void)
 {
@@ -34,32 +781,79 @@ struct buffer *buffer_new(void)
 	buf->path[0] = '\0';
 
 	/* Initialize with one empty line */
-	struct line *l = xcalloc(1, sizeof(struct line));
-	l->data = xstrdup("");
-	l->size = 0;
-	l->capacity = 0;
-	l->lineno = 1;
-
-	buf->head = buf->tail = buf->current = l;
-	buf->line_count = 1;
+	buf->current = buf->top = line_insert(buf, 0);
+	buf->gap_row = -1;
+	buf->dirty_from = 0;
+	buf->dirty_to = INT_MAX;
 
 	return buf;
 }
 
-/* Frees buffer and it's lines */
+/* Frees buffer, it's lines and text */
 void buffer_free(struct buffer *b)
 {
 	if (!b)
 		return;
-	struct line *iter = b->head;
-	while (iter) {
-		struct line *next = iter->next;
-		line_free(iter);
-		iter = next;
-	}
+	/* Blocks and owned text all live in the arena, so there is no need
+	 * to visit them */
+	arena_release(&b->arena);
+	free(b->blocks);
+	free(b->block_tree);
+	free(b->held);
+	rx_cache_free(b);
+
+	if (b->orig_mapped)
+		munmap(b->orig, b->orig_size);
+	else
+		free(b->orig);
 	free(b);
 }
 
+/* Bytes of memory held by the buffer. Mapped file contents are left out,
+ * those are page cache the kernel can drop */
+size_t buffer_mem_usage(struct buffer *b)
+{
+	size_t bytes = sizeof(*b) + b->arena.used;
+	bytes += b->block_cap * (sizeof(*b->blocks) + sizeof(*b->block_tree));
+	if (!b->orig_mapped)
+		bytes += b->orig_size;
+	return bytes;
+}
+
+/* Takes a snapshot of the current lines for another thread to read.
+ * Blocks and owned text they have are left as they are until
+ * buffer_unfreeze, edits work on copies. Lines appended by buffer_scan go
+ * past the end the snapshot knows about */
+void buffer_freeze(struct buffer *b, struct snapshot *snap)
+{
+	/* A gap moves text in place as it is typed */
+	buffer_gap_close(b);
+
+	snap->line_count = b->line_count;
+	snap->block_count = b->block_count;
+	snap->blocks = xmalloc(b->block_count * sizeof(*snap->blocks));
+	snap->counts = xmalloc(b->block_count * sizeof(*snap->counts));
+	for (int i = 0; i < b->block_count; i++) {
+		snap->blocks[i] = b->blocks[i];
+		snap->counts[i] = b->blocks[i]->count;
+	}
+	b->gen++;
+	b->snapshots++;
+}
+
+/* Called when the reader of snap is done. What snapshots kept alive is
+ * freed after the last one */
+void buffer_unfreeze(struct buffer *b, struct snapshot *snap)
+{
+	free(snap->blocks);
+	free(snap->counts);
+	if (--b->snapshots > 0)
+		return;
+	for (int i = 0; i < b->held_count; i++)
+		xarena_free(&b->arena, b->held[i].ptr, b->held[i].size);
+	b->held_count = 0;
+}
+
 /* Sets active buffer */
 void set_active_buffer(struct editor *e, struct buffer *b)
 {
@@ -67,6 +861,143 @@ void set_active_buffer(struct editor *e, struct buffer *b)
 	e->mode = MODE_NORMAL;
 }
 
+/* Reads the whole file into one allocation */
+static char *read_file(int fd, size_t *size)
+{
+	struct stat sb;
+	size_t cap = 64 * 1024;
+	size_t len = 0;
+
+	/* Size is only a hint, the file may still grow or not be regular */
+	if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode))
+		cap = (size_t)sb.st_size + 1;
+
+	char *data = xmalloc(cap);
+	ssize_t n;
+	while ((n = read(fd, &data[len], cap - len)) > 0) {
+		len += n;
+		if (len == cap) {
+			cap *= 2;
+			data = xrealloc(data, cap);
+		}
+	}
+
+	*size = len;
+	return data;
+}
+
+/* Maps a big regular file read-only. Pages are read in as lines are looked
+ * at, so memory use follows what was touched. Returns NULL if the file is
+ * small or can't be mapped, it is read normally then */
+static char *map_file(int fd, size_t *size)
+{
+	struct stat sb;
+	if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) ||
+	    sb.st_size < MAP_MIN_SIZE)
+		return NULL;
+
+	/* Private mapping of a file someone else truncates can still fault,
+	 * same as in other editors that map files */
+	void *data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	*size = sb.st_size;
+	return data;
+}
+
+/* Adds a line found by buffer_scan after the last line. Fills the last block
+ * directly and leaves the index update to the caller, *pending counts lines
+ * not yet added to it */
+static void scan_append(struct buffer *b, char *start, char *eol, int *pending)
+{
+	struct line_block *blk = b->blocks[b->block_count - 1];
+
+	if (blk->count == LINE_BLOCK_MAX) {
+		fenwick_add(b->block_tree, b->block_count, blk->index,
+			    *pending);
+		*pending = 0;
+		blk = block_new(b, b->block_count);
+	}
+
+	/* Strip newline logic. The first line decides the line ending used
+	 * when saving */
+	char *text_end = eol;
+	while (text_end > start && text_end[-1] == '\r')
+		text_end--;
+	if (b->scanned == 0 && b->line_count == 0)
+		b->crlf = (text_end != eol);
+
+	/* Short lines are copied inline, so they don't keep the file's
+	 * pages around or cost a pointer chase to draw */
+	struct line *l = &blk->lines[blk->count++];
+	l->size = 0;
+	line_set(b, l, start, text_end - start, 1);
+	b->line_count++;
+	(*pending)++;
+}
+
+/* Splits the original contents into lines until line n exists or the whole
+ * file is done. Mapped files are split lazily, lines appear as they are
+ * needed */
+void buffer_scan(struct buffer *b, int n)
+{
+	uint32_t offs[SCAN_BATCH];
+	char *p = b->orig + b->scanned;
+	char *end = b->orig + b->orig_size;
+	int pending = 0;
+
+	if (p < end && b->line_count <= n)
+		buffer_damage(b, b->line_count, INT_MAX);
+
+	/* Lines point straight into the original contents, nothing is copied
+	 * until a line is edited. Edits only happen on lines already found,
+	 * so new lines always go after them */
+	while (p < end && b->line_count <= n) {
+		size_t len = end - p;
+		if (len > SCAN_WINDOW)
+			len = SCAN_WINDOW;
+
+		int found = scan_newlines(p, len, offs, SCAN_BATCH);
+		if (found == 0) {
+			/* Line longer than the window, or the last one */
+			char *nl = memchr(p + len, '\n', end - p - len);
+			char *eol = nl ? nl : end;
+			scan_append(b, p, eol, &pending);
+			p = nl ? nl + 1 : end;
+			b->scanned = p - b->orig;
+			continue;
+		}
+
+		/* A partial line at the end of the window is found again by
+		 * the next round */
+		char *start = p;
+		for (int i = 0; i < found; i++) {
+			scan_append(b, start, p + offs[i], &pending);
+			start = p + offs[i] + 1;
+		}
+		p = start;
+		b->scanned = p - b->orig;
+	}
+
+	struct line_block *last = b->blocks[b->block_count - 1];
+	fenwick_add(b->block_tree, b->block_count, last->index, pending);
+}
+
+/* Idle work that splits mapped files to the end, so the line count is
+ * known and jumps to the end are ready before they are asked for */
+static int scan_idle(struct editor *e, void *data, uint64_t deadline)
+{
+	int more = 0;
+	for (struct buffer *b = e->buf_head; b; b = b->next) {
+		while (b->scanned < b->orig_size && clock_ns() < deadline)
+			buffer_scan(b, b->line_count + SCAN_IDLE_LINES);
+		if (b->scanned < b->orig_size)
+			more = 1;
+	}
+	return more;
+}
+
 /* Loads file to buffer */
 void load_file(struct editor *e, const char *path)
 {
@@ -85,61 +1016,34 @@ void load_file(struct editor *e, const char *path)
 	struct buffer *b = buffer_new();
 	strncpy(b->path, path, sizeof(b->path) - 1);
 
-	FILE *f = fopen(path, "r");
-	if (f) {
+	int fd = open(path, O_RDONLY);
+	if (fd >= 0) {
 		/* Clear the default empty line created in buffer_new */
-		line_free(b->head);
-		b->head = b->tail = b->current = NULL;
-		b->line_count = 0;
-
-		char *line_buf = NULL;
-		size_t cap = 0;
-		ssize_t len;
-
-		while ((len = getline(&line_buf, &cap, f)) != -1) {
-			/* Strip newline logic */
-			while (len > 0 && (line_buf[len - 1] == '\n' ||
-					   line_buf[len - 1] == '\r')) {
-				line_buf[--len] = '\0';
-			}
-
-			/* Create new line node */
-			struct line *l = xcalloc(1, sizeof(struct line));
-			l->data = xstrdup(
-				line_buf); /* xstrdup is safer than taking
-					      ownership of getline buffer */
-			l->size = (size_t)len;
-			l->capacity = l->size;
-			l->lineno = ++b->line_count;
-			l->prev = b->tail;
-
-			if (b->tail)
-				b->tail->next = l;
-			else
-				b->head = l;
-
-			b->tail = l;
+		line_remove(b, 0);
+
+		/* Huge files are mapped and only the first line is found now,
+		 * the rest follows the viewport and idle time */
+		b->orig = map_file(fd, &b->orig_size);
+		if (b->orig) {
+			b->orig_mapped = 1;
+			buffer_scan(b, 0);
+			event_idle(scan_idle, NULL);
+		} else {
+			b->orig = read_file(fd, &b->orig_size);
+			buffer_scan(b, INT_MAX);
 		}
-		free(line_buf);
-		fclose(f);
+		close(fd);
 	}
 
 	/* If file was empty or couldn't open, ensure at least one
 	 * line */
-	if (b->line_count == 0) {
-		/* buffer_new logic handles the struct, but we cleared it above,
-		 * so re-add */
-		struct line *l = xcalloc(1, sizeof(struct line));
-		l->data = xstrdup("");
-		l->lineno = 1;
-		b->head = b->tail = l;
-		b->line_count = 1;
-	}
+	if (b->line_count == 0)
+		line_insert(b, 0);
 
 	/* Reset the cursor */
-	b->current = b->head;
 	b->cx = 0;
 	b->cy = 0;
+	refresh_anchors(b);
 
 	/* Link to editor */
 	if (!e->buf_head) {
@@ -155,175 +1059,167 @@ void load_file(struct editor *e, const char *path)
 	set_active_buffer(e, b);
 }
 
-void save_file(struct editor *e)
+/* Returns the cursor's line ready to be changed. Typing goes into a gap at
+ * the cursor, except on lines short enough to be inline or long enough to
+ * be chunked. A gap left on another line is closed first */
+static struct line *line_at_cursor(struct buffer *b)
 {
-	struct buffer *b = e->active_buf;
-	if (!b->path[0])
-		return; /* Ignore no name, TODO: ask for filename and the save
-			 */
-
-	FILE *f = fopen(b->path, "w");
-	if (!f) {
-		set_message(e, "Err: %s", strerror(errno));
-		return;
-	}
-
-	struct line *curr = b->head;
-	long bytes = 0;
-	while (curr) {
-		if (curr->data) {
-			fprintf(f, "%s", curr->data);
-			bytes += curr->size;
-		}
-		/* Always write newline (POSIX standard). TODO: Support CRLF for
-		 * windows */
-		fprintf(f, "\n");
-		bytes++;
-		curr = curr->next;
-	}
+	if (b->gap_row != b->cy)
+		buffer_gap_close(b);
 
-	fclose(f);
-	set_message(e, "\"%s\" %ldL, %ldB written", b->path, b->line_count,
-		    bytes);
+	struct line *l = line_edit(b, b->current);
+	if (!line_gapped(l) && !line_chunked(l) &&
+	    l->size > LINE_INLINE_MAX + 1 && l->size < LINE_CHUNK_MIN)
+		gap_open(b, l, b->cy, b->cx);
+	return l;
 }
 
 /* Insert new char to cursor pos */
 void insert_char(struct editor *e, int c)
 {
-	struct line *l = e->active_buf->current;
-	if (!l)
+	struct buffer *b = e->active_buf;
+	if (!b->current)
 		return;
+	struct line *l = line_at_cursor(b);
 
-	/* Grow capacity if needed */
-	if (l->size + 1 >= l->capacity) {
-		size_t new_cap = (l->capacity == 0) ? 16 : l->capacity * 2;
-		l->data = xrealloc(l->data, new_cap);
-		l->capacity = new_cap;
-	}
-
-	/* Shift text right to make room */
-	memmove(&l->data[e->active_buf->cx + 1], &l->data[e->active_buf->cx],
-		l->size - e->active_buf->cx);
+	char ch = (char)c;
+	line_insert_text(b, l, b->cx, &ch, 1);
+	buffer_damage(b, b->cy, b->cy);
 
-	l->data[e->active_buf->cx] = (char)c;
-	l->size++;
-	l->data[l->size] = '\0';
-
-	e->active_buf->cx++;
+	b->cx++;
 }
 
 /* Creates empty line with newline */
 void insert_newline(struct editor *e)
 {
 	struct buffer *b = e->active_buf;
-	struct line *l = b->current;
-	if (!l)
+	if (!b->current)
 		return;
 
-	struct line *new_line = xcalloc(1, sizeof(struct line));
-
-	/* Split text: Copy from cursor to end into new line */
-	new_line->data = xstrdup(&l->data[b->cx]);
-	new_line->size = strlen(new_line->data);
-	new_line->capacity = new_line->size + 1; /* +1 for safety/null */
-
-	/* Truncate current line */
-	l->data[b->cx] = '\0';
-	l->size = b->cx;
-
-	/* Link new node */
-	new_line->next = l->next;
-	new_line->prev = l;
-	if (l->next)
-		l->next->prev = new_line;
-	else
-		b->tail = new_line;
-	l->next = new_line;
+	/* Link new line first, it may move the current one. Then split text:
+	 * text from cursor to end goes to the new line */
+	buffer_gap_close(b);
+	line_insert(b, b->cy + 1);
+	struct line *l = line_edit(b, buffer_line(b, b->cy));
+	line_split(b, l, b->cx, buffer_line(b, b->cy + 1));
+	buffer_damage(b, b->cy, INT_MAX);
 
 	/* Update buffer state */
-	b->line_count++;
-	b->current = new_line;
 	b->cx = 0;
 	b->cy++;
+	refresh_anchors(b);
+}
 
-	/* Fix line numbers from here downwards */
-	recalculate_linenos(new_line, l->lineno + 1);
+/* Length of the line of text at p, up to a newline or end. A CR before
+ * the newline is not part of it */
+static int text_line_len(const char *p, const char *end, const char **nl)
+{
+	*nl = memchr(p, '\n', end - p);
+	if (!*nl)
+		return end - p;
+	int n = *nl - p;
+	return (n > 0 && p[n - 1] == '\r') ? n - 1 : n;
+}
+
+/* Inserts len bytes of text at the cursor, each newline in it starting a
+ * new line. Pastes come through here instead of key by key: all the new
+ * lines are opened at once and filled in one pass over the text */
+void insert_text(struct editor *e, const char *s, size_t len)
+{
+	struct buffer *b = e->active_buf;
+	if (!b->current || len == 0)
+		return;
+
+	const char *end = s + len;
+	int breaks = 0;
+	for (const char *p = s; (p = memchr(p, '\n', end - p)); p++)
+		breaks++;
+
+	const char *nl;
+	int n = text_line_len(s, end, &nl);
+	if (breaks == 0) {
+		struct line *l = line_at_cursor(b);
+		line_insert_text(b, l, b->cx, s, n);
+		buffer_damage(b, b->cy, b->cy);
+		b->cx += n;
+		return;
+	}
+
+	/* Text from the cursor on moves to the last new line, and the first
+	 * line of the paste takes its place */
+	buffer_gap_close(b);
+	lines_insert(b, b->cy + 1, breaks);
+	struct line *l = line_edit(b, buffer_line(b, b->cy));
+	struct line *last = buffer_line(b, b->cy + breaks);
+	line_split(b, l, b->cx, last);
+	line_insert_text(b, l, b->cx, s, n);
+
+	/* New lines are next to each other in fresh blocks, so stepping to
+	 * the next one is cheap */
+	const char *p = nl + 1;
+	for (int i = 1; i < breaks; i++) {
+		l = buffer_next_line(b, l);
+		n = text_line_len(p, end, &nl);
+		line_set(b, l, (char *)p, n, 0);
+		p = nl + 1;
+	}
+
+	n = end - p;
+	if (n > 0)
+		line_insert_text(b, last, 0, p, n);
+	buffer_damage(b, b->cy, INT_MAX);
+
+	b->cy += breaks;
+	b->cx = n;
+	refresh_anchors(b);
 }
 
 /* Deletes a character on line on cursor pos. Backspace/DEL */
 void delete_char(struct editor *e, int backspace)
 {
 	struct buffer *b = e->active_buf;
-	struct line *l = b->current;
-	if (!l)
+	if (!b->current)
 		return;
+	struct line *l = line_edit(b, b->current);
 
 	/* If and backspace at start of line (merge with previous) */
 	if (backspace && b->cx == 0) {
-		if (!l->prev)
-			return; /* Ignore if on head*/
-
-		struct line *prev = l->prev;
-		size_t old_prev_len = prev->size;
-
-		/* Grow prev buffer to hold current line's data */
-		prev->data = xrealloc(prev->data, prev->size + l->size + 1);
-		prev->capacity = prev->size + l->size + 1;
-
-		/* Append current line data to prev */
-		memcpy(&prev->data[prev->size], l->data, l->size);
-		prev->size += l->size;
-		prev->data[prev->size] = '\0';
+		if (b->cy == 0)
+			return; /* Ignore if on first line */
 
-		/* Unlink 'l' (the line is now deleted/empty) */
-		prev->next = l->next;
-		if (l->next)
-			l->next->prev = prev;
-		else
-			b->tail = prev;
+		/* l stays put, it is in a block already safe to change */
+		buffer_gap_close(b);
+		struct line *prev = line_edit(b, buffer_line(b, b->cy - 1));
+		int old_prev_len = prev->size;
 
-		line_free(l);
+		/* Append current line's text to prev, then remove 'l' (the
+		 * line is now deleted/empty) */
+		line_join(b, prev, l);
+		line_remove(b, b->cy);
 
 		/* Update buffer state */
-		b->current = prev;
-		b->cx = old_prev_len;
 		b->cy--;
-		b->line_count--;
-
-		recalculate_linenos(prev->next, prev->lineno + 1);
+		b->cx = old_prev_len;
+		buffer_damage(b, b->cy, INT_MAX);
+		refresh_anchors(b);
 		return;
 	}
 
 	/* If delete and at end of line (merge with next) */
 	if (!backspace && b->cx == l->size) {
-		if (!l->next)
-			return; /*Ignrore if tail */
-
-		struct line *next = l->next;
-
-		/* Grow current buffer to hold next line's data */
-		char *new_data = xrealloc(l->data, l->size + next->size + 1);
-		l->data = new_data;
-		l->capacity = l->size + next->size + 1;
+		struct line *next = buffer_line(b, b->cy + 1);
+		if (!next)
+			return; /* Ignore if last line */
+		buffer_gap_close(b);
+		next = line_edit(b, next);
 
-		/* Append next line data to current */
-		memcpy(&l->data[l->size], next->data, next->size);
-		l->size += next->size;
-		l->data[l->size] = '\0';
-
-		/* Unlink 'next' */
-		l->next = next->next;
-		if (next->next)
-			next->next->prev = l;
-		else
-			b->tail = l;
-
-		line_free(next);
+		/* Append next line's text, then remove 'next' */
+		line_join(b, l, next);
+		line_remove(b, b->cy + 1);
 
 		/* Update buffer */
-		b->line_count--;
-
-		recalculate_linenos(l->next, l->lineno + 1);
+		buffer_damage(b, b->cy, INT_MAX);
+		refresh_anchors(b);
 		return;
 	}
 
@@ -336,11 +1232,9 @@ void delete_char(struct editor *e, int backspace)
 	if (!backspace && b->cx >= l->size)
 		return;
 
-	/* Shift left */
-	memmove(&l->data[char_pos], &l->data[char_pos + 1], l->size - char_pos);
-
-	l->size--;
-	l->data[l->size] = '\0';
+	l = line_at_cursor(b);
+	line_delete_text(b, l, char_pos, 1);
+	buffer_damage(b, b->cy, b->cy);
 
 	if (backspace)
 		b->cx--;
@@ -0,0 +1,358 @@
+#include <stdlib.h>
+#include <string.h>
+#include "kiuru.h"
+#include "util.h"
+
+/*
+ * Chunked lines. A line longer than LINE_CHUNK_MIN, like a minified file or
+ * a JSON dump on one line, is split into chunks of at most CHUNK_SIZE bytes
+ * when it is first edited. A Fenwick tree over the chunk sizes finds the
+ * chunk of a byte offset, so an edit only moves bytes inside one chunk
+ * instead of the whole tail of the line. Render columns are found through
+ * the line's rx index like for any long line, see rx.c.
+ *
+ * Chunk text follows the rules of line text: read-only chunks point into the
+ * original file contents, owned chunks come from the arena, and chunks a
+ * save is still writing are copied on first edit. Splitting a line from the
+ * file takes no copies, the chunks point into it.
+ */
+
+/* Owned chunks are allocated this big, full chunks are split in half */
+#define CHUNK_SIZE (16 * 1024)
+/* Chunks are made this full, so typing has room before a split */
+#define CHUNK_FILL (CHUNK_SIZE / 2)
+/* Neighbouring chunks are merged when both fit in this */
+#define CHUNK_MERGE_MAX (CHUNK_SIZE / 2)
+
+static struct line_chunks *chunks_of(struct line *l)
+{
+	return (struct line_chunks *)l->data;
+}
+
+static struct line_chunks *table_new(struct buffer *b)
+{
+	struct line_chunks *lc = xarena_alloc(&b->arena, sizeof(*lc));
+	memset(lc, 0, sizeof(*lc));
+	return lc;
+}
+
+/* Makes room for count chunks */
+static void table_reserve(struct buffer *b, struct line_chunks *lc, int count)
+{
+	if (count <= lc->cap)
+		return;
+	int cap = lc->cap ? lc->cap : 16;
+	while (cap < count)
+		cap *= 2;
+
+	lc->chunks = xarena_realloc(&b->arena, lc->chunks,
+				    lc->cap * sizeof(*lc->chunks),
+				    cap * sizeof(*lc->chunks));
+	lc->tree = xarena_realloc(&b->arena, lc->tree,
+				  lc->cap ? (lc->cap + 1) * sizeof(int) : 0,
+				  (cap + 1) * sizeof(int));
+	lc->cap = cap;
+}
+
+/* Gives the table itself back, not the chunk text */
+static void table_free(struct buffer *b, struct line_chunks *lc)
+{
+	if (lc->cap) {
+		xarena_free(&b->arena, lc->chunks,
+			    lc->cap * sizeof(*lc->chunks));
+		xarena_free(&b->arena, lc->tree, (lc->cap + 1) * sizeof(int));
+	}
+	xarena_free(&b->arena, lc, sizeof(*lc));
+}
+
+/* Rebuilds the tree after chunks were added or removed, O(chunks) */
+static void reindex(struct line_chunks *lc)
+{
+	for (int i = 0; i < lc->count; i++)
+		lc->tree[i + 1] = lc->chunks[i].size;
+	fenwick_init(lc->tree, lc->count);
+}
+
+/* Finds the chunk holding byte *off and leaves the offset inside it in
+ * *off. The end of the line gives the end of the last chunk */
+static int chunk_at(struct line_chunks *lc, int *off)
+{
+	int i = fenwick_find(lc->tree, lc->count, off);
+	if (i == lc->count) {
+		i = lc->count - 1;
+		*off = lc->chunks[i].size;
+	}
+	return i;
+}
+
+static void chunk_free_text(struct buffer *b, struct text_chunk *c)
+{
+	if (c->capacity > 0)
+		xarena_free(&b->arena, c->data, c->capacity);
+	else if (c->capacity < 0)
+		buffer_drop(b, c->data, -c->capacity);
+}
+
+/* Returns chunk text made writable, read-only text is copied on first
+ * edit */
+static char *chunk_writable(struct buffer *b, struct text_chunk *c)
+{
+	if (c->capacity <= 0) {
+		char *data = xarena_alloc(&b->arena, CHUNK_SIZE);
+		memcpy(data, c->data, c->size);
+		chunk_free_text(b, c);
+		c->data = data;
+		c->capacity = CHUNK_SIZE;
+	}
+	return c->data;
+}
+
+/* Splits chunk i at byte keep, the rest becomes chunk i + 1. Read-only
+ * halves keep pointing to the same text */
+static void chunk_split(struct buffer *b, struct line_chunks *lc, int i,
+			int keep)
+{
+	table_reserve(b, lc, lc->count + 1);
+	memmove(&lc->chunks[i + 2], &lc->chunks[i + 1],
+		(lc->count - i - 1) * sizeof(*lc->chunks));
+	lc->count++;
+
+	struct text_chunk *c = &lc->chunks[i];
+	struct text_chunk *right = &lc->chunks[i + 1];
+	right->size = c->size - keep;
+	if (c->capacity == 0) {
+		right->data = c->data + keep;
+		right->capacity = 0;
+	} else {
+		right->data = xarena_alloc(&b->arena, CHUNK_SIZE);
+		right->capacity = CHUNK_SIZE;
+		memcpy(right->data, c->data + keep, right->size);
+	}
+	c->size = keep;
+	reindex(lc);
+}
+
+/* Appends chunk i + 1 to chunk i */
+static void chunk_merge(struct buffer *b, struct line_chunks *lc, int i)
+{
+	struct text_chunk *c = &lc->chunks[i];
+	struct text_chunk *next = &lc->chunks[i + 1];
+
+	memcpy(chunk_writable(b, c) + c->size, next->data, next->size);
+	c->size += next->size;
+	chunk_free_text(b, next);
+	memmove(next, next + 1, (lc->count - i - 2) * sizeof(*lc->chunks));
+	lc->count--;
+	reindex(lc);
+}
+
+/* Text from byte off to the end of its chunk */
+const char *chunks_span(struct line *l, int off, int *len)
+{
+	struct line_chunks *lc = chunks_of(l);
+	int i = chunk_at(lc, &off);
+	*len = lc->chunks[i].size - off;
+	return lc->chunks[i].data + off;
+}
+
+/* Turns the text of a line longer than LINE_INLINE_MAX into chunks. Text
+ * from the file is pointed to, other text is copied and left for the
+ * caller to free */
+void chunks_make(struct buffer *b, struct line *l)
+{
+	struct line_chunks *lc = table_new(b);
+	int shared = l->capacity == 0;
+
+	table_reserve(b, lc, (l->size + CHUNK_FILL - 1) / CHUNK_FILL);
+	for (int off = 0; off < l->size; off += CHUNK_FILL) {
+		struct text_chunk *c = &lc->chunks[lc->count++];
+		c->size = l->size - off;
+		if (c->size > CHUNK_FILL)
+			c->size = CHUNK_FILL;
+		if (shared) {
+			c->data = l->data + off;
+			c->capacity = 0;
+		} else {
+			c->data = xarena_alloc(&b->arena, CHUNK_SIZE);
+			c->capacity = CHUNK_SIZE;
+			memcpy(c->data, l->data + off, c->size);
+		}
+	}
+	reindex(lc);
+
+	l->data = (char *)lc;
+	l->capacity = LINE_CHUNKED;
+}
+
+/* Inserts n bytes of s at byte off of a chunked line */
+void chunks_insert(struct buffer *b, struct line *l, int off, const char *s,
+		   int n)
+{
+	struct line_chunks *lc = chunks_of(l);
+
+	l->size += n;
+	while (n > 0) {
+		int k = off;
+		int i = chunk_at(lc, &k);
+		struct text_chunk *c = &lc->chunks[i];
+		if (c->size == CHUNK_SIZE) {
+			chunk_split(b, lc, i, CHUNK_SIZE / 2);
+			continue;
+		}
+
+		int take = CHUNK_SIZE - c->size;
+		if (take > n)
+			take = n;
+		char *data = chunk_writable(b, c);
+		memmove(&data[k + take], &data[k], c->size - k);
+		memcpy(&data[k], s, take);
+		c->size += take;
+		fenwick_add(lc->tree, lc->count, i, take);
+
+		off += take;
+		s += take;
+		n -= take;
+	}
+}
+
+/* Removes n bytes from byte off of a chunked line. Chunks that become
+ * empty are dropped, small neighbours merged */
+void chunks_delete(struct buffer *b, struct line *l, int off, int n)
+{
+	struct line_chunks *lc = chunks_of(l);
+	int k = off;
+	int first = chunk_at(lc, &k);
+	int i = first;
+	int gone = 0;
+
+	l->size -= n;
+	while (n > 0) {
+		struct text_chunk *c = &lc->chunks[i];
+		int take = c->size - k;
+		if (take > n)
+			take = n;
+
+		if (take == c->size) {
+			chunk_free_text(b, c);
+			c->size = 0;
+			gone++;
+		} else if (c->capacity == 0 && k == 0) {
+			/* Read-only text is cut from either end in place */
+			c->data += take;
+			c->size -= take;
+		} else if (c->capacity == 0 && k + take == c->size) {
+			c->size -= take;
+		} else {
+			char *data = chunk_writable(b, c);
+			memmove(&data[k], &data[k + take], c->size - k - take);
+			c->size -= take;
+		}
+		fenwick_add(lc->tree, lc->count, i, -take);
+		n -= take;
+		k = 0;
+		i++;
+	}
+
+	if (gone) {
+		/* Emptied chunks are all in first..i, drop them at once */
+		int to = first;
+		for (int j = first; j < lc->count; j++)
+			if (j >= i || lc->chunks[j].size > 0)
+				lc->chunks[to++] = lc->chunks[j];
+		lc->count = to;
+		reindex(lc);
+	}
+
+	if (first >= lc->count)
+		first = lc->count - 1;
+	if (first + 1 < lc->count &&
+	    lc->chunks[first].size + lc->chunks[first + 1].size <=
+		    CHUNK_MERGE_MAX)
+		chunk_merge(b, lc, first);
+	else if (first > 0 &&
+		 lc->chunks[first - 1].size + lc->chunks[first].size <=
+			 CHUNK_MERGE_MAX)
+		chunk_merge(b, lc, first - 1);
+}
+
+/* Moves the text of a chunked line from byte off on to the empty line dst,
+ * which becomes chunked. Costs O(chunks), no text is copied but for one
+ * chunk split at off */
+void chunks_split(struct buffer *b, struct line *l, int off, struct line *dst)
+{
+	struct line_chunks *lc = chunks_of(l);
+	int k = off;
+	int i = chunk_at(lc, &k);
+	if (k == lc->chunks[i].size) {
+		i++;
+	} else if (k > 0) {
+		chunk_split(b, lc, i, k);
+		i++;
+	}
+
+	struct line_chunks *tail = table_new(b);
+	table_reserve(b, tail, lc->count - i);
+	memcpy(tail->chunks, &lc->chunks[i],
+	       (lc->count - i) * sizeof(*lc->chunks));
+	tail->count = lc->count - i;
+	lc->count = i;
+	reindex(lc);
+	reindex(tail);
+
+	dst->data = (char *)tail;
+	dst->capacity = LINE_CHUNKED;
+	dst->size = l->size - off;
+	l->size = off;
+}
+
+/* Moves all chunks of src to the end of dst, both chunked. src is left
+ * empty */
+void chunks_append(struct buffer *b, struct line *dst, struct line *src)
+{
+	struct line_chunks *lc = chunks_of(dst);
+	struct line_chunks *from = chunks_of(src);
+
+	table_reserve(b, lc, lc->count + from->count);
+	memcpy(&lc->chunks[lc->count], from->chunks,
+	       from->count * sizeof(*lc->chunks));
+	lc->count += from->count;
+	reindex(lc);
+	dst->size += src->size;
+
+	table_free(b, from);
+	src->size = 0;
+}
+
+/* Gives a line copied out of a frozen block its own table. The save still
+ * reads the old one and its chunks, so owned chunks become copy on write
+ * and the old table is held until the save is done */
+void chunks_thaw(struct buffer *b, struct line *l)
+{
+	struct line_chunks *old = chunks_of(l);
+	struct line_chunks *lc = table_new(b);
+
+	table_reserve(b, lc, old->count);
+	lc->count = old->count;
+	for (int i = 0; i < lc->count; i++) {
+		lc->chunks[i] = old->chunks[i];
+		if (lc->chunks[i].capacity > 0)
+			lc->chunks[i].capacity = -lc->chunks[i].capacity;
+	}
+	reindex(lc);
+	l->data = (char *)lc;
+
+	if (old->cap) {
+		buffer_drop(b, old->chunks, old->cap * sizeof(*old->chunks));
+		buffer_drop(b, old->tree, (old->cap + 1) * sizeof(int));
+	}
+	buffer_drop(b, old, sizeof(*old));
+}
+
+/* Gives the chunks and table of a line back */
+void chunks_free(struct buffer *b, struct line *l)
+{
+	struct line_chunks *lc = chunks_of(l);
+	for (int i = 0; i < lc->count; i++)
+		chunk_free_text(b, &lc->chunks[i]);
+	table_free(b, lc);
+}
@@ -0,0 +1,323 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "kiuru.h"
+#include "screen.h"
+
+/*
+ * Event loop. The main loop waits here for the next key, and meanwhile
+ * wakes up for signals, timers and fds that worker threads write to when
+ * they are done. While no key is waiting, idle work runs in slices short
+ * enough that a key is never held up by more than one.
+ *
+ * Signals are turned into bytes on a pipe, so their handlers run in the
+ * main loop like everything else instead of inside the signal handler.
+ */
+
+/* Longest an idle task runs before keys are looked at again */
+#define IDLE_SLICE_NS 1000000
+/* Most signals that can have a handler at once */
+#define EVENT_SIGNALS_MAX 8
+
+struct event_watch {
+	int fd;
+	event_fn fn;
+	void *data;
+};
+
+struct event_timer {
+	int id;
+	uint64_t deadline;
+	/* Time it fires next, in clock_ns */
+	uint64_t interval;
+	/* Time between firings, 0 if it fires once */
+	event_fn fn;
+	void *data;
+};
+
+struct event_idle {
+	idle_fn fn;
+	void *data;
+};
+
+struct event_signal {
+	int sig;
+	event_fn fn;
+	void *data;
+	/* Handler before ours */
+	struct sigaction old;
+	/* old is called too, only for SIGWINCH so ncurses sees resizes */
+	int chain;
+};
+
+static struct event_watch *watches;
+static int watch_count;
+
+static struct event_timer *timers;
+static int timer_count;
+static int timer_last_id;
+
+static struct event_idle *idles;
+static int idle_count;
+
+static struct event_signal signals[EVENT_SIGNALS_MAX];
+static int signal_count;
+/* Self-pipe the signal handler writes signal numbers to */
+static int signal_pipe[2] = { -1, -1 };
+
+/* What poll waits on: the terminal, the signal pipe, then the watches */
+static struct pollfd *pfds;
+static int pfd_cap;
+
+/* Calls fn in the main loop whenever fd is readable, until
+ * event_unwatch. fn has to read what is there, or it is called again
+ * right away */
+void event_watch(int fd, event_fn fn, void *data)
+{
+	watches = xrealloc(watches, (watch_count + 1) * sizeof(*watches));
+	watches[watch_count++] = (struct event_watch){ fd, fn, data };
+}
+
+void event_unwatch(int fd)
+{
+	for (int i = 0; i < watch_count; i++) {
+		if (watches[i].fd == fd) {
+			watches[i] = watches[--watch_count];
+			return;
+		}
+	}
+}
+
+/* Calls fn in ms from now, and every ms after that if repeat is set.
+ * Returns an id for event_timer_cancel, never 0 */
+int event_timer(int ms, int repeat, event_fn fn, void *data)
+{
+	uint64_t interval = (uint64_t)(ms > 0 ? ms : 1) * 1000000;
+	timers = xrealloc(timers, (timer_count + 1) * sizeof(*timers));
+	timers[timer_count++] = (struct event_timer){
+		.id = ++timer_last_id,
+		.deadline = clock_ns() + interval,
+		.interval = repeat ? interval : 0,
+		.fn = fn,
+		.data = data,
+	};
+	return timer_last_id;
+}
+
+void event_timer_cancel(int id)
+{
+	for (int i = 0; i < timer_count; i++) {
+		if (timers[i].id == id) {
+			timers[i] = timers[--timer_count];
+			return;
+		}
+	}
+}
+
+/* Queues idle work, unless the same fn and data are queued already. It
+ * runs while no key is waiting until it returns 0 */
+void event_idle(idle_fn fn, void *data)
+{
+	for (int i = 0; i < idle_count; i++)
+		if (idles[i].fn == fn && idles[i].data == data)
+			return;
+	idles = xrealloc(idles, (idle_count + 1) * sizeof(*idles));
+	idles[idle_count++] = (struct event_idle){ fn, data };
+}
+
+static void signal_handler(int sig, siginfo_t *info, void *ctx)
+{
+	int saved = errno;
+	unsigned char byte = sig;
+	/* A full pipe already has a wakeup in it */
+	(void)write(signal_pipe[1], &byte, 1);
+
+	for (int i = 0; i < signal_count; i++) {
+		struct sigaction *old = &signals[i].old;
+		if (signals[i].sig != sig || !signals[i].chain)
+			continue;
+		if (old->sa_flags & SA_SIGINFO)
+			old->sa_sigaction(sig, info, ctx);
+		else if (old->sa_handler != SIG_DFL &&
+			 old->sa_handler != SIG_IGN)
+			old->sa_handler(sig);
+	}
+	errno = saved;
+}
+
+/* Calls fn in the main loop after sig comes in. The handler set before
+ * for SIGWINCH still runs too, ncurses reads the new size in it. Others
+ * are not called: the ones ncurses has for SIGTERM and SIGHUP exit right
+ * in the handler, and fn would never run */
+void event_signal(int sig, event_fn fn, void *data)
+{
+	if (signal_count == EVENT_SIGNALS_MAX)
+		die("Too many signal handlers");
+	if (signal_pipe[0] < 0) {
+		if (pipe(signal_pipe) < 0)
+			die("Cannot create signal pipe");
+		for (int i = 0; i < 2; i++) {
+			fcntl(signal_pipe[i], F_SETFL, O_NONBLOCK);
+			fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC);
+		}
+	}
+
+	struct event_signal *s = &signals[signal_count++];
+	s->sig = sig;
+	s->fn = fn;
+	s->data = data;
+	s->chain = sig == SIGWINCH;
+
+	struct sigaction sa = { 0 };
+	sa.sa_sigaction = signal_handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(sig, &sa, &s->old);
+}
+
+/* Runs the handlers of signals that came in. Returns 1 if any ran */
+static int run_signals(struct editor *e)
+{
+	unsigned char sigs[64];
+	ssize_t n;
+	int ran = 0;
+
+	while ((n = read(signal_pipe[0], sigs, sizeof(sigs))) > 0) {
+		for (ssize_t i = 0; i < n; i++) {
+			for (int j = 0; j < signal_count; j++) {
+				if (signals[j].sig == sigs[i]) {
+					signals[j].fn(e, signals[j].data);
+					ran = 1;
+				}
+			}
+		}
+	}
+	return ran;
+}
+
+/* Runs timers that are due. A timer may cancel or add others, so the
+ * list is looked at again after each. Returns 1 if any ran */
+static int run_timers(struct editor *e)
+{
+	int ran = 0;
+	uint64_t now = clock_ns();
+
+	for (int i = 0; i < timer_count; i++) {
+		if (timers[i].deadline > now)
+			continue;
+		struct event_timer t = timers[i];
+		if (t.interval) {
+			timers[i].deadline = now + t.interval;
+		} else {
+			timers[i] = timers[--timer_count];
+		}
+		t.fn(e, t.data);
+		ran = 1;
+		i = -1;
+	}
+	return ran;
+}
+
+/* Ms until the next timer is due, -1 if there are none */
+static int timer_wait_ms(void)
+{
+	if (timer_count == 0)
+		return -1;
+	uint64_t now = clock_ns();
+	uint64_t next = timers[0].deadline;
+	for (int i = 1; i < timer_count; i++)
+		if (timers[i].deadline < next)
+			next = timers[i].deadline;
+	if (next <= now)
+		return 0;
+	/* Rounded up, so the timer is due when poll returns */
+	return (next - now + 999999) / 1000000;
+}
+
+/* Runs the first idle task for one slice. Returns 1 if it finished */
+static int run_idle(struct editor *e)
+{
+	struct event_idle task = idles[0];
+	if (task.fn(e, task.data, clock_ns() + IDLE_SLICE_NS))
+		return 0;
+
+	for (int i = 0; i < idle_count; i++) {
+		if (idles[i].fn == task.fn && idles[i].data == task.data) {
+			memmove(&idles[i], &idles[i + 1],
+				(idle_count - i - 1) * sizeof(*idles));
+			idle_count--;
+			break;
+		}
+	}
+	return 1;
+}
+
+/* Waits for the next key, running timers, signal and fd handlers and
+ * idle work meanwhile. Returns ERR when something other than a key may
+ * have changed what is on screen, so the caller draws again */
+int event_key(struct editor *e)
+{
+	/* A backend without a terminal, like a replayed script, always has
+	 * its next key ready */
+	int fd = screen_fd();
+
+	for (;;) {
+		if (run_timers(e))
+			break;
+		if (fd >= 0) {
+			int c = screen_key(0);
+			if (c != ERR)
+				return c;
+		}
+
+		if (pfd_cap < watch_count + 2) {
+			pfd_cap = watch_count + 2;
+			pfds = xrealloc(pfds, pfd_cap * sizeof(*pfds));
+		}
+		pfds[0] = (struct pollfd){ .fd = fd, .events = POLLIN };
+		pfds[1] = (struct pollfd){ .fd = signal_pipe[0],
+					   .events = POLLIN };
+		for (int i = 0; i < watch_count; i++)
+			pfds[i + 2] = (struct pollfd){ .fd = watches[i].fd,
+						       .events = POLLIN };
+		int count = watch_count + 2;
+
+		int timeout = (fd < 0 || idle_count) ? 0 : timer_wait_ms();
+		int n = poll(pfds, count, timeout);
+		if (n < 0) {
+			if (errno != EINTR && errno != EAGAIN)
+				die("poll failed: %s", strerror(errno));
+			continue;
+		}
+
+		int ran = (pfds[1].revents & POLLIN) && run_signals(e);
+		for (int i = 2; i < count; i++) {
+			if (!pfds[i].revents)
+				continue;
+			/* An earlier handler may have removed it */
+			for (int j = 0; j < watch_count; j++) {
+				if (watches[j].fd == pfds[i].fd) {
+					watches[j].fn(e, watches[j].data);
+					ran = 1;
+					break;
+				}
+			}
+		}
+		if (ran)
+			break;
+
+		if (fd < 0) {
+			if (idle_count)
+				run_idle(e);
+			return screen_key(-1);
+		}
+		/* Idle work only when nothing else is waiting */
+		if (n == 0 && idle_count && run_idle(e))
+			break;
+	}
+	return ERR;
+}
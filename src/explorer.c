@@ -1,28 +1,348 @@
-#include <ncurses.h>
-#include <stdlib.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include "kiuru.h"
-#include <dirent.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include "kiuru.h"
+#include "screen.h"
+
+/*
+ * A directory is read on a thread of its own, so one with hundreds of
+ * thousands of entries does not hold up the editor. The thread sorts what
+ * it read in batches and hands them over through a pipe, and the main
+ * loop merges each into the sorted list on screen. Batches grow with the
+ * list, so merging costs about as much as sorting it all at once.
+ */
+
+/* Entries in the first batch of a scan, later ones are bigger */
+#define SCAN_BATCH_MIN 1024
+
+static const char *sort_names[SORT_COUNT] = {
+	[SORT_NAME] = "name",
+	[SORT_MTIME] = "modified",
+	[SORT_SIZE] = "size",
+	[SORT_DIRS_FIRST] = "directories first",
+};
+
+/* Sorted entries a scan read, names offsets into names */
+struct scan_batch {
+	struct explorer_entry *entries;
+	int count;
+	char *names;
+	size_t names_len;
+	size_t names_cap;
+	struct scan_batch *next;
+};
+
+struct explorer_scan {
+	int fd;
+	enum explorer_sort sort;
+	pthread_t thread;
+	int started;
+	/* thread was created */
+	atomic_int cancel;
+	atomic_int done;
+	/* All batches are in the list */
+	pthread_mutex_t lock;
+	struct scan_batch *batches;
+	/* Oldest first, guarded by lock */
+	int pipe[2];
+	/* Written to after each batch, wakes up the main loop */
+
+	struct explorer_scan *next;
+	/* Scans not freed yet, current and cancelled */
+};
+
+static struct explorer_scan *scans;
+
+/* Order of entries a and b, whose names are in names. .. always comes
+ * first */
+static int compare(const struct explorer_entry *a,
+		   const struct explorer_entry *b, const char *names,
+		   enum explorer_sort sort)
+{
+	const char *na = names + a->name;
+	const char *nb = names + b->name;
+	int up_a = strcmp(na, "..") == 0;
+	int up_b = strcmp(nb, "..") == 0;
+	if (up_a != up_b)
+		return up_b - up_a;
+
+	switch (sort) {
+	case SORT_MTIME: /* Newest first */
+	case SORT_SIZE: /* Biggest first */
+		if (a->key != b->key)
+			return (a->key < b->key) ? 1 : -1;
+		break;
+	case SORT_DIRS_FIRST:
+		if (a->dir != b->dir)
+			return (int)b->dir - (int)a->dir;
+		break;
+	default:
+		break;
+	}
+	return strcmp(na, nb);
+}
+
+/* Sorts n entries with a bottom up merge sort, tmp has room for n */
+static void sort_entries(struct explorer_entry *v, struct explorer_entry *tmp,
+			 int n, const char *names, enum explorer_sort sort)
+{
+	for (int width = 1; width < n; width *= 2) {
+		for (int lo = 0; lo < n; lo += 2 * width) {
+			int mid = (lo + width < n) ? lo + width : n;
+			int hi = (lo + 2 * width < n) ? lo + 2 * width : n;
+			int i = lo, j = mid, k = lo;
+			while (i < mid && j < hi)
+				tmp[k++] = (compare(&v[j], &v[i], names, sort) < 0) ?
+						   v[j++] :
+						   v[i++];
+			while (i < mid)
+				tmp[k++] = v[i++];
+			while (j < hi)
+				tmp[k++] = v[j++];
+		}
+		memcpy(v, tmp, n * sizeof(*v));
+	}
+}
+
+/* Sorts a batch and hands it to the main loop */
+static void send_batch(struct explorer_scan *scan, struct scan_batch *b)
+{
+	struct explorer_entry *tmp = xmalloc(b->count * sizeof(*tmp));
+	sort_entries(b->entries, tmp, b->count, b->names, scan->sort);
+	free(tmp);
+
+	pthread_mutex_lock(&scan->lock);
+	struct scan_batch **p = &scan->batches;
+	while (*p)
+		p = &(*p)->next;
+	*p = b;
+	pthread_mutex_unlock(&scan->lock);
+	/* A full pipe already has a wakeup in it */
+	(void)write(scan->pipe[1], "", 1);
+}
+
+/* Adds entry name to batch b. d_type tells if it is a directory on most
+ * filesystems, the rest, links and sorting by time or size need fstatat.
+ * A link counts as what it points to, like stat */
+static void add_entry(struct explorer_scan *scan, struct scan_batch *b,
+		      int fd, struct dirent *de)
+{
+	struct explorer_entry *en = &b->entries[b->count++];
+	size_t len = strlen(de->d_name) + 1;
+	if (b->names_len + len > b->names_cap) {
+		b->names_cap = (b->names_len + len) * 2;
+		b->names = xrealloc(b->names, b->names_cap);
+	}
+	memcpy(b->names + b->names_len, de->d_name, len);
+	en->name = b->names_len;
+	b->names_len += len;
+	en->dir = de->d_type == DT_DIR;
+	en->key = 0;
+
+	struct stat sb;
+	if ((de->d_type == DT_UNKNOWN || de->d_type == DT_LNK ||
+	     scan->sort == SORT_MTIME || scan->sort == SORT_SIZE) &&
+	    fstatat(fd, de->d_name, &sb, 0) == 0) {
+		en->dir = S_ISDIR(sb.st_mode);
+		en->key = (scan->sort == SORT_MTIME) ? sb.st_mtime : sb.st_size;
+	}
+}
+
+static void *scan_thread(void *arg)
+{
+	struct explorer_scan *scan = arg;
+	DIR *d = fdopendir(scan->fd);
+	struct scan_batch *b = NULL;
+	int want = SCAN_BATCH_MIN;
+	int total = 0;
+
+	struct dirent *de;
+	while (d && !atomic_load(&scan->cancel) && (de = readdir(d))) {
+		/* Filter out current dir '.' but keep '..' */
+		if (strcmp(de->d_name, ".") == 0)
+			continue;
+		if (!b) {
+			b = xcalloc(1, sizeof(*b));
+			b->entries = xmalloc(want * sizeof(*b->entries));
+		}
+		add_entry(scan, b, scan->fd, de);
+		if (b->count == want) {
+			send_batch(scan, b);
+			b = NULL;
+			total += want;
+			want = (total / 4 > SCAN_BATCH_MIN) ? total / 4 :
+							      SCAN_BATCH_MIN;
+		}
+	}
+	if (b)
+		send_batch(scan, b);
+	/* closedir closes the fd */
+	if (d)
+		closedir(d);
+	else
+		close(scan->fd);
+
+	atomic_store(&scan->done, 1);
+	(void)write(scan->pipe[1], "", 1);
+	return NULL;
+}
+
+/* Merges sorted batch b into the list from the end, keeping the same
+ * entry selected */
+static void merge_batch(struct editor *e, struct scan_batch *b)
+{
+	/* Names go after the ones there */
+	if (e->file_names_len + b->names_len > e->file_names_cap) {
+		e->file_names_cap = (e->file_names_len + b->names_len) * 2;
+		e->file_names = xrealloc(e->file_names, e->file_names_cap);
+	}
+	memcpy(e->file_names + e->file_names_len, b->names, b->names_len);
+	for (int i = 0; i < b->count; i++)
+		b->entries[i].name += e->file_names_len;
+	e->file_names_len += b->names_len;
+
+	if (e->file_count + b->count > e->file_cap) {
+		e->file_cap = (e->file_count + b->count) * 2;
+		e->file_list =
+			xrealloc(e->file_list, e->file_cap * sizeof(*e->file_list));
+	}
+
+	struct explorer_entry *v = e->file_list;
+	int i = e->file_count - 1;
+	int j = b->count - 1;
+	int k = e->file_count + b->count - 1;
+	int cy = e->expl_cy;
+	while (j >= 0) {
+		if (i >= 0 && compare(&v[i], &b->entries[j], e->file_names,
+				      e->expl_sort) > 0) {
+			if (i == e->expl_cy)
+				cy = k;
+			v[k--] = v[i--];
+		} else {
+			v[k--] = b->entries[j--];
+		}
+	}
+	e->file_count += b->count;
+
+	/* The selected entry stays on the same row */
+	e->expl_offset += cy - e->expl_cy;
+	if (e->expl_offset < 0)
+		e->expl_offset = 0;
+	e->expl_cy = cy;
+}
+
+static void free_batches(struct scan_batch *b)
+{
+	while (b) {
+		struct scan_batch *next = b->next;
+		free(b->entries);
+		free(b->names);
+		free(b);
+		b = next;
+	}
+}
+
+/* Joins the thread of a scan that is done and frees it */
+static void scan_free(struct explorer_scan *scan)
+{
+	if (scan->started)
+		pthread_join(scan->thread, NULL);
+	event_unwatch(scan->pipe[0]);
+	close(scan->pipe[0]);
+	close(scan->pipe[1]);
+	free_batches(scan->batches);
+	pthread_mutex_destroy(&scan->lock);
+
+	for (struct explorer_scan **p = &scans; *p; p = &(*p)->next) {
+		if (*p == scan) {
+			*p = scan->next;
+			break;
+		}
+	}
+	free(scan);
+}
+
+static void scan_event(struct editor *e, void *data)
+{
+	struct explorer_scan *scan = data;
+	char drain[256];
+
+	/* Looked at before the batches, which are all in once it is set */
+	int done = atomic_load(&scan->done);
+	while (read(scan->pipe[0], drain, sizeof(drain)) > 0)
+		;
+
+	if (e->expl_scan == scan) {
+		pthread_mutex_lock(&scan->lock);
+		struct scan_batch *b = scan->batches;
+		scan->batches = NULL;
+		pthread_mutex_unlock(&scan->lock);
+
+		for (struct scan_batch *it = b; it; it = it->next)
+			merge_batch(e, it);
+		free_batches(b);
+		if (done)
+			e->expl_scan = NULL;
+	}
+	if (done)
+		scan_free(scan);
+}
+
+/* Stops the running scan, its thread finishes on its own */
+static void scan_cancel(struct editor *e)
+{
+	if (e->expl_scan) {
+		atomic_store(&e->expl_scan->cancel, 1);
+		e->expl_scan = NULL;
+	}
+}
 
 /* Frees file list */
 static void free_file_list(struct editor *e)
 {
-	if (e->file_list) {
-		for (int i = 0; i < e->file_count; i++)
-			free(e->file_list[i]);
-		free(e->file_list);
-		e->file_list = NULL;
-	}
+	scan_cancel(e);
+	free(e->file_list);
+	free(e->file_names);
+	e->file_list = NULL;
+	e->file_names = NULL;
 	e->file_count = 0;
+	e->file_cap = 0;
+	e->file_names_len = 0;
+	e->file_names_cap = 0;
 }
 
-static int file_select(const struct dirent *entry)
+/* Starts reading the current directory on a thread */
+static void scan_start(struct editor *e)
 {
-	/* Filter out current dir '.' but keep '..' */
-	return (strcmp(entry->d_name, ".") != 0);
+	struct explorer_scan *scan = xcalloc(1, sizeof(*scan));
+	scan->fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (scan->fd < 0 || pipe(scan->pipe) != 0) {
+		if (scan->fd >= 0)
+			close(scan->fd);
+		free(scan);
+		set_message(e, "Err: Failed to read dir");
+		return;
+	}
+	fcntl(scan->pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(scan->pipe[1], F_SETFL, O_NONBLOCK);
+	scan->sort = e->expl_sort;
+	pthread_mutex_init(&scan->lock, NULL);
+
+	scan->next = scans;
+	scans = scan;
+	e->expl_scan = scan;
+	event_watch(scan->pipe[0], scan_event, scan);
+
+	if (pthread_create(&scan->thread, NULL, scan_thread, scan) == 0)
+		scan->started = 1;
+	else
+		scan_thread(scan);
 }
 
 void open_explorer(struct editor *e, const char *path)
@@ -40,20 +360,7 @@ void open_explorer(struct editor *e, const char *path)
 		strcpy(e->cwd, "Unknown");
 
 	free_file_list(e);
-
-	/* Scan directory
-	 * alphasort comes with dirent.h usually, otherwise use NULL for no sort
-	 */
-	/* TODO: Make sort custom */
-	e->file_count = scandir(".", &e->file_list, file_select, alphasort);
-
-	if (e->file_count < 0) {
-		set_message(e, "Err: Failed to read dir");
-		e->file_count = 0;
-	}
-
-	/* Hide cursor */
-	curs_set(0);
+	scan_start(e);
 
 	e->mode = MODE_EXPLORER;
 	e->expl_cy = 0;
@@ -62,60 +369,64 @@ void open_explorer(struct editor *e, const char *path)
 
 void draw_explorer(struct editor *e)
 {
-	erase();
+	screen_erase();
 
 	int rows = e->screen_rows;
 	int cols = e->screen_cols;
 
-	/* Draw title */
-	attron(A_REVERSE | A_BOLD);
-	mvprintw(0, 0, " File Explorer: %s ", e->cwd);
-	/* Fill rest of line */
-	for (int i = getcurx(stdscr); i < cols; i++)
-		addch(' ');
-	attroff(A_REVERSE | A_BOLD);
+	/* Draw title, filling rest of line */
+	int x = screen_print(0, 0, A_REVERSE | A_BOLD,
+			     " File Explorer: %s | by %s%s ", e->cwd,
+			     sort_names[e->expl_sort],
+			     e->expl_scan ? " | reading..." : "");
+	screen_fill(0, x, cols - x, ' ' | A_REVERSE | A_BOLD);
 
 	/* Draw files */
 	for (int y = 1; y < rows - 1; y++) {
 		int list_idx = (y - 1) + e->expl_offset;
 
-		move(y, 0);
-		clrtoeol();
+		screen_clear_eol(y, 0);
 
 		if (list_idx < e->file_count) {
-			struct dirent *dp = e->file_list[list_idx];
-			int is_selected = (list_idx == e->expl_cy);
+			struct explorer_entry *en = &e->file_list[list_idx];
+			chtype attr = 0;
 
-			/* Check if directory */
-			struct stat sb;
-			stat(dp->d_name, &sb);
-			int is_dir = S_ISDIR(sb.st_mode);
-
-			if (is_selected)
-				attron(A_REVERSE);
+			if (list_idx == e->expl_cy)
+				attr |= A_REVERSE;
 
 			/* Add slash to dirs */
-			if (is_dir)
-				attron(COLOR_PAIR(1) | A_BOLD);
-
-			mvprintw(y, 1, "%s%s", dp->d_name, is_dir ? "/" : "");
+			if (en->dir)
+				attr |= COLOR_PAIR(1) | A_BOLD;
 
-			if (is_dir)
-				attroff(COLOR_PAIR(1) | A_BOLD);
-			if (is_selected)
-				attroff(A_REVERSE);
+			screen_print(y, 1, attr, "%s%s",
+				     e->file_names + en->name,
+				     en->dir ? "/" : "");
 		}
 	}
+
+	if (e->message[0])
+		screen_print(rows - 1, 0, A_REVERSE, "%s", e->message);
 }
 
-void handle_explorer_input(struct editor *e)
+void handle_explorer_input(struct editor *e, int c)
 {
-	int c = getch();
-
 	switch (c) {
 	case 'q': /* Quit explorer, return to normal if possible */
+		scan_cancel(e);
 		e->mode = MODE_NORMAL;
-		curs_set(1);
+		break;
+
+	case '/': /* Grep files under this directory */
+		grep_open(e);
+		break;
+
+	case 'f': /* Find a file under this directory by name */
+		finder_open(e);
+		break;
+
+	case 's': /* Next sort order, read again for times and sizes */
+		e->expl_sort = (e->expl_sort + 1) % SORT_COUNT;
+		open_explorer(e, NULL);
 		break;
 
 	case 'j':
@@ -142,24 +453,25 @@ void handle_explorer_input(struct editor *e)
 		if (e->file_count == 0)
 			break;
 
-		struct dirent *dp = e->file_list[e->expl_cy];
-		struct stat sb;
+		struct explorer_entry *en = &e->file_list[e->expl_cy];
+		const char *name = e->file_names + en->name;
 
-		if (stat(dp->d_name, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+		if (en->dir) {
 			/* It's a directory, enter it */
-			open_explorer(e, dp->d_name);
+			open_explorer(e, name);
 		} else {
 			/* It's a file, open it */
 			char full_path[PATH_MAX];
 
 			/* Construct absolute path */
-			snprintf(full_path, sizeof(full_path), "%s/%s", e->cwd,
-				 dp->d_name);
+			if (snprintf(full_path, sizeof(full_path), "%s/%s",
+				     e->cwd, name) >= (int)sizeof(full_path)) {
+				set_message(e, "Err: Path too long");
+				break;
+			}
 
 			load_file(e, full_path);
 			e->mode = MODE_NORMAL;
-			/* Set cursor back to normal */
-			curs_set(1);
 
 			/* Clean up */
 			free_file_list(e);
@@ -168,3 +480,13 @@ void handle_explorer_input(struct editor *e)
 	}
 	}
 }
+
+/* Stops all scans and waits for their threads, before quitting */
+void explorer_wait(struct editor *e)
+{
+	free_file_list(e);
+	while (scans) {
+		atomic_store(&scans->cancel, 1);
+		scan_free(scans);
+	}
+}
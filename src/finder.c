@@ -0,0 +1,1069 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "kiuru.h"
+#include "screen.h"
+
+/*
+ * Fuzzy file finder, opened with F, or f in the explorer. Lists the files
+ * under the explorer's directory whose paths have the letters of the query
+ * in order, best matches first, and Enter opens the selected one.
+ *
+ * A thread indexes the paths once and keeps the directories it read. When
+ * the finder is opened again for the same directory it walks them again
+ * in the background, and only reads the ones whose modification time
+ * changed. What .gitignores name is left out, like grep does.
+ *
+ * Each key narrows the matches of the query before it: only those, and
+ * paths indexed since, are scored again, split across threads when there
+ * are many. Going back with backspace takes the matches kept for the
+ * shorter query. A 64 bit mask of the characters of every path is kept
+ * apart from the paths, so most that cannot match are passed over without
+ * looking at their text.
+ */
+
+#define FINDER_THREADS_MAX 8
+/* Fewer candidates than this are scored in the main thread */
+#define FINDER_PARALLEL_MIN 32768
+/* Results kept in order for the list, the rest only count */
+#define FINDER_BEST 500
+/* Paths in a chunk of the path list */
+#define FINDER_CHUNK 65536
+#define FINDER_CHUNKS_MAX 256
+/* Size of the blocks path texts are kept in */
+#define FINDER_TEXT_BLOCK (1 << 20)
+
+/* Score of a path that does not match */
+#define NO_MATCH INT_MIN
+/* Points for each letter of the query matched */
+#define SCORE_MATCH 16
+/* Letter right after the one before in the query */
+#define BONUS_CONSECUTIVE 8
+/* Letter at the start of the path or a directory or file name */
+#define BONUS_SLASH 10
+/* Letter after _ - . or a space */
+#define BONUS_WORD 8
+/* Upper case letter after a lower case one */
+#define BONUS_CAMEL 7
+/* Letter in the file name, not in a directory above */
+#define BONUS_BASENAME 2
+/* Skipping letters costs this much, and this much more for each */
+#define GAP_START 3
+#define GAP_EXTEND 1
+
+/* Path the index found */
+struct finder_path {
+	const char *text;
+	/* Relative to the root, NUL terminated */
+	uint64_t base_mask;
+	/* Characters of the file name, see char_bit */
+	uint16_t len;
+	uint16_t base;
+	/* Where the file name starts */
+};
+
+struct path_chunk {
+	uint64_t masks[FINDER_CHUNK];
+	/* Characters of each path, see char_bit */
+	struct finder_path paths[FINDER_CHUNK];
+};
+
+/* Paths of an index walk. Chunks and text never move once written, so
+ * the main thread reads the first count while the walk adds more */
+struct path_list {
+	struct path_chunk *chunks[FINDER_CHUNKS_MAX];
+	atomic_int count;
+	char **blocks;
+	int block_count;
+	/* Where the next path text goes, and room left there */
+	char *text;
+	size_t text_left;
+};
+
+/* Directory of the index. Kept between walks, so a walk only reads the
+ * ones that changed */
+struct index_dir {
+	char *name;
+	/* Name in the parent, "" for the root */
+	int read;
+	/* Entries were read. Directories a .gitignore skips never are */
+	struct timespec mtime;
+	struct timespec ignore_mtime;
+	/* Of the directory and its .gitignore when they were read */
+	struct ignore *ignore;
+	/* Rules of its .gitignore, NULL if none */
+	char **files;
+	int file_count;
+	struct index_dir **dirs;
+	int dir_count;
+	/* Both sorted by name */
+};
+
+/* Paths under a directory, kept between openings of the finder */
+struct finder_index {
+	char root[PATH_MAX];
+	int root_fd;
+	struct index_dir *tree;
+	struct path_list *list;
+	/* Paths the finder shows */
+	struct path_list *building;
+	/* Paths the running walk adds to. The same as list on the first
+	 * walk, which shows paths as they are found. A later one makes a
+	 * new list only if something changed, it replaces list when done */
+	int streaming;
+	/* building is list */
+	int changed;
+	/* The walk read a directory or .gitignore again */
+	pthread_t thread;
+	int started;
+	/* A thread runs the walk, not joined yet */
+	atomic_int cancel;
+	atomic_int running;
+	atomic_int woken;
+	/* A wakeup is in the pipe and not read yet */
+	int pipe[2];
+};
+
+/* Query folded to lower case, with the mask of its characters */
+struct finder_query {
+	char text[FINDER_QUERY_MAX];
+	int len;
+	uint64_t mask;
+};
+
+/* A path that matches and its score */
+struct finder_match {
+	int score;
+	uint32_t path;
+	/* Index in the path list */
+};
+
+/* Matches of the query up to some length */
+struct finder_level {
+	uint32_t *matches;
+	/* Indexes of the paths that match, in index order. NULL for the
+	 * empty query, which all paths match */
+	int count;
+	int cap;
+	int seen;
+	/* Paths of the list looked at, later ones are not in matches yet */
+	struct finder_match *best;
+	int best_count;
+	/* Best FINDER_BEST matches, best first */
+};
+
+/* Candidates for one thread to score */
+struct finder_work {
+	struct path_list *list;
+	const struct finder_query *query;
+	const uint32_t *idx;
+	/* Paths idx[from..to], or from..to if NULL */
+	int from;
+	int to;
+	uint32_t *out;
+	/* Room for the indexes of to - from matches */
+	int count;
+	struct finder_match best[FINDER_BEST];
+	int best_count;
+	/* Heap with the worst of them on top */
+	pthread_t thread;
+};
+
+static struct finder_index *indexed;
+
+static inline unsigned char fold(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/* Bit of a character in the masks. Letters and digits have one of their
+ * own, other characters share the rest */
+static inline int char_bit(unsigned char c)
+{
+	c = fold(c);
+	if (c >= 'a' && c <= 'z')
+		return c - 'a';
+	if (c >= '0' && c <= '9')
+		return 26 + c - '0';
+	return 36 + c % 28;
+}
+
+static uint64_t text_mask(const char *s, int len)
+{
+	uint64_t mask = 0;
+	for (int i = 0; i < len; i++)
+		mask |= 1ULL << char_bit(s[i]);
+	return mask;
+}
+
+static inline struct finder_path *path_at(struct path_list *list, uint32_t n)
+{
+	return &list->chunks[n / FINDER_CHUNK]->paths[n % FINDER_CHUNK];
+}
+
+static void list_free(struct path_list *list)
+{
+	if (!list)
+		return;
+	for (int i = 0; i < FINDER_CHUNKS_MAX; i++)
+		free(list->chunks[i]);
+	for (int i = 0; i < list->block_count; i++)
+		free(list->blocks[i]);
+	free(list->blocks);
+	free(list);
+}
+
+/* Adds path to the list, base is where its file name starts */
+static void list_add(struct path_list *list, const char *path, int len,
+		     int base)
+{
+	int n = atomic_load_explicit(&list->count, memory_order_relaxed);
+	if (n == FINDER_CHUNK * FINDER_CHUNKS_MAX)
+		return;
+	struct path_chunk *c = list->chunks[n / FINDER_CHUNK];
+	if (!c)
+		c = list->chunks[n / FINDER_CHUNK] = xmalloc(sizeof(*c));
+
+	if ((size_t)len + 1 > list->text_left) {
+		list->blocks = xrealloc(list->blocks, (list->block_count + 1) *
+							      sizeof(*list->blocks));
+		list->text = xmalloc(FINDER_TEXT_BLOCK);
+		list->blocks[list->block_count++] = list->text;
+		list->text_left = FINDER_TEXT_BLOCK;
+	}
+	memcpy(list->text, path, len + 1);
+	c->masks[n % FINDER_CHUNK] = text_mask(path, len);
+	c->paths[n % FINDER_CHUNK] = (struct finder_path){
+		list->text, text_mask(path + base, len - base), len, base
+	};
+	list->text += len + 1;
+	list->text_left -= len + 1;
+
+	/* Written before the main thread can see it */
+	atomic_store_explicit(&list->count, n + 1, memory_order_release);
+}
+
+static void dir_free(struct index_dir *d)
+{
+	if (!d)
+		return;
+	for (int i = 0; i < d->file_count; i++)
+		free(d->files[i]);
+	for (int i = 0; i < d->dir_count; i++)
+		dir_free(d->dirs[i]);
+	free(d->files);
+	free(d->dirs);
+	ignore_free(d->ignore);
+	free(d->name);
+	free(d);
+}
+
+static int cmp_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int cmp_dirs(const void *a, const void *b)
+{
+	const struct index_dir *x = *(struct index_dir *const *)a;
+	const struct index_dir *y = *(struct index_dir *const *)b;
+	return strcmp(x->name, y->name);
+}
+
+static int same_time(struct timespec a, struct timespec b)
+{
+	return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+/* Reads the entries of directory d from fd again. Subdirectories it had
+ * before keep what was read of them */
+static void read_dir(struct index_dir *d, int fd)
+{
+	DIR *dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return;
+	}
+	char **files = NULL;
+	int file_count = 0;
+	int file_cap = 0;
+	struct index_dir **dirs = NULL;
+	int dir_count = 0;
+	int dir_cap = 0;
+	/* Old subdirectories found again, the others are gone */
+	char *kept = xcalloc(d->dir_count + 1, 1);
+
+	struct dirent *de;
+	while ((de = readdir(dir)) && !atomic_load(&indexed->cancel)) {
+		const char *name = de->d_name;
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+		    strcmp(name, ".git") == 0)
+			continue;
+
+		int type = de->d_type;
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+			if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+				continue;
+			type = S_ISDIR(st.st_mode) ? DT_DIR :
+			       S_ISREG(st.st_mode) ? DT_REG :
+						     DT_UNKNOWN;
+		}
+		/* Links are not followed, one to a parent would loop */
+		if (type == DT_REG) {
+			if (file_count == file_cap) {
+				file_cap = file_cap ? file_cap * 2 : 16;
+				files = xrealloc(files,
+						 file_cap * sizeof(*files));
+			}
+			files[file_count++] = xstrdup(name);
+		} else if (type == DT_DIR) {
+			if (dir_count == dir_cap) {
+				dir_cap = dir_cap ? dir_cap * 2 : 16;
+				dirs = xrealloc(dirs, dir_cap * sizeof(*dirs));
+			}
+			struct index_dir key = { .name = (char *)name };
+			struct index_dir *kp = &key;
+			struct index_dir **old =
+				d->dir_count ? bsearch(&kp, d->dirs,
+						       d->dir_count,
+						       sizeof(*d->dirs),
+						       cmp_dirs) :
+					       NULL;
+			if (old) {
+				dirs[dir_count] = *old;
+				kept[old - d->dirs] = 1;
+			} else {
+				dirs[dir_count] = xcalloc(1, sizeof(**dirs));
+				dirs[dir_count]->name = xstrdup(name);
+			}
+			dir_count++;
+		}
+	}
+	closedir(dir);
+
+	qsort(files, file_count, sizeof(*files), cmp_names);
+	qsort(dirs, dir_count, sizeof(*dirs), cmp_dirs);
+	for (int i = 0; i < d->file_count; i++)
+		free(d->files[i]);
+	for (int i = 0; i < d->dir_count; i++) {
+		if (!kept[i])
+			dir_free(d->dirs[i]);
+	}
+	free(kept);
+	free(d->files);
+	free(d->dirs);
+	d->files = files;
+	d->file_count = file_count;
+	d->dirs = dirs;
+	d->dir_count = dir_count;
+}
+
+/* Parses the .gitignore of d, at path, again if it changed */
+static void update_ignore(struct index_dir *d, char *path, int len)
+{
+	const char *name = ".gitignore";
+	int has = bsearch(&name, d->files, d->file_count, sizeof(*d->files),
+			  cmp_names) != NULL;
+	struct stat st;
+	if (has) {
+		snprintf(path + len, PATH_MAX - len, "%s.gitignore",
+			 len ? "/" : "");
+		has = fstatat(indexed->root_fd, path, &st, 0) == 0;
+		path[len] = '\0';
+	}
+	if (!has) {
+		if (d->ignore)
+			indexed->changed = 1;
+		ignore_free(d->ignore);
+		d->ignore = NULL;
+		return;
+	}
+	if (d->ignore && same_time(st.st_mtim, d->ignore_mtime))
+		return;
+
+	int fd = openat(indexed->root_fd, len ? path : ".",
+			O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	ignore_free(d->ignore);
+	d->ignore = ignore_read(fd, path, NULL);
+	d->ignore_mtime = st.st_mtim;
+	close(fd);
+	indexed->changed = 1;
+}
+
+/* Tells the main loop there are new paths, once until it looks */
+static void wake(struct finder_index *ix)
+{
+	if (!atomic_exchange(&ix->woken, 1))
+		(void)write(ix->pipe[1], "", 1);
+}
+
+/* Walks directory d at path, which is len bytes. update reads it again if
+ * it changed, emit adds its files to the list being built */
+static void walk(struct index_dir *d, char *path, int len,
+		 struct ignore *parent, int update, int emit)
+{
+	struct finder_index *ix = indexed;
+	if (atomic_load(&ix->cancel))
+		return;
+
+	if (update) {
+		struct stat st;
+		if (fstatat(ix->root_fd, len ? path : ".", &st, 0) != 0)
+			return;
+		if (!d->read || !same_time(st.st_mtim, d->mtime)) {
+			int fd = openat(ix->root_fd, len ? path : ".",
+					O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (fd < 0)
+				return;
+			read_dir(d, fd);
+			d->read = 1;
+			d->mtime = st.st_mtim;
+			ix->changed = 1;
+		}
+		update_ignore(d, path, len);
+	}
+
+	struct ignore *ign = parent;
+	if (d->ignore) {
+		d->ignore->parent = parent;
+		ign = d->ignore;
+	}
+	int sep = len ? 1 : 0;
+
+	if (emit) {
+		for (int i = 0; i < d->file_count; i++) {
+			const char *name = d->files[i];
+			int n = strlen(name);
+			if (len + sep + n >= PATH_MAX)
+				continue;
+			if (sep)
+				path[len] = '/';
+			memcpy(path + len + sep, name, n + 1);
+			if (!ignore_match(ign, path, name, 0))
+				list_add(ix->building, path, len + sep + n,
+					 len + sep);
+		}
+		path[len] = '\0';
+		if (ix->streaming && d->file_count)
+			wake(ix);
+	}
+
+	for (int i = 0; i < d->dir_count; i++) {
+		struct index_dir *sub = d->dirs[i];
+		int n = strlen(sub->name);
+		if (len + sep + n >= PATH_MAX)
+			continue;
+		if (sep)
+			path[len] = '/';
+		memcpy(path + len + sep, sub->name, n + 1);
+		if (!ignore_match(ign, path, sub->name, 1) &&
+		    (update || sub->read))
+			walk(sub, path, len + sep + n, ign, update, emit);
+		path[len] = '\0';
+	}
+}
+
+static void *index_thread(void *arg)
+{
+	struct finder_index *ix = arg;
+	char path[PATH_MAX] = "";
+
+	ix->changed = 0;
+	if (ix->streaming) {
+		walk(ix->tree, path, 0, NULL, 1, 1);
+	} else {
+		/* Paths are listed again only if a directory changed */
+		walk(ix->tree, path, 0, NULL, 1, 0);
+		if (ix->changed && !atomic_load(&ix->cancel)) {
+			ix->building = xcalloc(1, sizeof(*ix->building));
+			walk(ix->tree, path, 0, NULL, 0, 1);
+		}
+	}
+
+	atomic_store(&ix->running, 0);
+	(void)write(ix->pipe[1], "", 1);
+	return NULL;
+}
+
+/* Walks the index in a thread, see struct finder_index for building */
+static void index_start(struct finder_index *ix)
+{
+	ix->streaming = ix->list == NULL;
+	if (ix->streaming)
+		ix->list = ix->building = xcalloc(1, sizeof(*ix->list));
+	atomic_store(&ix->cancel, 0);
+	atomic_store(&ix->running, 1);
+	if (pthread_create(&ix->thread, NULL, index_thread, ix) == 0)
+		ix->started = 1;
+	else
+		index_thread(ix);
+}
+
+static void index_free(struct finder_index *ix)
+{
+	atomic_store(&ix->cancel, 1);
+	if (ix->started)
+		pthread_join(ix->thread, NULL);
+	event_unwatch(ix->pipe[0]);
+	close(ix->pipe[0]);
+	close(ix->pipe[1]);
+	close(ix->root_fd);
+	dir_free(ix->tree);
+	if (ix->building != ix->list)
+		list_free(ix->building);
+	list_free(ix->list);
+	free(ix);
+}
+
+/* Bonus for matching the byte at i of text, for the start of a word */
+static inline int bonus(const char *text, int i)
+{
+	if (i == 0 || text[i - 1] == '/')
+		return BONUS_SLASH;
+	unsigned char prev = text[i - 1];
+	unsigned char c = text[i];
+	if (prev == '_' || prev == '-' || prev == '.' || prev == ' ')
+		return BONUS_WORD;
+	if (prev >= 'a' && prev <= 'z' && c >= 'A' && c <= 'Z')
+		return BONUS_CAMEL;
+	return 0;
+}
+
+/* Index after the first match of the query in text from start, -1 if the
+ * letters of the query are not all there in order */
+static inline int match_forward(const char *text, int start, int len,
+				const struct finder_query *q)
+{
+	int j = 0;
+	for (int i = start; i < len; i++) {
+		if (fold(text[i]) == (unsigned char)q->text[j] && ++j == q->len)
+			return i + 1;
+	}
+	return -1;
+}
+
+/* Score of path p for query q, NO_MATCH if it does not have the letters
+ * of the query in order. Where they were matched goes to pos if not
+ * NULL */
+static int score_path(const struct finder_path *p,
+		      const struct finder_query *q, int *pos)
+{
+	const char *text = p->text;
+	/* A match in the file name is tried first */
+	int end = -1;
+	if ((p->base_mask & q->mask) == q->mask)
+		end = match_forward(text, p->base, p->len, q);
+	if (end < 0 && p->base)
+		end = match_forward(text, 0, p->len, q);
+	if (end < 0)
+		return NO_MATCH;
+
+	/* Going back from the end finds the shortest match that ends there,
+	 * and the letters it takes */
+	int at[FINDER_QUERY_MAX];
+	if (!pos)
+		pos = at;
+	for (int i = end - 1, j = q->len - 1; j >= 0; i--) {
+		if (fold(text[i]) == (unsigned char)q->text[j])
+			pos[j--] = i;
+	}
+
+	int score = 0;
+	for (int j = 0; j < q->len; j++) {
+		int i = pos[j];
+		int s = SCORE_MATCH + bonus(text, i) * (j == 0 ? 2 : 1);
+		if (j > 0 && i == pos[j - 1] + 1)
+			s += BONUS_CONSECUTIVE;
+		else if (j > 0)
+			s -= GAP_START + (i - pos[j - 1] - 2) * GAP_EXTEND;
+		if (i >= p->base)
+			s += BONUS_BASENAME;
+		score += s;
+	}
+	/* Shorter paths first when the rest is the same */
+	return score - p->len / 8;
+}
+
+/* a goes after b in the results */
+static inline int worse(struct finder_match a, struct finder_match b)
+{
+	return a.score < b.score || (a.score == b.score && a.path > b.path);
+}
+
+/* Adds m to the heap of the best matches if it is one */
+static void keep_best(struct finder_match *heap, int *count,
+		      struct finder_match m)
+{
+	int i;
+	if (*count < FINDER_BEST) {
+		i = (*count)++;
+		while (i > 0 && worse(m, heap[(i - 1) / 2])) {
+			heap[i] = heap[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+		heap[i] = m;
+		return;
+	}
+	if (!worse(heap[0], m))
+		return;
+	i = 0;
+	for (;;) {
+		int c = 2 * i + 1;
+		if (c >= FINDER_BEST)
+			break;
+		if (c + 1 < FINDER_BEST && worse(heap[c + 1], heap[c]))
+			c++;
+		if (!worse(heap[c], m))
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = m;
+}
+
+static void *score_thread(void *arg)
+{
+	struct finder_work *w = arg;
+	const struct finder_query *q = w->query;
+	uint64_t mask = q->mask;
+
+	for (int k = w->from; k < w->to; k++) {
+		uint32_t n = w->idx ? w->idx[k] : (uint32_t)k;
+		struct path_chunk *c = w->list->chunks[n / FINDER_CHUNK];
+		if ((c->masks[n % FINDER_CHUNK] & mask) != mask)
+			continue;
+		int score = score_path(&c->paths[n % FINDER_CHUNK], q, NULL);
+		if (score == NO_MATCH)
+			continue;
+		w->out[w->count++] = n;
+		keep_best(w->best, &w->best_count,
+			  (struct finder_match){ score, n });
+	}
+	return NULL;
+}
+
+static int cmp_matches(const void *a, const void *b)
+{
+	const struct finder_match *x = a;
+	const struct finder_match *y = b;
+	return worse(*x, *y) ? 1 : worse(*y, *x) ? -1 : 0;
+}
+
+/* Scores paths idx[from..to], or from..to if idx is NULL, and adds the
+ * ones that match to level lv */
+static void score_paths(struct path_list *list, const struct finder_query *q,
+			struct finder_level *lv, const uint32_t *idx, int from,
+			int to)
+{
+	int n = to - from;
+	if (n <= 0)
+		return;
+	if (lv->count + n > lv->cap) {
+		lv->cap = lv->count + n;
+		lv->matches = xrealloc(lv->matches,
+				       lv->cap * sizeof(*lv->matches));
+	}
+
+	int threads = 1;
+	if (n >= FINDER_PARALLEL_MIN) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (cpus > FINDER_THREADS_MAX) ? FINDER_THREADS_MAX :
+			  (cpus > 1)		      ? cpus :
+							1;
+	}
+	struct finder_work *work = xmalloc(threads * sizeof(*work));
+	for (int t = 0; t < threads; t++) {
+		struct finder_work *w = &work[t];
+		w->list = list;
+		w->query = q;
+		w->idx = idx;
+		w->from = from + (int)((int64_t)n * t / threads);
+		w->to = from + (int)((int64_t)n * (t + 1) / threads);
+		w->out = lv->matches + lv->count + (w->from - from);
+		w->count = 0;
+		w->best_count = 0;
+	}
+
+	/* The first part is scored here while the others are */
+	int started = 1;
+	for (; started < threads; started++) {
+		if (pthread_create(&work[started].thread, NULL, score_thread,
+				   &work[started]) != 0)
+			break;
+	}
+	score_thread(&work[0]);
+	for (int t = started; t < threads; t++)
+		score_thread(&work[t]);
+	for (int t = 1; t < started; t++)
+		pthread_join(work[t].thread, NULL);
+
+	/* Matches of each part follow the ones before, in index order */
+	int best_count = lv->best_count;
+	for (int t = 0; t < threads; t++) {
+		memmove(lv->matches + lv->count, work[t].out,
+			work[t].count * sizeof(*lv->matches));
+		lv->count += work[t].count;
+		best_count += work[t].best_count;
+	}
+
+	struct finder_match *best = xmalloc(best_count * sizeof(*best));
+	memcpy(best, lv->best, lv->best_count * sizeof(*best));
+	best_count = lv->best_count;
+	for (int t = 0; t < threads; t++) {
+		memcpy(best + best_count, work[t].best,
+		       work[t].best_count * sizeof(*best));
+		best_count += work[t].best_count;
+	}
+	qsort(best, best_count, sizeof(*best), cmp_matches);
+	if (best_count > FINDER_BEST)
+		best_count = FINDER_BEST;
+	memcpy(lv->best, best, best_count * sizeof(*best));
+	lv->best_count = best_count;
+	free(best);
+	free(work);
+}
+
+/* The first len bytes of the query, folded */
+static void make_query(struct finder *f, int len, struct finder_query *q)
+{
+	for (int i = 0; i < len; i++)
+		q->text[i] = fold(f->query[i]);
+	q->len = len;
+	q->mask = text_mask(q->text, len);
+}
+
+/* Adds the paths indexed since level n was made to it */
+static void level_extend(struct finder *f, int n)
+{
+	struct finder_level *lv = &f->levels[n];
+	struct path_list *list = indexed->list;
+	int count = atomic_load_explicit(&list->count, memory_order_acquire);
+	if (lv->seen == count)
+		return;
+
+	if (n == 0) {
+		/* Everything matches, the list is in index order */
+		for (int i = lv->seen; i < count && lv->best_count < FINDER_BEST;
+		     i++)
+			lv->best[lv->best_count++] = (struct finder_match){ 0, i };
+		lv->count = count;
+	} else {
+		struct finder_query q;
+		make_query(f, n, &q);
+		score_paths(list, &q, lv, NULL, lv->seen, count);
+	}
+	lv->seen = count;
+}
+
+/* Makes level n + 1 from level n, for the query one letter longer */
+static void level_push(struct finder *f, int n)
+{
+	struct finder_level *prev = &f->levels[n];
+	struct finder_level *lv = &f->levels[n + 1];
+	struct path_list *list = indexed->list;
+	int count = atomic_load_explicit(&list->count, memory_order_acquire);
+	struct finder_query q;
+	make_query(f, n + 1, &q);
+
+	*lv = (struct finder_level){ .best = xmalloc(FINDER_BEST *
+						     sizeof(*lv->best)) };
+	if (n == 0) {
+		score_paths(list, &q, lv, NULL, 0, count);
+	} else {
+		/* Only what matched the shorter query can match this one */
+		score_paths(list, &q, lv, prev->matches, 0, prev->count);
+		score_paths(list, &q, lv, NULL, prev->seen, count);
+	}
+	lv->seen = count;
+}
+
+static void level_free(struct finder_level *lv)
+{
+	free(lv->matches);
+	free(lv->best);
+	*lv = (struct finder_level){ 0 };
+}
+
+/* Makes all levels again, for a new path list */
+static void levels_rebuild(struct finder *f)
+{
+	for (int i = 0; i <= f->len; i++)
+		level_free(&f->levels[i]);
+	f->levels[0].best = xmalloc(FINDER_BEST * sizeof(*f->levels[0].best));
+	level_extend(f, 0);
+	for (int i = 0; i < f->len; i++)
+		level_push(f, i);
+}
+
+/* Keeps the selection on the list of results */
+static void select_result(struct editor *e, int cy)
+{
+	struct finder *f = &e->finder;
+	int count = f->levels[f->len].best_count;
+	int rows = e->screen_rows - 2;
+	if (cy >= count)
+		cy = count - 1;
+	if (cy < 0)
+		cy = 0;
+	f->cy = cy;
+	if (f->cy < f->offset)
+		f->offset = f->cy;
+	if (f->cy >= f->offset + rows)
+		f->offset = f->cy - rows + 1;
+	if (f->offset < 0)
+		f->offset = 0;
+}
+
+static void index_event(struct editor *e, void *data)
+{
+	struct finder_index *ix = data;
+	struct finder *f = &e->finder;
+	char drain[256];
+
+	/* Looked at before the paths, which are all in once it is 0 */
+	int done = atomic_load(&ix->running) == 0;
+	atomic_store(&ix->woken, 0);
+	while (read(ix->pipe[0], drain, sizeof(drain)) > 0)
+		;
+
+	int swapped = 0;
+	if (done && ix->started) {
+		pthread_join(ix->thread, NULL);
+		ix->started = 0;
+	}
+	if (done && ix->building && ix->building != ix->list) {
+		list_free(ix->list);
+		ix->list = ix->building;
+		swapped = 1;
+	}
+	if (done)
+		ix->building = NULL;
+
+	if (!f->levels)
+		return;
+	if (swapped)
+		levels_rebuild(f);
+	else
+		level_extend(f, f->len);
+	select_result(e, f->cy);
+}
+
+/* Opens the finder on the explorer's directory, or the working directory
+ * if the explorer was not opened */
+void finder_open(struct editor *e)
+{
+	struct finder *f = &e->finder;
+	char root[PATH_MAX];
+	if (e->cwd[0]) {
+		strcpy(root, e->cwd);
+	} else if (!getcwd(root, sizeof(root))) {
+		set_message(e, "Err: Cannot access working directory");
+		return;
+	}
+
+	if (indexed && strcmp(indexed->root, root) != 0) {
+		index_free(indexed);
+		indexed = NULL;
+	}
+	if (!indexed) {
+		struct finder_index *ix = xcalloc(1, sizeof(*ix));
+		ix->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (ix->root_fd < 0) {
+			free(ix);
+			set_message(e, "Err: Cannot access %s", root);
+			return;
+		}
+		if (pipe(ix->pipe) != 0) {
+			close(ix->root_fd);
+			free(ix);
+			set_message(e, "Err: cannot start finder");
+			return;
+		}
+		fcntl(ix->pipe[0], F_SETFL, O_NONBLOCK);
+		fcntl(ix->pipe[1], F_SETFL, O_NONBLOCK);
+		strcpy(ix->root, root);
+		ix->tree = xcalloc(1, sizeof(*ix->tree));
+		ix->tree->name = xstrdup("");
+		indexed = ix;
+		event_watch(ix->pipe[0], index_event, ix);
+	}
+	/* Again since the last time, for what changed */
+	if (!atomic_load(&indexed->running) && !indexed->started)
+		index_start(indexed);
+
+	f->back = e->mode;
+	f->len = 0;
+	f->cy = 0;
+	f->offset = 0;
+	if (!f->levels)
+		f->levels = xcalloc(FINDER_QUERY_MAX + 1, sizeof(*f->levels));
+	levels_rebuild(f);
+	e->mode = MODE_FINDER;
+}
+
+static void finder_close(struct editor *e, enum editor_mode mode)
+{
+	struct finder *f = &e->finder;
+	if (f->levels) {
+		for (int i = 0; i <= f->len; i++)
+			level_free(&f->levels[i]);
+		free(f->levels);
+		f->levels = NULL;
+	}
+	f->len = 0;
+	e->mode = mode;
+}
+
+/* Opens the selected file */
+static void open_result(struct editor *e)
+{
+	struct finder *f = &e->finder;
+	struct finder_level *lv = &f->levels[f->len];
+	if (lv->best_count == 0)
+		return;
+	struct finder_path *p = path_at(indexed->list, lv->best[f->cy].path);
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s/%s", indexed->root, p->text) >=
+	    (int)sizeof(path)) {
+		set_message(e, "Err: Path too long");
+		return;
+	}
+
+	finder_close(e, MODE_NORMAL);
+	load_file(e, path);
+	e->drawn_buf = NULL;
+}
+
+void handle_finder_input(struct editor *e, int c)
+{
+	struct finder *f = &e->finder;
+	int rows = e->screen_rows - 2;
+
+	switch (c) {
+	case KEY_ESCAPE:
+		finder_close(e, f->back);
+		break;
+	case KEY_RETURN:
+		open_result(e);
+		break;
+	case KEY_UP:
+	case 'P' & 0x1f:
+		select_result(e, f->cy - 1);
+		break;
+	case KEY_DOWN:
+	case 'N' & 0x1f:
+		select_result(e, f->cy + 1);
+		break;
+	case KEY_PPAGE:
+		select_result(e, f->cy - rows);
+		break;
+	case KEY_NPAGE:
+		select_result(e, f->cy + rows);
+		break;
+	case KEY_BACKSPACE:
+		if (f->len == 0)
+			break;
+		level_free(&f->levels[f->len--]);
+		/* Kept from before, only paths found since are new to it */
+		level_extend(f, f->len);
+		f->cy = 0;
+		f->offset = 0;
+		break;
+	default:
+		if (c < 32 || c > 255 || c == 127 || f->len == FINDER_QUERY_MAX)
+			break;
+		f->query[f->len] = c;
+		level_push(f, f->len);
+		f->len++;
+		f->cy = 0;
+		f->offset = 0;
+		break;
+	}
+}
+
+/* Draws path p on row y from column 1, the letters of the query bold and
+ * directories above it dim. Long paths lose their start */
+static void draw_path(struct editor *e, int y, struct finder_path *p,
+		      const struct finder_query *q, chtype attr)
+{
+	int cols = e->screen_cols;
+	int width = cols - 2;
+	if (width <= 0)
+		return;
+	int pos[FINDER_QUERY_MAX];
+	if (q->len && score_path(p, q, pos) == NO_MATCH)
+		return;
+
+	chtype cells[width];
+	int from = (p->len > width) ? p->len - width : 0;
+	int n = p->len - from;
+	int j = 0;
+	while (j < q->len && pos[j] < from)
+		j++;
+	for (int i = from; i < p->len; i++) {
+		unsigned char c = p->text[i];
+		chtype a = attr;
+		if (j < q->len && pos[j] == i) {
+			a |= A_BOLD;
+			j++;
+		} else if (i < p->base) {
+			a |= COLOR_PAIR(1);
+		}
+		cells[i - from] = ((c < 32 || c == 127) ? '?' : c) | a;
+	}
+	screen_put(y, 1, cells, n);
+	if (attr && n < width)
+		screen_fill(y, 1 + n, width - n, ' ' | attr);
+}
+
+void draw_finder(struct editor *e)
+{
+	struct finder *f = &e->finder;
+	struct finder_level *lv = &f->levels[f->len];
+	struct path_list *list = indexed->list;
+	int rows = e->screen_rows;
+	int cols = e->screen_cols;
+	screen_erase();
+
+	int x = screen_print(0, 0, A_REVERSE | A_BOLD,
+			     " Find: %s | %d of %d%s ", indexed->root,
+			     lv->count, lv->seen,
+			     atomic_load(&indexed->running) ? " | indexing..." :
+							      "");
+	screen_fill(0, x, cols - x, ' ' | A_REVERSE | A_BOLD);
+
+	struct finder_query q;
+	make_query(f, f->len, &q);
+	for (int y = 1; y < rows - 1; y++) {
+		int i = y - 1 + f->offset;
+		if (i >= lv->best_count)
+			break;
+		draw_path(e, y, path_at(list, lv->best[i].path), &q,
+			  (i == f->cy) ? A_REVERSE : 0);
+	}
+
+	if (e->message[0])
+		screen_print(rows - 2, 0, A_REVERSE, "%s", e->message);
+	x = screen_print(rows - 1, 0, 0, "> %.*s", f->len, f->query);
+	screen_cursor(rows - 1, x, 1);
+}
+
+/* Stops indexing and waits for its thread, before quitting */
+void finder_wait(struct editor *e)
+{
+	if (e->finder.levels)
+		finder_close(e, e->mode);
+	if (indexed) {
+		index_free(indexed);
+		indexed = NULL;
+	}
+}
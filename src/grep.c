@@ -0,0 +1,801 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "kiuru.h"
+#include "screen.h"
+
+/*
+ * Project grep, opened with / in the explorer. Looks for a literal pattern
+ * in every file under the explorer's directory and lists the lines that
+ * have it, Enter opens the file at the line.
+ *
+ * Worker threads walk the tree. Each has a queue of its own of directories
+ * and files to look at. It takes the newest item of its own queue, and
+ * when that is empty steals the oldest from another's, which tends to be
+ * a directory high up with much under it. When all are empty it waits
+ * for another to queue more. Paths a .gitignore on the way down names
+ * are skipped, and so are .git and, like git does, files with a NUL byte
+ * near the start.
+ *
+ * Files are matched with the vector filter / uses. The matches of a file
+ * go to the main loop together through a pipe, so results show up while
+ * the search goes on and the editor never waits for it.
+ */
+
+#define GREP_THREADS_MAX 8
+/* Bytes looked at for a NUL byte, which makes a file binary */
+#define GREP_BINARY_PEEK 8000
+/* Smaller files are read, mapping them costs more than the copy. Also
+ * the size of the first read of every file */
+#define GREP_MAP_MIN (64 * 1024)
+/* Bytes of a matched line kept for the results list */
+#define GREP_PREVIEW_MAX 200
+/* The search stops after this many matches */
+#define GREP_MATCHES_MAX 100000
+/* Bytes of a file matched in one go, search_bytes takes an int */
+#define GREP_WINDOW (1 << 30)
+/* Time between redraws of the count of files searched */
+#define GREP_PROGRESS_MS 100
+
+/* Directory or file for a worker to look at */
+struct grep_item {
+	char *path;
+	/* Relative to the root, "" for the root */
+	struct ignore *ignore;
+	/* Rules that apply in the directory it is in */
+	int dir;
+};
+
+/* Work queue of a worker. The owner takes from the tail, others steal
+ * from the head */
+struct grep_queue {
+	pthread_mutex_t lock;
+	struct grep_item *items;
+	int head;
+	int tail;
+	int cap;
+};
+
+struct grep_worker {
+	struct grep_job *job;
+	int id;
+	pthread_t thread;
+	struct grep_queue queue;
+	char *buf;
+	/* First GREP_MAP_MIN bytes of a file, all of a small one */
+};
+
+/* Matches of one file, on their way to the main loop */
+struct grep_found {
+	char *path;
+	struct grep_match *matches;
+	int count;
+	struct grep_found *next;
+};
+
+struct grep_job {
+	char pattern[SEARCH_MAX];
+	int len;
+	int root_fd;
+	struct grep_worker workers[GREP_THREADS_MAX];
+	int worker_count;
+	int thread_count;
+	/* Threads started, 0 if the search ran in the main thread */
+	atomic_int pending;
+	/* Items queued or being looked at, the walk is over at 0 */
+	atomic_int cancel;
+	atomic_int running;
+	/* Workers not done yet */
+	atomic_int files;
+	atomic_int matches;
+	atomic_int woken;
+	/* A wakeup is in the pipe and not read yet */
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle;
+	/* Workers with nothing to take wait on it for more, the end of the
+	 * walk or cancel */
+	atomic_int idle_count;
+	/* Workers waiting or about to */
+	pthread_mutex_t lock;
+	/* Guards found and ignores */
+	struct grep_found *found;
+	/* Newest first */
+	struct ignore *ignores;
+	int pipe[2];
+	int timer;
+	/* Redraws the count of files searched, 0 once stopped */
+
+	struct grep_job *next;
+	/* Jobs not freed yet, current and cancelled */
+};
+
+static struct grep_job *jobs;
+
+/* path/name, or name for the root */
+static char *join(const char *path, const char *name)
+{
+	size_t len = strlen(path);
+	size_t name_len = strlen(name);
+	char *s = xmalloc(len + name_len + 2);
+	memcpy(s, path, len);
+	if (len)
+		s[len++] = '/';
+	memcpy(s + len, name, name_len + 1);
+	return s;
+}
+
+/* Reads the .gitignore of directory fd, which is path. Returns the rules
+ * for what is inside, parent if it has none */
+static struct ignore *read_ignore(struct grep_job *job, int fd,
+				  const char *path, struct ignore *parent)
+{
+	struct ignore *ign = ignore_read(fd, path, parent);
+	if (ign != parent) {
+		pthread_mutex_lock(&job->lock);
+		ign->next = job->ignores;
+		job->ignores = ign;
+		pthread_mutex_unlock(&job->lock);
+	}
+	return ign;
+}
+
+/* Tells the main loop there is something new, once until it looks */
+static void wake(struct grep_job *job)
+{
+	if (!atomic_exchange(&job->woken, 1))
+		(void)write(job->pipe[1], "", 1);
+}
+
+/* Wakes a worker waiting for work, or all of them */
+static void wake_idle(struct grep_job *job, int all)
+{
+	pthread_mutex_lock(&job->idle_lock);
+	if (all)
+		pthread_cond_broadcast(&job->idle);
+	else
+		pthread_cond_signal(&job->idle);
+	pthread_mutex_unlock(&job->idle_lock);
+}
+
+/* Stops the workers of job, they finish on their own */
+static void stop(struct grep_job *job)
+{
+	atomic_store(&job->cancel, 1);
+	wake_idle(job, 1);
+}
+
+static void push(struct grep_worker *w, char *path, struct ignore *ign,
+		 int dir)
+{
+	struct grep_queue *q = &w->queue;
+	atomic_fetch_add(&w->job->pending, 1);
+
+	pthread_mutex_lock(&q->lock);
+	if (q->tail == q->cap) {
+		if (q->head > q->cap / 2) {
+			memmove(q->items, q->items + q->head,
+				(q->tail - q->head) * sizeof(*q->items));
+			q->tail -= q->head;
+			q->head = 0;
+		} else {
+			q->cap = q->cap ? q->cap * 2 : 64;
+			q->items = xrealloc(q->items,
+					    q->cap * sizeof(*q->items));
+		}
+	}
+	q->items[q->tail++] = (struct grep_item){ path, ign, dir };
+	pthread_mutex_unlock(&q->lock);
+
+	if (atomic_load(&w->job->idle_count))
+		wake_idle(w->job, 0);
+}
+
+/* Next item of w's own queue, or stolen from another's. 0 if all are
+ * empty */
+static int take(struct grep_worker *w, struct grep_item *it)
+{
+	struct grep_job *job = w->job;
+	for (int i = 0; i < job->worker_count; i++) {
+		struct grep_queue *q =
+			&job->workers[(w->id + i) % job->worker_count].queue;
+		int got = 0;
+		pthread_mutex_lock(&q->lock);
+		if (q->tail > q->head) {
+			*it = (i == 0) ? q->items[--q->tail] :
+					 q->items[q->head++];
+			got = 1;
+		}
+		pthread_mutex_unlock(&q->lock);
+		if (got)
+			return 1;
+	}
+	return 0;
+}
+
+/* Like take, but waits while others look at what may queue more. 0 once
+ * the walk is over or cancelled */
+static int take_wait(struct grep_worker *w, struct grep_item *it)
+{
+	struct grep_job *job = w->job;
+	int got;
+
+	pthread_mutex_lock(&job->idle_lock);
+	/* Counted before looking, so a push after it wakes us */
+	atomic_fetch_add(&job->idle_count, 1);
+	while (!(got = take(w, it)) && !atomic_load(&job->cancel) &&
+	       atomic_load(&job->pending) > 0)
+		pthread_cond_wait(&job->idle, &job->idle_lock);
+	atomic_fetch_sub(&job->idle_count, 1);
+	pthread_mutex_unlock(&job->idle_lock);
+	return got;
+}
+
+/* Queues what is in directory it */
+static void list_dir(struct grep_worker *w, struct grep_item *it)
+{
+	struct grep_job *job = w->job;
+	int fd = openat(job->root_fd, it->path[0] ? it->path : ".",
+			O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	struct ignore *ign = read_ignore(job, fd, it->path, it->ignore);
+	DIR *d = fdopendir(fd);
+	if (!d) {
+		close(fd);
+		return;
+	}
+
+	struct dirent *de;
+	while ((de = readdir(d)) && !atomic_load(&job->cancel)) {
+		const char *name = de->d_name;
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+		    strcmp(name, ".git") == 0)
+			continue;
+
+		int type = de->d_type;
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+			if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+				continue;
+			type = S_ISDIR(st.st_mode) ? DT_DIR :
+			       S_ISREG(st.st_mode) ? DT_REG :
+						     DT_UNKNOWN;
+		}
+		/* Links are not followed, one to a parent would loop */
+		if (type != DT_DIR && type != DT_REG)
+			continue;
+
+		char *path = join(it->path, name);
+		if (ignore_match(ign, path, name, type == DT_DIR))
+			free(path);
+		else
+			push(w, path, ign, type == DT_DIR);
+	}
+	closedir(d);
+}
+
+/* Copy of a matched line for the results list, cut and with tabs and
+ * other control bytes as spaces */
+static char *preview(const char *line, size_t len)
+{
+	if (len && line[len - 1] == '\r')
+		len--;
+	if (len > GREP_PREVIEW_MAX)
+		len = GREP_PREVIEW_MAX;
+	char *s = xmalloc(len + 1);
+	for (size_t i = 0; i < len; i++)
+		s[i] = ((unsigned char)line[i] < 32) ? ' ' : line[i];
+	s[len] = '\0';
+	return s;
+}
+
+/* Finds the lines of file path that have the pattern */
+static void grep_text(struct grep_worker *w, const char *path,
+		      const char *data, size_t size)
+{
+	struct grep_job *job = w->job;
+	struct grep_match *matches = NULL;
+	int count = 0;
+	/* Lines are counted up to the match, from here */
+	const char *line = data;
+	int line_no = 0;
+
+	for (size_t pos = 0; pos < size;) {
+		size_t n = size - pos;
+		if (n > GREP_WINDOW)
+			n = GREP_WINDOW;
+		int at = search_bytes(data + pos, n, job->pattern, job->len);
+		if (at < 0) {
+			if (n == size - pos)
+				break;
+			/* A match may cross into the next window */
+			pos += n - job->len + 1;
+			continue;
+		}
+
+		const char *hit = data + pos + at;
+		for (const char *p; (p = memchr(line, '\n', hit - line));
+		     line = p + 1)
+			line_no++;
+		const char *eol = memchr(hit, '\n', data + size - hit);
+		if (!eol)
+			eol = data + size;
+
+		matches = xrealloc(matches, (count + 1) * sizeof(*matches));
+		matches[count++] = (struct grep_match){
+			.line = line_no,
+			.col = hit - line,
+			.text = preview(line, eol - line),
+		};
+		if (atomic_fetch_add(&job->matches, 1) + 1 >= GREP_MATCHES_MAX) {
+			stop(job);
+			break;
+		}
+
+		/* One match a line is listed */
+		line = eol + 1;
+		line_no++;
+		pos = line - data;
+	}
+	if (count == 0)
+		return;
+
+	struct grep_found *f = xmalloc(sizeof(*f));
+	*f = (struct grep_found){ xstrdup(path), matches, count, NULL };
+	pthread_mutex_lock(&job->lock);
+	f->next = job->found;
+	job->found = f;
+	pthread_mutex_unlock(&job->lock);
+	wake(job);
+}
+
+/* Greps file it, unless it is binary. Most files fit the first read, only
+ * the ones that do not are looked at with fstat and mapped */
+static void grep_file(struct grep_worker *w, struct grep_item *it)
+{
+	struct grep_job *job = w->job;
+	int fd = openat(job->root_fd, it->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (!w->buf)
+		w->buf = xmalloc(GREP_MAP_MIN);
+
+	const char *data = w->buf;
+	ssize_t n = read(fd, w->buf, GREP_MAP_MIN);
+	size_t size = (n > 0) ? n : 0;
+	int mapped = 0;
+	struct stat st;
+	if (size == GREP_MAP_MIN && fstat(fd, &st) == 0 &&
+	    (size_t)st.st_size > size) {
+		void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			madvise(p, st.st_size, MADV_SEQUENTIAL);
+			data = p;
+			size = st.st_size;
+			mapped = 1;
+		}
+	}
+	close(fd);
+	atomic_fetch_add(&job->files, 1);
+
+	size_t peek = (size < GREP_BINARY_PEEK) ? size : GREP_BINARY_PEEK;
+	if (size && !memchr(data, '\0', peek))
+		grep_text(w, it->path, data, size);
+	if (mapped)
+		munmap((void *)data, size);
+}
+
+static void *grep_thread(void *arg)
+{
+	struct grep_worker *w = arg;
+	struct grep_job *job = w->job;
+	struct grep_item it;
+
+	while (!atomic_load(&job->cancel) &&
+	       (take(w, &it) || take_wait(w, &it))) {
+		if (it.dir)
+			list_dir(w, &it);
+		else
+			grep_file(w, &it);
+		free(it.path);
+		/* The last one lets the waiting workers go */
+		if (atomic_fetch_sub(&job->pending, 1) == 1)
+			wake_idle(job, 1);
+	}
+
+	atomic_fetch_sub(&job->running, 1);
+	(void)write(job->pipe[1], "", 1);
+	return NULL;
+}
+
+/* Frees the results list */
+static void grep_clear(struct grep *g)
+{
+	for (int i = 0; i < g->file_count; i++)
+		free(g->files[i]);
+	for (int i = 0; i < g->match_count; i++)
+		free(g->matches[i].text);
+	free(g->files);
+	free(g->matches);
+	g->files = NULL;
+	g->file_count = 0;
+	g->matches = NULL;
+	g->match_count = 0;
+	g->match_cap = 0;
+	g->searched = 0;
+	g->cy = 0;
+	g->offset = 0;
+}
+
+static void free_found(struct grep_found *f)
+{
+	while (f) {
+		struct grep_found *next = f->next;
+		for (int i = 0; i < f->count; i++)
+			free(f->matches[i].text);
+		free(f->matches);
+		free(f->path);
+		free(f);
+		f = next;
+	}
+}
+
+/* Joins the threads of a job that are all done and frees it */
+static void job_free(struct grep_job *job)
+{
+	for (int i = 0; i < job->thread_count; i++)
+		pthread_join(job->workers[i].thread, NULL);
+	if (job->timer)
+		event_timer_cancel(job->timer);
+	event_unwatch(job->pipe[0]);
+	close(job->pipe[0]);
+	close(job->pipe[1]);
+	close(job->root_fd);
+
+	for (int i = 0; i < job->worker_count; i++) {
+		struct grep_worker *w = &job->workers[i];
+		/* Left over when cancelled */
+		for (int j = w->queue.head; j < w->queue.tail; j++)
+			free(w->queue.items[j].path);
+		free(w->queue.items);
+		free(w->buf);
+		pthread_mutex_destroy(&w->queue.lock);
+	}
+	free_found(job->found);
+	ignore_free(job->ignores);
+	pthread_mutex_destroy(&job->lock);
+	pthread_mutex_destroy(&job->idle_lock);
+	pthread_cond_destroy(&job->idle);
+
+	for (struct grep_job **p = &jobs; *p; p = &(*p)->next) {
+		if (*p == job) {
+			*p = job->next;
+			break;
+		}
+	}
+	free(job);
+}
+
+/* Moves the matches workers found into the results list */
+static void take_found(struct grep *g, struct grep_job *job)
+{
+	pthread_mutex_lock(&job->lock);
+	struct grep_found *f = job->found;
+	job->found = NULL;
+	pthread_mutex_unlock(&job->lock);
+
+	/* Oldest first, in the order they were found */
+	struct grep_found *list = NULL;
+	while (f) {
+		struct grep_found *next = f->next;
+		f->next = list;
+		list = f;
+		f = next;
+	}
+
+	for (f = list; f; f = list) {
+		list = f->next;
+		g->files = xrealloc(g->files,
+				    (g->file_count + 1) * sizeof(*g->files));
+		g->files[g->file_count] = f->path;
+		if (g->match_count + f->count > g->match_cap) {
+			g->match_cap = (g->match_count + f->count) * 2;
+			g->matches = xrealloc(g->matches, g->match_cap *
+								  sizeof(*g->matches));
+		}
+		for (int i = 0; i < f->count; i++) {
+			f->matches[i].file = g->file_count;
+			g->matches[g->match_count++] = f->matches[i];
+		}
+		g->file_count++;
+		free(f->matches);
+		free(f);
+	}
+	g->searched = atomic_load(&job->files);
+}
+
+static void grep_event(struct editor *e, void *data)
+{
+	struct grep_job *job = data;
+	struct grep *g = &e->grep;
+	char drain[256];
+
+	/* Looked at before the results, which are all in once it is 0 */
+	int done = atomic_load(&job->running) == 0;
+	atomic_store(&job->woken, 0);
+	while (read(job->pipe[0], drain, sizeof(drain)) > 0)
+		;
+
+	if (g->job == job) {
+		take_found(g, job);
+		if (done)
+			g->job = NULL;
+		if (done && g->match_count >= GREP_MATCHES_MAX)
+			set_message(e, "Stopped after %d matches",
+				    GREP_MATCHES_MAX);
+	}
+	if (done)
+		job_free(job);
+}
+
+/* Redraws the count of files searched while the search runs */
+static void grep_progress(struct editor *e, void *data)
+{
+	struct grep_job *job = data;
+	if (e->grep.job == job)
+		e->grep.searched = atomic_load(&job->files);
+}
+
+/* Stops the running search, its threads finish on their own */
+static void grep_cancel(struct grep *g)
+{
+	if (!g->job)
+		return;
+	stop(g->job);
+	event_timer_cancel(g->job->timer);
+	g->job->timer = 0;
+	g->job = NULL;
+}
+
+/* Starts grepping the explorer's directory for the pattern */
+static void grep_start(struct editor *e)
+{
+	struct grep *g = &e->grep;
+	grep_cancel(g);
+	grep_clear(g);
+	strcpy(g->root, e->cwd);
+
+	struct grep_job *job = xcalloc(1, sizeof(*job));
+	job->root_fd = open(g->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (job->root_fd < 0) {
+		free(job);
+		set_message(e, "Err: Cannot access %s", g->root);
+		return;
+	}
+	if (pipe(job->pipe) != 0) {
+		close(job->root_fd);
+		free(job);
+		set_message(e, "Err: cannot start grep");
+		return;
+	}
+	fcntl(job->pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(job->pipe[1], F_SETFL, O_NONBLOCK);
+	memcpy(job->pattern, g->pattern, g->len);
+	job->len = g->len;
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_mutex_init(&job->idle_lock, NULL);
+	pthread_cond_init(&job->idle, NULL);
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	job->worker_count = (cpus > GREP_THREADS_MAX) ? GREP_THREADS_MAX :
+			    (cpus > 1)		      ? cpus :
+							1;
+	for (int i = 0; i < job->worker_count; i++) {
+		job->workers[i].job = job;
+		job->workers[i].id = i;
+		pthread_mutex_init(&job->workers[i].queue.lock, NULL);
+	}
+	push(&job->workers[0], xstrdup(""), NULL, 1);
+
+	job->next = jobs;
+	jobs = job;
+	g->job = job;
+	event_watch(job->pipe[0], grep_event, job);
+	job->timer = event_timer(GREP_PROGRESS_MS, 1, grep_progress, job);
+
+	atomic_init(&job->running, job->worker_count);
+	for (int i = 0; i < job->worker_count; i++) {
+		if (pthread_create(&job->workers[i].thread, NULL, grep_thread,
+				   &job->workers[i]) != 0) {
+			atomic_fetch_sub(&job->running, job->worker_count - i);
+			break;
+		}
+		job->thread_count++;
+	}
+
+	/* No threads, search here instead */
+	if (job->thread_count == 0) {
+		atomic_init(&job->running, 1);
+		job->worker_count = 1;
+		grep_thread(&job->workers[0]);
+	}
+}
+
+/* Opens the grep prompt, from the explorer */
+void grep_open(struct editor *e)
+{
+	e->grep.prompt = 1;
+	e->grep.len = 0;
+	e->mode = MODE_GREP;
+}
+
+/* Opens the file of the selected match at its line */
+static void open_match(struct editor *e)
+{
+	struct grep *g = &e->grep;
+	if (g->match_count == 0)
+		return;
+	struct grep_match *m = &g->matches[g->cy];
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s/%s", g->root,
+		     g->files[m->file]) >= (int)sizeof(path)) {
+		set_message(e, "Err: Path too long");
+		return;
+	}
+
+	grep_cancel(g);
+	load_file(e, path);
+	e->mode = MODE_NORMAL;
+
+	struct buffer *b = e->active_buf;
+	buffer_gap_close(b);
+	buffer_scan(b, m->line);
+	if (m->line < b->line_count) {
+		b->cy = m->line;
+		b->current = buffer_line(b, b->cy);
+		b->cx = (m->col < b->current->size) ? m->col : b->current->size;
+	}
+	scroll_to_cursor(e);
+
+	/* n and N go on from here */
+	struct search *s = &e->search;
+	memcpy(s->pattern, g->pattern, g->len);
+	s->len = g->len;
+	s->dir = 1;
+	s->highlight = 1;
+	e->drawn_buf = NULL;
+}
+
+/* Moves the selection by n results */
+static void select_match(struct editor *e, int n)
+{
+	struct grep *g = &e->grep;
+	int rows = e->screen_rows - 2;
+	g->cy += n;
+	if (g->cy >= g->match_count)
+		g->cy = g->match_count - 1;
+	if (g->cy < 0)
+		g->cy = 0;
+	if (g->cy < g->offset)
+		g->offset = g->cy;
+	if (g->cy >= g->offset + rows)
+		g->offset = g->cy - rows + 1;
+}
+
+void handle_grep_input(struct editor *e, int c)
+{
+	struct grep *g = &e->grep;
+
+	if (g->prompt) {
+		switch (c) {
+		case KEY_ESCAPE:
+			g->prompt = 0;
+			if (!g->job && g->match_count == 0)
+				e->mode = MODE_EXPLORER;
+			break;
+		case KEY_RETURN:
+			if (g->len == 0)
+				break;
+			g->prompt = 0;
+			grep_start(e);
+			break;
+		case KEY_BACKSPACE:
+			if (g->len == 0)
+				handle_grep_input(e, KEY_ESCAPE);
+			else
+				g->len--;
+			break;
+		default:
+			if (c >= 32 && c <= 255 && c != 127 &&
+			    g->len < SEARCH_MAX)
+				g->pattern[g->len++] = c;
+			break;
+		}
+		return;
+	}
+
+	switch (c) {
+	case 'q':
+	case KEY_ESCAPE: /* Back to the explorer */
+		grep_cancel(g);
+		e->mode = MODE_EXPLORER;
+		break;
+	case 'j':
+	case KEY_DOWN:
+		select_match(e, 1);
+		break;
+	case 'k':
+	case KEY_UP:
+		select_match(e, -1);
+		break;
+	case KEY_NPAGE:
+		select_match(e, e->screen_rows - 2);
+		break;
+	case KEY_PPAGE:
+		select_match(e, -(e->screen_rows - 2));
+		break;
+	case '/': /* Search for something else */
+		grep_open(e);
+		break;
+	case KEY_RETURN:
+		open_match(e);
+		break;
+	}
+}
+
+void draw_grep(struct editor *e)
+{
+	struct grep *g = &e->grep;
+	int rows = e->screen_rows;
+	int cols = e->screen_cols;
+	screen_erase();
+
+	int x = screen_print(0, 0, A_REVERSE | A_BOLD,
+			     " Grep: %.*s in %s | %d in %d files, %d searched%s ",
+			     g->len, g->pattern, g->root, g->match_count,
+			     g->file_count, g->searched,
+			     g->job ? "..." : "");
+	screen_fill(0, x, cols - x, ' ' | A_REVERSE | A_BOLD);
+
+	for (int y = 1; y < rows - 1; y++) {
+		int i = y - 1 + g->offset;
+		if (i >= g->match_count)
+			break;
+		struct grep_match *m = &g->matches[i];
+		chtype attr = (i == g->cy && !g->prompt) ? A_REVERSE : 0;
+		x = screen_print(y, 1, attr | COLOR_PAIR(1) | A_BOLD, "%s",
+				 g->files[m->file]);
+		x = screen_print(y, x, attr, ":%d: ", m->line + 1);
+		if (x < cols)
+			screen_print(y, x, attr, "%.*s", cols - x, m->text);
+	}
+
+	if (g->prompt) {
+		x = screen_print(rows - 1, 0, 0, "grep: %.*s", g->len,
+				 g->pattern);
+		screen_cursor(rows - 1, x, 1);
+	} else {
+		if (e->message[0])
+			screen_print(rows - 1, 0, A_REVERSE, "%s", e->message);
+		screen_cursor(0, 0, 0);
+	}
+}
+
+/* Stops all searches and waits for their threads, before quitting */
+void grep_wait(struct editor *e)
+{
+	grep_cancel(&e->grep);
+	while (jobs) {
+		stop(jobs);
+		job_free(jobs);
+	}
+	grep_clear(&e->grep);
+}
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kiuru.h"
+#include "screen.h"
+#include "util.h"
+
+/*
+ * Headless screen. Keeps the cell grid in memory and takes keys from a
+ * script instead of a terminal, so whole sessions can be timed and
+ * replayed the same way every time. A script is text where each byte is a
+ * key, except for names in angle brackets like vim's:
+ *
+ *	<Esc> <CR> <BS> <Del> <Tab> <Up> <Down> <Left> <Right>
+ *	<PageUp> <PageDown> <PasteStart> <PasteEnd> <lt> <C-x>
+ *
+ * Newlines are skipped so scripts can be wrapped, <CR> is Enter. Keys
+ * never time out, and once the script runs out every read gives KEY_EOF.
+ * Text between <PasteStart> and <PasteEnd> is pasted.
+ */
+
+static chtype *grid;
+static int grid_rows;
+static int grid_cols;
+static int cursor_y;
+static int cursor_x;
+static int cursor_visible;
+
+static int *keys;
+static int key_count;
+static int key_next;
+
+static const struct {
+	const char *name;
+	int key;
+} key_names[] = {
+	{ "Esc", KEY_ESCAPE },	    { "CR", KEY_RETURN },
+	{ "Enter", KEY_RETURN },    { "BS", KEY_BACKSPACE },
+	{ "Del", KEY_DC },	    { "Tab", '\t' },
+	{ "Up", KEY_UP },	    { "Down", KEY_DOWN },
+	{ "Left", KEY_LEFT },	    { "Right", KEY_RIGHT },
+	{ "PageUp", KEY_PPAGE },    { "PageDown", KEY_NPAGE },
+	{ "PasteStart", KEY_PASTE_START }, { "PasteEnd", KEY_PASTE_END },
+	{ "lt", '<' },
+};
+
+/* Key named by the text between < and >, or ERR */
+static int key_by_name(const char *name, int len)
+{
+	if (len == 3 && name[0] == 'C' && name[1] == '-')
+		return name[2] & 0x1f;
+	for (size_t i = 0; i < sizeof(key_names) / sizeof(key_names[0]); i++)
+		if ((int)strlen(key_names[i].name) == len &&
+		    strncmp(key_names[i].name, name, len) == 0)
+			return key_names[i].key;
+	return ERR;
+}
+
+static void parse_script(const char *script, size_t len)
+{
+	free(keys);
+	keys = xmalloc((len ? len : 1) * sizeof(*keys));
+	key_count = 0;
+	key_next = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		if (script[i] == '\n')
+			continue;
+		if (script[i] == '<') {
+			const char *end = memchr(script + i, '>', len - i);
+			int key = end ? key_by_name(script + i + 1,
+						    end - script - i - 1) :
+					ERR;
+			if (key != ERR) {
+				keys[key_count++] = key;
+				i = end - script;
+				continue;
+			}
+		}
+		/* Anything else is the key itself */
+		keys[key_count++] = (unsigned char)script[i];
+	}
+}
+
+static chtype *row_at(int y)
+{
+	return &grid[(size_t)y * grid_cols];
+}
+
+static void blank(int y, int x, int n)
+{
+	chtype *row = row_at(y);
+	for (int i = x; i < x + n; i++)
+		row[i] = ' ';
+}
+
+/* Opens a rows x cols screen that reads keys from the script */
+void headless_open(int rows, int cols, const char *script, size_t len)
+{
+	grid_rows = rows;
+	grid_cols = cols;
+	grid = xrealloc(grid, (size_t)rows * cols * sizeof(*grid));
+	for (int y = 0; y < rows; y++)
+		blank(y, 0, cols);
+	cursor_y = 0;
+	cursor_x = 0;
+	cursor_visible = 1;
+	parse_script(script, len);
+	screen_use(&headless_screen);
+}
+
+/* Cells of row y as last drawn, grid_cols of them */
+const chtype *headless_row(int y)
+{
+	return row_at(y);
+}
+
+/* Writes the screen as text, one line per row without trailing blanks.
+ * Attributes are left out */
+void headless_dump(FILE *f)
+{
+	for (int y = 0; y < grid_rows; y++) {
+		const chtype *row = row_at(y);
+		int n = grid_cols;
+		while (n > 0 && (row[n - 1] & A_CHARTEXT) == ' ')
+			n--;
+		for (int x = 0; x < n; x++)
+			fputc(row[x] & A_CHARTEXT, f);
+		fputc('\n', f);
+	}
+}
+
+static void headless_size(int *rows, int *cols)
+{
+	*rows = grid_rows;
+	*cols = grid_cols;
+}
+
+static void headless_put(int y, int x, const chtype *cells, int n)
+{
+	memcpy(&row_at(y)[x], cells, n * sizeof(*cells));
+}
+
+static void headless_clear_eol(int y, int x)
+{
+	if (y >= 0 && y < grid_rows && x < grid_cols)
+		blank(y, x, grid_cols - x);
+}
+
+static void headless_scroll(int top, int bottom, int n)
+{
+	int height = bottom - top + 1;
+	if (abs(n) >= height) {
+		for (int y = top; y <= bottom; y++)
+			blank(y, 0, grid_cols);
+		return;
+	}
+
+	size_t row_bytes = (size_t)grid_cols * sizeof(*grid);
+	if (n > 0) {
+		memmove(row_at(top), row_at(top + n), (height - n) * row_bytes);
+		for (int y = bottom - n + 1; y <= bottom; y++)
+			blank(y, 0, grid_cols);
+	} else if (n < 0) {
+		memmove(row_at(top - n), row_at(top), (height + n) * row_bytes);
+		for (int y = top; y < top - n; y++)
+			blank(y, 0, grid_cols);
+	}
+}
+
+static void headless_erase(void)
+{
+	for (int y = 0; y < grid_rows; y++)
+		blank(y, 0, grid_cols);
+}
+
+static void headless_cursor(int y, int x, int visible)
+{
+	cursor_visible = visible;
+	if (visible) {
+		cursor_y = y;
+		cursor_x = x;
+	}
+}
+
+static void headless_flush(void)
+{
+	/* Nothing to send anywhere, the grid is the screen */
+}
+
+/* Keys of the script come one per frame, as if typed. None is pending
+ * when the main loop looks for more without waiting */
+static int headless_key(int timeout_ms)
+{
+	if (timeout_ms == 0)
+		return ERR;
+	if (key_next == key_count)
+		return KEY_EOF;
+	return keys[key_next++];
+}
+
+static int headless_suspend(void)
+{
+	/* No terminal to hand over */
+	return -1;
+}
+
+static void headless_resume(void)
+{
+}
+
+/* Leaves the final screen on stdout, like a terminal would show it */
+static void headless_end(void)
+{
+	headless_dump(stdout);
+	fflush(stdout);
+}
+
+const struct screen_ops headless_screen = {
+	.size = headless_size,
+	.put = headless_put,
+	.clear_eol = headless_clear_eol,
+	.scroll_rows = headless_scroll,
+	.erase_all = headless_erase,
+	.cursor = headless_cursor,
+	.flush = headless_flush,
+	.fd = -1,
+	.key = headless_key,
+	.suspend = headless_suspend,
+	.resume = headless_resume,
+	.end = headless_end,
+};
@@ -0,0 +1,169 @@
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "kiuru.h"
+
+/*
+ * .gitignore rules, for the walks of grep and the file finder. Covers
+ * what most .gitignores use: globs, ! to take a path back, a trailing /
+ * for directories only, a / that anchors to the .gitignore's directory
+ * and ** between slashes for any number of directories. The global
+ * excludes and .git/info/exclude are not read.
+ */
+
+/* Biggest .gitignore read */
+#define IGNORE_FILE_MAX (1 << 20)
+
+/* Parses the .gitignore in text, rules of the directory dir */
+static struct ignore *parse_ignore(char *text, const char *dir,
+				   struct ignore *parent)
+{
+	struct ignore *ign = xcalloc(1, sizeof(*ign));
+	ign->parent = parent;
+	ign->dir = xstrdup(dir);
+	ign->dir_len = strlen(dir);
+
+	for (char *line = text, *next; line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		size_t len = strlen(line);
+		while (len && (line[len - 1] == '\r' || line[len - 1] == ' '))
+			line[--len] = '\0';
+		if (len == 0 || line[0] == '#')
+			continue;
+
+		struct ignore_rule r = { 0 };
+		if (line[0] == '!') {
+			r.negate = 1;
+			line++;
+			len--;
+		}
+		if (len && line[len - 1] == '/') {
+			r.dir_only = 1;
+			line[--len] = '\0';
+		}
+		/* A leading ** and slash matches in any directory, like no
+		 * slash at all, unless there is another slash after it */
+		char *rest = strncmp(line, "**/", 3) == 0 ? line + 3 : line;
+		if (strchr(rest, '/'))
+			r.anchored = 1;
+		else
+			line = rest;
+		if (line[0] == '/')
+			line++;
+		if (line[0] == '\0')
+			continue;
+		r.glob = xstrdup(line);
+
+		ign->rules = xrealloc(ign->rules,
+				      (ign->count + 1) * sizeof(*ign->rules));
+		ign->rules[ign->count++] = r;
+	}
+	return ign;
+}
+
+/* Reads the .gitignore of directory fd, which is path from the root of
+ * the walk. Returns the rules for what is inside, parent if it has none.
+ * The caller owns what it returns when that is not parent */
+struct ignore *ignore_read(int fd, const char *path, struct ignore *parent)
+{
+	int ifd = openat(fd, ".gitignore", O_RDONLY | O_CLOEXEC);
+	if (ifd < 0)
+		return parent;
+
+	/* Most are a few hundred bytes */
+	struct stat st;
+	size_t size = IGNORE_FILE_MAX;
+	if (fstat(ifd, &st) == 0 && (size_t)st.st_size < size)
+		size = st.st_size;
+
+	char *text = xmalloc(size + 1);
+	size_t len = 0;
+	ssize_t n;
+	while (len < size && (n = read(ifd, text + len, size - len)) > 0)
+		len += n;
+	close(ifd);
+	text[len] = '\0';
+
+	struct ignore *ign = parse_ignore(text, path, parent);
+	free(text);
+	return ign;
+}
+
+/* fnmatch of path with FNM_PATHNAME, except that a ** between slashes,
+ * or leading with a slash after it, also matches any number of
+ * directories */
+static int path_match(const char *glob, const char *path)
+{
+	if (strncmp(glob, "**/", 3) == 0) {
+		for (const char *p = path; p; p = strchr(p, '/')) {
+			if (*p == '/')
+				p++;
+			if (path_match(glob + 3, p))
+				return 1;
+		}
+		return 0;
+	}
+
+	const char *stars = strstr(glob, "/**/");
+	if (!stars)
+		return fnmatch(glob, path, FNM_PATHNAME) == 0;
+
+	/* What is before it matches the first directories of path, what
+	 * is after the rest of it with the ** leading */
+	char head[PATH_MAX], dirs[PATH_MAX];
+	size_t len = stars - glob;
+	if (len >= sizeof(head))
+		return 0;
+	memcpy(head, glob, len);
+	head[len] = '\0';
+	for (const char *p = strchr(path, '/'); p; p = strchr(p + 1, '/')) {
+		len = p - path;
+		if (len >= sizeof(dirs))
+			return 0;
+		memcpy(dirs, path, len);
+		dirs[len] = '\0';
+		if (fnmatch(head, dirs, FNM_PATHNAME) == 0 &&
+		    path_match(stars + 1, p + 1))
+			return 1;
+	}
+	return 0;
+}
+
+/* 1 if a .gitignore says to skip path, whose last part is name. Rules
+ * deeper down and later in a file win */
+int ignore_match(struct ignore *ign, const char *path, const char *name,
+		 int dir)
+{
+	for (; ign; ign = ign->parent) {
+		const char *rel = path + (ign->dir_len ? ign->dir_len + 1 : 0);
+		for (int i = ign->count - 1; i >= 0; i--) {
+			struct ignore_rule *r = &ign->rules[i];
+			if (r->dir_only && !dir)
+				continue;
+			if (r->anchored ? path_match(r->glob, rel) :
+					  fnmatch(r->glob, name, 0) == 0)
+				return !r->negate;
+		}
+	}
+	return 0;
+}
+
+/* Frees a list of rules linked by next */
+void ignore_free(struct ignore *list)
+{
+	while (list) {
+		struct ignore *next = list->next;
+		for (int i = 0; i < list->count; i++)
+			free(list->rules[i].glob);
+		free(list->rules);
+		free(list->dir);
+		free(list);
+		list = next;
+	}
+}
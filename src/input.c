@@ -1,42 +1,45 @@
-#include <ncurses.h>
+#include <stdlib.h>
 #include "kiuru.h"
+#include "screen.h"
 
-/* Sets cursor to buffer head */
+/* Moves cursor to line n, clamped to the buffer */
+static void goto_line(struct editor *e, int n)
+{
+	/* Lines of a huge file may not be split yet that far */
+	buffer_scan(e->active_buf, n);
+
+	if (n >= e->active_buf->line_count)
+		n = e->active_buf->line_count - 1;
+	if (n < 0)
+		n = 0;
+	e->active_buf->cy = n;
+	e->active_buf->current = buffer_line(e->active_buf, n);
+}
+
+/* Sets cursor to first line */
 static void to_first_line(struct editor *e)
 {
-	e->active_buf->current = e->active_buf->head;
-	e->active_buf->cy = 0;
+	goto_line(e, 0);
 	e->active_buf->cx = 0;
 }
 
-/* Sets cursor to buffer tail */
+/* Sets cursor to last line */
 static void to_last_line(struct editor *e)
 {
-	e->active_buf->current = e->active_buf->tail;
-	e->active_buf->cy = e->active_buf->line_count - 1;
+	goto_line(e, INT_MAX);
 	e->active_buf->cx = 0;
 }
 
 /* Move cursor up by one page */
 static void page_up(struct editor *e)
 {
-	for (int i = 0; i < e->screen_rows - 1; i++) {
-		if (e->active_buf->current->prev) {
-			e->active_buf->cy--;
-			e->active_buf->current = e->active_buf->current->prev;
-		}
-	}
+	goto_line(e, e->active_buf->cy - (e->screen_rows - 1));
 }
 
 /* Move cursor down by one page */
 static void page_down(struct editor *e)
 {
-	for (int i = 0; i < e->screen_rows - 1; i++) {
-		if (e->active_buf->current->next) {
-			e->active_buf->cy++;
-			e->active_buf->current = e->active_buf->current->next;
-		}
-	}
+	goto_line(e, e->active_buf->cy + (e->screen_rows - 1));
 }
 
 static void move_cursor(struct editor *e, int key)
@@ -62,30 +65,35 @@ static void move_cursor(struct editor *e, int key)
 		break;
 	case KEY_UP:
 	case 'k':
-		if (e->active_buf->current->prev) {
+		if (e->active_buf->cy > 0) {
 			e->active_buf->cy--;
-			e->active_buf->current = e->active_buf->current->prev;
+			e->active_buf->current = buffer_prev_line(
+				e->active_buf, e->active_buf->current);
 		}
 		break;
 	case KEY_DOWN:
 	case 'j':
-	case KEY_RETURN: /* Keycode 10 and 13 */
-		if (e->active_buf->current->next) {
+	case KEY_RETURN: { /* Keycode 10 and 13 */
+		struct line *next = buffer_next_line(e->active_buf,
+						     e->active_buf->current);
+		if (next) {
 			e->active_buf->cy++;
-			e->active_buf->current = e->active_buf->current->next;
+			e->active_buf->current = next;
 		}
 		break;
+	}
 	case KEY_PPAGE: /* Page up */
 		page_up(e);
 		break;
 	case KEY_NPAGE: /* Page down */
 		page_down(e);
 		break;
-	case 'g': /* Jump to head */
+	case 'g': { /* Jump to head */
 		/* Wait for second 'g' */
-		if (getch() == 'g')
+		if (screen_key(-1) == 'g')
 			to_first_line(e);
 		break;
+	}
 
 	case 'G': /* Jump to tail */
 		to_last_line(e);
@@ -112,6 +120,7 @@ static void handle_normal_mode(struct editor *e, int c)
 		break;
 	case 'H': /* TODO: make long command */
 		show_help_page();
+		e->drawn_buf = NULL;
 		break;
 	case KEY_UP:
 	case KEY_DOWN:
@@ -141,8 +150,34 @@ static void handle_normal_mode(struct editor *e, int c)
 	case 'E': /* Open explorer */
 		open_explorer(e, ".");
 		break;
+	case 'F': /* Find a file by name */
+		finder_open(e);
+		break;
 	case 'K':
 		open_man_page(e);
+		e->drawn_buf = NULL;
+		break;
+	case '/': /* Search forward */
+		search_open(e, 1);
+		break;
+	case '?': /* Search backward */
+		search_open(e, -1);
+		break;
+	case 'n': /* Next match */
+		search_next(e, 1);
+		break;
+	case 'N': /* Previous match */
+		search_next(e, -1);
+		break;
+	case KEY_ESCAPE: /* Stop highlighting matches */
+		if (e->search.highlight) {
+			e->search.highlight = 0;
+			e->drawn_buf = NULL;
+		}
+		break;
+	case 'T': /* Toggle latency overlay */
+		if (e->latency)
+			e->latency_overlay = !e->latency_overlay;
 		break;
 	}
 }
@@ -177,33 +212,101 @@ static void handle_insert_mode(struct editor *e, int c)
 	}
 }
 
-void handle_input(struct editor *e)
+/* Inserts a bracketed paste as text in one go, in normal mode too, so
+ * its letters are never taken as commands. At the search and grep prompts
+ * it is typed into the pattern, in the finder into the query */
+static void paste(struct editor *e)
 {
+	size_t len;
+	char *text = screen_paste(&len);
+	if (e->mode == MODE_SEARCH) {
+		for (size_t i = 0; i < len && text[i] != '\n'; i++)
+			handle_search_input(e, (unsigned char)text[i]);
+	} else if (e->mode == MODE_GREP) {
+		for (size_t i = 0; i < len && text[i] != '\n' && e->grep.prompt;
+		     i++)
+			handle_grep_input(e, (unsigned char)text[i]);
+	} else if (e->mode == MODE_FINDER) {
+		for (size_t i = 0; i < len && text[i] != '\n'; i++)
+			handle_finder_input(e, (unsigned char)text[i]);
+	} else if (e->mode != MODE_EXPLORER) {
+		insert_text(e, text, len);
+	}
+	free(text);
+}
+
+void handle_input(struct editor *e, int c)
+{
+	/* The message goes away with the next key. Frames drawn before it
+	 * for timers, workers and idle work keep it */
+	e->message[0] = '\0';
+
 	if (e->mode == MODE_EXPLORER) {
-		handle_explorer_input(e);
+		if (c == KEY_PASTE_START)
+			paste(e);
+		else
+			handle_explorer_input(e, c);
 		return;
 	}
-	int c = getch();
+	if (e->mode == MODE_GREP) {
+		if (c == KEY_PASTE_START)
+			paste(e);
+		else
+			handle_grep_input(e, c);
+		return;
+	}
+	if (e->mode == MODE_FINDER) {
+		if (c == KEY_PASTE_START)
+			paste(e);
+		else
+			handle_finder_input(e, c);
+		return;
+	}
+
+	/* A search still going on in idle time would move the cursor away
+	 * from under this key */
+	if (e->mode != MODE_SEARCH)
+		search_cancel(e);
 
-	if (e->mode == MODE_NORMAL)
+	if (c == KEY_PASTE_START)
+		paste(e);
+	else if (e->mode == MODE_NORMAL)
 		handle_normal_mode(e, c);
+	else if (e->mode == MODE_SEARCH)
+		handle_search_input(e, c);
 	else
 		handle_insert_mode(e, c);
 
+	/* Typing keeps the current line in a gap buffer, which is closed
+	 * when the cursor leaves the line or insert mode */
+	if (e->mode != MODE_INSERT ||
+	    e->active_buf->cy != e->active_buf->gap_row)
+		buffer_gap_close(e->active_buf);
+
+	scroll_to_cursor(e);
+}
+
+/* Scrolls the active buffer so the cursor is on screen */
+void scroll_to_cursor(struct editor *e)
+{
 	/* Reserve space for status bar */
 	int h_limit = e->screen_rows - 1;
 
 	/* Row scrolling */
-	if (e->active_buf->cy < e->active_buf->row_offset)
-		e->active_buf->row_offset = e->active_buf->cy;
-	if (e->active_buf->cy >= e->active_buf->row_offset + h_limit)
-		e->active_buf->row_offset = e->active_buf->cy - h_limit + 1;
+	int row_offset = e->active_buf->row_offset;
+	if (e->active_buf->cy < row_offset)
+		row_offset = e->active_buf->cy;
+	if (e->active_buf->cy >= row_offset + h_limit)
+		row_offset = e->active_buf->cy - h_limit + 1;
+	if (row_offset != e->active_buf->row_offset)
+		buffer_scroll(e->active_buf, row_offset);
 
 	/*
 	 * Col scrolling
 	 * TODO: Some padding, like opt.scrolloff in vim
 	 */
-	int rx = cx_to_rx(e->active_buf->current, e->active_buf->cx);
+	int rx = cx_to_rx(e->active_buf, e->active_buf->current,
+			  e->active_buf->cx);
 
 	if (rx < e->active_buf->col_offset)
 		e->active_buf->col_offset = rx;
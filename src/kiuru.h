@@ -3,6 +3,7 @@
 
 #include <limits.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include "util.h"
 
 #ifndef PATH_MAX
@@ -27,46 +28,373 @@ enum editor_mode {
 	MODE_NORMAL,
 	MODE_INSERT,
 	MODE_EXPLORER,
+	MODE_SEARCH,
+	MODE_GREP,
+	MODE_FINDER,
 };
 
+/* Lines this short keep their text inside struct line */
+#define LINE_INLINE_MAX 12
+
 struct line {
+	union {
+		struct {
+			char *data;
+			/* Line text, not NUL terminated. Points into the
+			 * original file contents until the line is edited,
+			 * after that it is owned by the line and comes from
+			 * the buffer's arena */
+			int capacity;
+			/* Max line capacity, grown if necessary. 0 means the
+			 * text is read-only and gets copied on first edit,
+			 * otherwise it is the arena allocation size. Negative
+			 * for owned text a save is still writing, that is
+			 * copied on first edit too. LINE_CHUNKED for text
+			 * kept in chunks, LINE_GAPPED for text with a gap */
+		} __attribute__((packed));
+		char text[LINE_INLINE_MAX];
+		/* Text of lines up to LINE_INLINE_MAX bytes, they never
+		 * use data */
+	};
+	int size;
+	/* Line size, also tells where the text is */
+} __attribute__((aligned(8)));
+
+/* Lines longer than this are kept in chunks once edited, see chunk.c */
+#define LINE_CHUNK_MIN (64 * 1024)
+/* capacity of a chunked line, data then points to its struct line_chunks */
+#define LINE_CHUNKED INT_MIN
+
+/* Piece of the text of a chunked line */
+struct text_chunk {
 	char *data;
-	/* Line text */
 	int size;
-	/* Line size */
 	int capacity;
-	/* Max line capacity, grown if necessary */
-	int lineno;
-	/* Line nro */
-	struct line *next;
-	struct line *prev;
+	/* Same as in struct line, 0 for read-only, negative while a save
+	 * writes it */
+};
+
+/* Text of a chunked line */
+struct line_chunks {
+	struct text_chunk *chunks;
+	int *tree;
+	/* Fenwick tree over chunk sizes, maps byte offsets to chunks */
+	int count;
+	int cap;
+};
+
+/* capacity of the line being typed on, data then points to its struct
+ * line_gap */
+#define LINE_GAPPED (INT_MIN + 1)
+
+/* Text of the line being typed on, held in a gap buffer. The text follows
+ * the header with gap_size unused bytes at offset gap, so typing at the
+ * gap moves nothing */
+struct line_gap {
+	int capacity;
+	/* Allocation size, header included */
+	int gap;
+	int gap_size;
+	char text[];
+};
+
+static inline int line_chunked(const struct line *l)
+{
+	return l->size > LINE_INLINE_MAX && l->capacity == LINE_CHUNKED;
+}
+
+static inline int line_gapped(const struct line *l)
+{
+	return l->size > LINE_INLINE_MAX && l->capacity == LINE_GAPPED;
+}
+
+/* Returns the text of a line, wherever it is kept. For chunked and gapped
+ * lines that is their header, their text is read with line_span */
+static inline char *line_text(struct line *l)
+{
+	return (l->size <= LINE_INLINE_MAX) ? l->text : l->data;
+}
+
+const char *chunks_span(struct line *l, int off, int *len);
+
+/* Returns the text of any line from byte off to the end of the piece it is
+ * kept in, *len is set to the length of that. Walking a whole line takes
+ * one span, two across a gap, or one per chunk */
+static inline const char *line_span(struct line *l, int off, int *len)
+{
+	if (line_chunked(l))
+		return chunks_span(l, off, len);
+	if (line_gapped(l)) {
+		struct line_gap *g = (struct line_gap *)l->data;
+		if (off < g->gap) {
+			*len = g->gap - off;
+			return g->text + off;
+		}
+		*len = l->size - off;
+		return g->text + g->gap_size + off;
+	}
+	*len = l->size - off;
+	return line_text(l) + off;
+}
+
+/* Returns byte i of a line */
+static inline char line_byte(struct line *l, int i)
+{
+	int len;
+	return *line_span(l, i, &len);
+}
+
+/* Lines of a buffer as they were when it was taken, for reading in
+ * another thread. See buffer_freeze */
+struct snapshot {
+	struct line_block **blocks;
+	int *counts;
+	/* Lines of each block when the snapshot was taken */
+	int block_count;
+	int line_count;
+};
+
+/* Arena allocation put aside until a background save is done with it */
+struct held_alloc {
+	void *ptr;
+	size_t size;
+};
+
+/* Line blocks are this big and aligned to it, so the block of any line can
+ * be found from its address */
+#define LINE_BLOCK_SIZE 4096
+/* Lines per block in the line store, the header is padded to 16 bytes */
+#define LINE_BLOCK_MAX ((LINE_BLOCK_SIZE - 16) / sizeof(struct line))
+
+/* Run of consecutive lines. Blocks are the leaves of the line store, so
+ * lines are allocated a block at a time and sit next to each other in
+ * memory */
+struct line_block {
+	int count;
+	/* Lines in use */
+	int index;
+	/* Position in the buffer's block list */
+	int gen;
+	/* Buffer generation the block was made in, see buffer.gen */
+	struct line lines[LINE_BLOCK_MAX];
 };
 
 struct buffer {
 	/* Path to file */
 	char path[PATH_MAX];
 
-	/* First line */
-	struct line *head;
-	/* Last line */
-	struct line *tail;
-	/* Current line (where cursor sits) */
+	/* Original file contents, never modified. Mapped for huge files */
+	char *orig;
+	size_t orig_size;
+	int orig_mapped;
+	/* Bytes of orig already split into lines, the rest is found when
+	 * those lines are needed */
+	size_t scanned;
+	/* Lines end in CRLF, going by the first line */
+	int crlf;
+	/* Line blocks and edited text come from here, and are given back
+	 * to the system all at once with the buffer */
+	struct arena arena;
+
+	/* Line store, blocks in file order */
+	struct line_block **blocks;
+	int block_count;
+	int block_cap;
+	/* Fenwick tree over block line counts, maps line numbers to blocks
+	 * and back */
+	int *block_tree;
+	/* Current line (where cursor sits). Points into a block, so it is
+	 * fetched again after lines are inserted or removed */
 	struct line *current;
 	int line_count;
 
 	/* Cursor location */
 	int cx, cy;
-	/* Offset from head line, for vertical scroll */
+	/* Offset from first line, for vertical scroll */
 	int row_offset;
+	/* Line at row_offset, where drawing starts. Follows scrolling and is
+	 * fetched again after edits like current */
+	struct line *top;
 	/* Offset from beginning of a line, for horizontal scroll */
 	int col_offset;
 	/* Line gutter width */
 	int gutter_w;
+	/* Lines dirty_from..dirty_to changed since the last draw, nothing
+	 * did if dirty_from > dirty_to */
+	int dirty_from;
+	int dirty_to;
+
+	/* Background save in progress, or NULL */
+	struct save_job *save;
+	/* Snapshots other threads are reading, from saves and searches */
+	int snapshots;
+	/* Bumped when a snapshot is taken. While any is held, blocks of
+	 * older generations may belong to one and are copied before they
+	 * are changed */
+	int gen;
+	/* Render column indexes of long lines, see rx.c */
+	struct rx_index *rx_cache;
+	/* Line held in a gap buffer while typing on it, -1 for none */
+	int gap_row;
+
+	/* Arena memory snapshots still read, given back after the last one */
+	struct held_alloc *held;
+	int held_count;
+	int held_cap;
 
 	struct buffer *next;
 	struct buffer *prev;
 };
 
+/* Steps of the main loop timed for each key, see latency.c */
+enum latency_mark {
+	MARK_INPUT,
+	MARK_EDITED,
+	MARK_DRAWN,
+	MARK_FLUSHED,
+	MARK_COUNT
+};
+
+/* Handler the event loop calls for a signal, timer or readable fd */
+typedef void (*event_fn)(struct editor *e, void *data);
+/* Idle work. Works until clock_ns reaches deadline, returns 1 while there
+ * is more to do */
+typedef int (*idle_fn)(struct editor *e, void *data, uint64_t deadline);
+
+/* Longest search pattern, in bytes */
+#define SEARCH_MAX 256
+
+/* Search with / and ?, see search.c */
+struct search {
+	/* Pattern being typed at the prompt, or the last one searched for */
+	char pattern[SEARCH_MAX];
+	int len;
+	/* Pattern before the prompt opened, put back on Esc */
+	char prev[SEARCH_MAX];
+	int prev_len;
+	/* 1 searches forward, -1 backward */
+	int dir;
+	/* Matches of pattern are highlighted */
+	int highlight;
+	/* Cursor and scroll when the prompt opened */
+	int origin_cy;
+	int origin_cx;
+	int origin_row_offset;
+
+	/* Buffer of a search that goes on in idle time, NULL if none runs */
+	struct buffer *buf;
+	/* Way the running search goes, dir or the other way for N */
+	int step;
+	/* Line and byte the running search goes on from */
+	int y;
+	int x;
+	/* Line it started on, it gives up when it gets back there */
+	int start_y;
+	int wrapped;
+	/* Tell about wrapping around and misses in the status bar */
+	int verbose;
+	/* The last search found a match */
+	int found;
+	/* Regex search running in worker threads, NULL if none. See regex.c */
+	struct regex_job *job;
+};
+
+/* A pattern from a .gitignore */
+struct ignore_rule {
+	char *glob;
+	int negate;
+	/* Started with !, takes back a path an earlier rule skipped */
+	int dir_only;
+	/* Ended with /, matches only directories */
+	int anchored;
+	/* Had a / before the end, matched against the path from the
+	 * .gitignore's directory and not just the name */
+};
+
+/* Rules of a .gitignore, see ignore.c. The ones of directories above are
+ * in parent */
+struct ignore {
+	struct ignore *parent;
+	char *dir;
+	int dir_len;
+	/* Directory of the .gitignore relative to the root, "" for it */
+	struct ignore_rule *rules;
+	int count;
+	struct ignore *next;
+	/* List of the owner, freed together with ignore_free */
+};
+
+/* Orders of the explorer, s goes through them */
+enum explorer_sort {
+	SORT_NAME,
+	SORT_MTIME,
+	SORT_SIZE,
+	SORT_DIRS_FIRST,
+	SORT_COUNT,
+};
+
+/* Entry of the directory the explorer shows. Found once per scan, so
+ * drawing and opening it never go to the filesystem */
+struct explorer_entry {
+	uint32_t name;
+	/* Offset of the name in file_names */
+	uint32_t dir;
+	/* It is a directory, or a link to one */
+	int64_t key;
+	/* Modification time or size, for sorting by them */
+};
+
+/* A line a project grep found */
+struct grep_match {
+	int file;
+	/* Index in grep.files */
+	int line;
+	int col;
+	char *text;
+	/* The line, cut at GREP_PREVIEW_MAX bytes */
+};
+
+/* Project grep from the explorer, see grep.c */
+struct grep {
+	/* Pattern being typed, or the one the results are for */
+	char pattern[SEARCH_MAX];
+	int len;
+	/* The pattern is being typed at the prompt */
+	int prompt;
+	/* Directory searched, paths in files are relative to it */
+	char root[PATH_MAX];
+	/* Files with matches, in the order they were found */
+	char **files;
+	int file_count;
+	struct grep_match *matches;
+	int match_count;
+	int match_cap;
+	/* Files looked at so far */
+	int searched;
+	/* Selected result and first one on screen */
+	int cy;
+	int offset;
+	/* Search running in worker threads, NULL when done */
+	struct grep_job *job;
+};
+
+/* Longest query of the file finder, in bytes */
+#define FINDER_QUERY_MAX 128
+
+/* Fuzzy file finder, see finder.c */
+struct finder {
+	char query[FINDER_QUERY_MAX];
+	int len;
+	/* Matches of each start of the query, levels[len] is shown. NULL
+	 * while the finder is closed */
+	struct finder_level *levels;
+	/* Selected result and first one on screen */
+	int cy;
+	int offset;
+	/* Mode it was opened from, Esc goes back there */
+	enum editor_mode back;
+};
+
 struct editor {
 	/* Start of buffer list */
 	struct buffer *buf_head;
@@ -81,33 +409,127 @@ struct editor {
 	/* Status bar message, 80 bytes is resonable for most terminals */
 	char message[80];
 
-	/* Explorer state */
-	struct dirent **file_list;
+	/* What the last draw left on screen, so the next one only redraws
+	 * what changed. NULL drawn_buf repaints everything */
+	struct buffer *drawn_buf;
+	int drawn_rows;
+	int drawn_cols;
+	int drawn_row_offset;
+	int drawn_col_offset;
+	int drawn_gutter_w;
+
+	/* Explorer state, entries sorted by expl_sort */
+	struct explorer_entry *file_list;
 	int file_count;
+	int file_cap;
+	/* Names of the entries, each NUL terminated */
+	char *file_names;
+	size_t file_names_len;
+	size_t file_names_cap;
 	int expl_cy;
 	int expl_offset;
+	enum explorer_sort expl_sort;
+	/* Scan still reading the directory, NULL when done */
+	struct explorer_scan *expl_scan;
 	char cwd[PATH_MAX];
 
+	/* Keystroke latency, NULL if not measured */
+	struct latency *latency;
+	/* Show latency in the status bar instead of the usual */
+	int latency_overlay;
+
+	struct search search;
+	struct grep grep;
+	struct finder finder;
+
 	enum editor_mode mode;
 };
 
 /* Prototypes */
 void buffer_free(struct buffer *b);
 struct buffer *buffer_new();
+struct line *buffer_line(struct buffer *b, int n);
+int buffer_lineno(struct buffer *b, struct line *l);
+struct line *buffer_next_line(struct buffer *b, struct line *l);
+struct line *buffer_prev_line(struct buffer *b, struct line *l);
+void buffer_scroll(struct buffer *b, int row_offset);
+void buffer_scan(struct buffer *b, int n);
+void buffer_damage(struct buffer *b, int from, int to);
+size_t buffer_mem_usage(struct buffer *b);
+void buffer_freeze(struct buffer *b, struct snapshot *snap);
+void buffer_unfreeze(struct buffer *b, struct snapshot *snap);
+void buffer_drop(struct buffer *b, void *ptr, size_t size);
+void buffer_gap_close(struct buffer *b);
+void line_read(struct line *l, int off, int n, char *out);
+void chunks_make(struct buffer *b, struct line *l);
+void chunks_insert(struct buffer *b, struct line *l, int off, const char *s,
+		   int n);
+void chunks_delete(struct buffer *b, struct line *l, int off, int n);
+void chunks_split(struct buffer *b, struct line *l, int off, struct line *dst);
+void chunks_append(struct buffer *b, struct line *dst, struct line *src);
+void chunks_thaw(struct buffer *b, struct line *l);
+void chunks_free(struct buffer *b, struct line *l);
 void delete_char(struct editor *e, int backspace);
 void draw_ui(struct editor *e);
-void handle_input(struct editor *e);
+void handle_input(struct editor *e, int c);
 void insert_char(struct editor *e, int c);
 void insert_newline(struct editor *e);
+void insert_text(struct editor *e, const char *s, size_t len);
 void load_file(struct editor *e, const char *path);
 void quit_editor(struct editor *e, int status);
 void save_file(struct editor *e);
+int save_poll(struct editor *e);
+void save_wait(struct editor *e);
 void set_active_buffer(struct editor *e, struct buffer *b);
 void show_help_page();
-void handle_explorer_input(struct editor *e);
+void handle_explorer_input(struct editor *e, int c);
 void open_explorer(struct editor *e, const char *path);
 void draw_explorer(struct editor *e);
+void explorer_wait(struct editor *e);
 void open_man_page(struct editor *e);
 void init_ncurses(struct editor *e);
+int cx_to_rx(struct buffer *b, struct line *line, int cx);
+int rx_to_cx(struct buffer *b, struct line *line, int rx, int *start);
+void rx_update(struct buffer *b, const char *old_text, struct line *l,
+	       int from);
+void rx_forget(struct buffer *b, const char *text);
+void rx_cache_free(struct buffer *b);
+struct latency *latency_new(const char *path);
+void latency_mark(struct latency *lat, enum latency_mark mark);
+void latency_status(struct latency *lat, char *buf, size_t n);
+void latency_free(struct latency *lat);
+void event_watch(int fd, event_fn fn, void *data);
+void event_unwatch(int fd);
+int event_timer(int ms, int repeat, event_fn fn, void *data);
+void event_timer_cancel(int id);
+void event_idle(idle_fn fn, void *data);
+void event_signal(int sig, event_fn fn, void *data);
+int event_key(struct editor *e);
+void search_open(struct editor *e, int dir);
+void search_next(struct editor *e, int dir);
+void search_cancel(struct editor *e);
+void handle_search_input(struct editor *e, int c);
+int search_find(struct editor *e, struct line *l, int from, int to, int *len);
+void search_done(struct editor *e, int y, int x, int wrapped);
+void regex_start(struct editor *e, int step, int verbose);
+void regex_cancel(struct regex_job *job);
+void regex_wait(void);
+int regex_find(struct editor *e, struct line *l, int from, int to, int *len);
+const char *regex_error(struct editor *e);
+int search_bytes(const char *text, int n, const char *pat, int m);
+struct ignore *ignore_read(int fd, const char *path, struct ignore *parent);
+int ignore_match(struct ignore *ign, const char *path, const char *name,
+		 int dir);
+void ignore_free(struct ignore *list);
+void grep_open(struct editor *e);
+void handle_grep_input(struct editor *e, int c);
+void draw_grep(struct editor *e);
+void grep_wait(struct editor *e);
+void finder_open(struct editor *e);
+void handle_finder_input(struct editor *e, int c);
+void draw_finder(struct editor *e);
+void finder_wait(struct editor *e);
+void scroll_to_cursor(struct editor *e);
+int scan_newlines(const char *p, size_t len, uint32_t *offs, int max);
 
 #endif
@@ -0,0 +1,220 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "kiuru.h"
+#include "util.h"
+
+/*
+ * Keystroke latency. The main loop marks when a key was read, when it was
+ * handled, when the frame after it was drawn and when that frame was
+ * flushed to the terminal. The time between marks goes into a histogram
+ * per phase, and their sum into one for the whole key.
+ *
+ * Histograms are log-linear like HdrHistogram: exact below SUB_COUNT ns,
+ * then every power of two is split into SUB_COUNT / 2 buckets, so a value
+ * is off by at most 1 / 16 whatever its size.
+ */
+
+#define SUB_BITS 5
+#define SUB_COUNT (1 << SUB_BITS)
+#define SUB_HALF (SUB_COUNT / 2)
+/* Enough for any 64 bit value */
+#define HIST_BUCKETS (SUB_COUNT + (64 - SUB_BITS) * SUB_HALF)
+
+enum latency_phase {
+	PHASE_EDIT,
+	/* Key read to handled */
+	PHASE_DRAW,
+	/* Handled to drawn, save progress included */
+	PHASE_FLUSH,
+	/* Drawn to sent to the terminal */
+	PHASE_KEY,
+	/* Key read to sent, the latency the user sees */
+	PHASE_COUNT
+};
+
+static const char *phase_names[PHASE_COUNT] = { "edit", "draw", "flush",
+						"key" };
+
+struct histogram {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+};
+
+struct latency {
+	struct histogram phases[PHASE_COUNT];
+	uint64_t marks[MARK_COUNT];
+	/* Time of each mark for the key in flight */
+	int pending;
+	/* A key was read and its frame is not flushed yet */
+	uint64_t last;
+	/* Latency of the last key */
+	char path[PATH_MAX];
+	/* Where the histograms go on quit, empty for nowhere */
+};
+
+static int bucket_of(uint64_t v)
+{
+	if (v < SUB_COUNT)
+		return v;
+	/* Shift that leaves the top SUB_BITS - 1 bits below the leading one */
+	int shift = 63 - __builtin_clzll(v) - (SUB_BITS - 1);
+	return SUB_COUNT + (shift - 1) * SUB_HALF + (int)(v >> shift) -
+	       SUB_HALF;
+}
+
+/* Smallest value of bucket i */
+static uint64_t bucket_low(int i)
+{
+	if (i < SUB_COUNT)
+		return i;
+	int j = i - SUB_COUNT;
+	int shift = j / SUB_HALF + 1;
+	return (uint64_t)(j % SUB_HALF + SUB_HALF) << shift;
+}
+
+/* Largest value of bucket i */
+static uint64_t bucket_high(int i)
+{
+	return (i + 1 < HIST_BUCKETS) ? bucket_low(i + 1) - 1 : UINT64_MAX;
+}
+
+static void hist_add(struct histogram *h, uint64_t v)
+{
+	h->counts[bucket_of(v)]++;
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+}
+
+/* Value at or below which p per mille of the values are, to the bucket */
+static uint64_t hist_pct(const struct histogram *h, int p)
+{
+	if (!h->count)
+		return 0;
+	uint64_t want = (h->count * p + 999) / 1000;
+	uint64_t seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= want)
+			return (bucket_high(i) < h->max) ? bucket_high(i) :
+							   h->max;
+	}
+	return h->max;
+}
+
+/* Starts measuring. The histograms are written to path on quit, unless it
+ * is NULL */
+struct latency *latency_new(const char *path)
+{
+	struct latency *lat = xcalloc(1, sizeof(*lat));
+	if (path)
+		snprintf(lat->path, sizeof(lat->path), "%s", path);
+	return lat;
+}
+
+/* Marks the time of a step of the main loop. The flush after a key ends
+ * it and its times are added up. Does nothing for a NULL lat, so callers
+ * need not check */
+void latency_mark(struct latency *lat, enum latency_mark mark)
+{
+	if (!lat)
+		return;
+	if (mark == MARK_INPUT)
+		lat->pending = 1;
+	else if (!lat->pending)
+		return;
+	lat->marks[mark] = clock_ns();
+	if (mark != MARK_FLUSHED)
+		return;
+
+	uint64_t *m = lat->marks;
+	hist_add(&lat->phases[PHASE_EDIT], m[MARK_EDITED] - m[MARK_INPUT]);
+	hist_add(&lat->phases[PHASE_DRAW], m[MARK_DRAWN] - m[MARK_EDITED]);
+	hist_add(&lat->phases[PHASE_FLUSH], m[MARK_FLUSHED] - m[MARK_DRAWN]);
+	lat->last = m[MARK_FLUSHED] - m[MARK_INPUT];
+	hist_add(&lat->phases[PHASE_KEY], lat->last);
+	lat->pending = 0;
+}
+
+/* Formats ns for the status bar */
+static void format_ns(char *buf, size_t n, uint64_t ns)
+{
+	if (ns < 1000)
+		snprintf(buf, n, "%dns", (int)ns);
+	else if (ns < 1000000)
+		snprintf(buf, n, "%.1fus", ns / 1e3);
+	else
+		snprintf(buf, n, "%.1fms", ns / 1e6);
+}
+
+/* Writes the status bar overlay: the last key's latency, then median and
+ * 99th percentile of each phase */
+void latency_status(struct latency *lat, char *buf, size_t n)
+{
+	char last[16];
+	format_ns(last, sizeof(last), lat->last);
+	size_t len = snprintf(buf, n,
+			      " [LATENCY] keys %llu | last %s | p50/p99",
+			      (unsigned long long)lat->phases[PHASE_KEY].count,
+			      last);
+
+	for (int i = 0; i < PHASE_COUNT && len < n; i++) {
+		char p50[16], p99[16];
+		format_ns(p50, sizeof(p50), hist_pct(&lat->phases[i], 500));
+		format_ns(p99, sizeof(p99), hist_pct(&lat->phases[i], 990));
+		len += snprintf(buf + len, n - len, " %s %s/%s", phase_names[i],
+				p50, p99);
+	}
+}
+
+/* Writes the histograms to the path given to latency_new as JSON, and
+ * frees lat */
+void latency_free(struct latency *lat)
+{
+	if (!lat)
+		return;
+	FILE *f = lat->path[0] ? fopen(lat->path, "w") : NULL;
+	if (lat->path[0] && !f)
+		fprintf(stderr, "Cannot write latency stats to %s\n",
+			lat->path);
+
+	if (f) {
+		fprintf(f, "{\"unit\": \"ns\", \"phases\": {");
+		for (int i = 0; i < PHASE_COUNT; i++) {
+			const struct histogram *h = &lat->phases[i];
+			fprintf(f,
+				"%s\n  \"%s\": {\"count\": %llu, "
+				"\"mean\": %.0f, \"p50\": %llu, "
+				"\"p90\": %llu, \"p99\": %llu, "
+				"\"p999\": %llu, \"max\": %llu, "
+				"\"buckets\": [",
+				i ? "," : "", phase_names[i],
+				(unsigned long long)h->count,
+				h->count ? (double)h->sum / h->count : 0.0,
+				(unsigned long long)hist_pct(h, 500),
+				(unsigned long long)hist_pct(h, 900),
+				(unsigned long long)hist_pct(h, 990),
+				(unsigned long long)hist_pct(h, 999),
+				(unsigned long long)h->max);
+
+			/* [lowest value, count] of the buckets in use */
+			int first = 1;
+			for (int j = 0; j < HIST_BUCKETS; j++) {
+				if (!h->counts[j])
+					continue;
+				fprintf(f, "%s[%llu, %llu]", first ? "" : ", ",
+					(unsigned long long)bucket_low(j),
+					(unsigned long long)h->counts[j]);
+				first = 0;
+			}
+			fprintf(f, "]}");
+		}
+		fprintf(f, "\n}}\n");
+		fclose(f);
+	}
+	free(lat);
+}
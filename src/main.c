@@ -1,10 +1,24 @@
-﻿#include <ncurses.h>
+﻿#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "kiuru.h"
+#include "screen.h"
+
+/* Most keys handled before a redraw when they come faster than frames */
+#define KEY_BURST_MAX 1024
 
 void quit_editor(struct editor *e, int status)
 {
-	endwin();
+	/* Let pending saves, searches and directory scans finish before
+	 * their buffers go away */
+	save_wait(e);
+	regex_wait();
+	grep_wait(e);
+	explorer_wait(e);
+	finder_wait(e);
+	screen_end();
+	latency_free(e->latency);
 	struct buffer *iter = e->buf_head;
 	while (iter) {
 		struct buffer *next = iter->next;
@@ -15,15 +29,88 @@ void quit_editor(struct editor *e, int status)
 	exit(status);
 }
 
+/* Reads a key script for --replay */
+static char *read_script(const char *path, size_t *len)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+		die("Cannot open key script %s", path);
+
+	size_t cap = 4096;
+	char *script = xmalloc(cap);
+	*len = 0;
+	size_t n;
+	while ((n = fread(script + *len, 1, cap - *len, f)) > 0) {
+		*len += n;
+		if (*len == cap) {
+			cap *= 2;
+			script = xrealloc(script, cap);
+		}
+	}
+	fclose(f);
+	return script;
+}
+
+/* The terminal changed size, draw everything again. ncurses gets the new
+ * size itself */
+static void on_resize(struct editor *e, void *data)
+{
+	e->drawn_buf = NULL;
+}
+
+/* Leaves the terminal as it was, after saves in progress are done */
+static void on_terminate(struct editor *e, void *data)
+{
+	quit_editor(e, 1);
+}
+
 int main(int argc, char *argv[])
 {
 	struct editor e = { 0 };
 	e.mode = MODE_NORMAL;
 
-	init_ncurses(&e);
-	if (argc >= 2) {
+	/*
+	 * --replay FILE runs without a terminal, taking keys from FILE (see
+	 * headless.c) and printing the screen when they run out. --size
+	 * ROWSxCOLS sets the screen size for it, 24x80 by default. --stats
+	 * FILE writes keystroke latency histograms to FILE on quit
+	 */
+	const char *replay = NULL;
+	const char *stats = NULL;
+	int rows = 24, cols = 80;
+	int first = 1;
+	while (first < argc && strncmp(argv[first], "--", 2) == 0) {
+		if (strcmp(argv[first], "--") == 0) {
+			first++;
+			break;
+		}
+		if (first + 1 == argc)
+			die("Missing value for %s", argv[first]);
+		if (strcmp(argv[first], "--replay") == 0)
+			replay = argv[first + 1];
+		else if (strcmp(argv[first], "--stats") == 0)
+			stats = argv[first + 1];
+		else if (strcmp(argv[first], "--size") != 0 ||
+			 sscanf(argv[first + 1], "%dx%d", &rows, &cols) != 2 ||
+			 rows < 2 || cols < 1)
+			die("Usage: kiuru [--replay FILE] [--size ROWSxCOLS] "
+			    "[--stats FILE] [FILE]...");
+		first += 2;
+	}
+
+	e.latency = latency_new(stats);
+	if (replay) {
+		size_t len;
+		char *script = read_script(replay, &len);
+		headless_open(rows, cols, script, len);
+		free(script);
+	} else {
+		init_ncurses(&e);
+	}
+
+	if (first < argc) {
 		/* Load all provided files */
-		for (int i = 1; i < argc; i++)
+		for (int i = first; i < argc; i++)
 			load_file(&e, argv[i]);
 	} else {
 		/* No file provided? Create a "No Name" buffer */
@@ -32,17 +119,31 @@ int main(int argc, char *argv[])
 		set_active_buffer(&e, b);
 	}
 
+	event_signal(SIGWINCH, on_resize, NULL);
+	event_signal(SIGTERM, on_terminate, NULL);
+	event_signal(SIGHUP, on_terminate, NULL);
+
 	while (1) {
 		draw_ui(&e);
+		latency_mark(e.latency, MARK_DRAWN);
+		screen_flush();
+		latency_mark(e.latency, MARK_FLUSHED);
+
+		/* Timers, saves finishing and idle work run while waiting */
+		int c = event_key(&e);
+		if (c == ERR)
+			continue;
+		latency_mark(e.latency, MARK_INPUT);
 
-		int rx = cx_to_rx(e.active_buf->current, e.active_buf->cx);
-		/* Ensure screen_x accounts for gutter and scroll, but never
-		 * enters gutter space */
-		int screen_x = (rx - e.active_buf->col_offset) +
-			       e.active_buf->gutter_w;
-		move(e.active_buf->cy - e.active_buf->row_offset, screen_x);
-		refresh();
-		handle_input(&e);
+		/* Keys already waiting, like a burst from a terminal without
+		 * bracketed paste, are all handled before the next frame */
+		for (int n = 0; c != ERR && n < KEY_BURST_MAX; n++) {
+			if (c == KEY_EOF)
+				quit_editor(&e, 0);
+			handle_input(&e, c);
+			c = (n + 1 < KEY_BURST_MAX) ? screen_key(0) : ERR;
+		}
+		latency_mark(e.latency, MARK_EDITED);
 	}
 
 	return 0;
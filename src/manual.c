@@ -1,8 +1,8 @@
-#include <ncurses.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include "kiuru.h"
+#include "screen.h"
 #include "util.h"
 
 static const char *help_text[] = { "Coming later" };
@@ -14,18 +14,16 @@ void show_help_page()
 	int key;
 
 	while (1) {
-		erase();
+		screen_erase();
 		int rows, cols;
-		getmaxyx(stdscr, rows, cols);
+		screen_size(&rows, &cols);
 
 		/* Draw sticky title bar */
-		attron(A_REVERSE);
-		mvhline(0, 0, ' ', cols);
+		screen_fill(0, 0, cols, ' ' | A_REVERSE);
 		char *title = "The manual";
 		/* Center the title text */
 		int title_x = (cols / 2) - (strlen(title) / 2);
-		mvprintw(0, title_x, "%s", title);
-		attroff(A_REVERSE);
+		screen_print(0, title_x, A_REVERSE, "%s", title);
 
 		/* Draw scrollable content */
 		/* We start drawing from row 1 to leave row 0 for the sticky
@@ -33,16 +31,16 @@ void show_help_page()
 		for (int i = 0; i < rows - 1; i++) {
 			int line_idx = i + offset;
 			if (line_idx < help_line_count) {
-				mvaddnstr(i + 1, 2, help_text[line_idx],
-					  cols - 4);
+				screen_print(i + 1, 2, 0, "%.*s", cols - 4,
+					     help_text[line_idx]);
 			}
 		}
 
-		refresh();
+		screen_flush();
 
 		/* Handle input */
-		key = getch();
-		if (key == KEY_ESCAPE || key == 'q') {
+		key = screen_key(-1);
+		if (key == KEY_ESCAPE || key == 'q' || key == KEY_EOF) {
 			break;
 		} else if (key == KEY_DOWN || key == 'j') {
 			if (offset < help_line_count - (rows - 1))
@@ -53,7 +51,7 @@ void show_help_page()
 		}
 	}
 
-	erase();
+	screen_erase();
 }
 
 void open_man_page(struct editor *e)
@@ -72,21 +70,21 @@ void open_man_page(struct editor *e)
 			return;
 		}
 
-		/* Save terminal state */
-		def_prog_mode();
 		/* Temporarily exit ncurses, this causes a little flash, but its
 		 * not significant enough. Technically, there could be a temp
 		 * buffer before entering man page, but it might be unnecessary
 		 */
-		endwin();
+		if (screen_suspend() != 0) {
+			set_message(e, "Err: No terminal for the man page");
+			free(word);
+			return;
+		}
 
 		char run_cmd[256];
 		snprintf(run_cmd, sizeof(run_cmd), "man %s", word);
 		system(run_cmd);
 
-		/* Restore terminal state */
-		reset_prog_mode();
-		refresh();
+		screen_resume();
 
 		free(word);
 	} else {
@@ -0,0 +1,540 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "kiuru.h"
+
+/*
+ * Regex search, for patterns that start with \v like vim's very magic.
+ * The rest is a POSIX extended regex.
+ *
+ * Matching every line of a big buffer takes too long for the main loop,
+ * so a search takes a snapshot of the lines and splits them into chunks
+ * of REGEX_CHUNK_LINES, in the order the search goes from the cursor.
+ * The part of a mapped file not split into lines yet is searched right
+ * from the mapping, in pieces of REGEX_TAIL_BYTES whose lines the workers
+ * count, so a search never splits the whole file in the main loop.
+ * Worker threads take chunks in that order and note the match of each
+ * nearest the cursor. Chunks are looked at in order as they finish, so
+ * the match after the cursor is taken as soon as the chunks before it
+ * are done, while later ones may still run.
+ *
+ * A newer search cancels the one in flight. Its threads stop at their
+ * next check and the job is freed once the last one is out, the main
+ * loop never waits for them.
+ */
+
+/* Lines in a chunk handed to a worker */
+#define REGEX_CHUNK_LINES 8192
+#define REGEX_THREADS_MAX 8
+/* Bytes of the unsplit end of a mapped file in a chunk */
+#define REGEX_TAIL_BYTES (4 << 20)
+/* Lines a worker matches between looks at the cancel flag */
+#define REGEX_CANCEL_LINES 256
+/* Bytes past the visible part of a line matched for highlighting */
+#define REGEX_VIEW_SLACK 4096
+
+/* Lines start..end of the snapshot, walked from start, or a piece of the
+ * unsplit tail */
+struct regex_chunk {
+	int start;
+	int end;
+	int limit;
+	/* On the first line only matches after this byte count going
+	 * forward, before it going backward */
+	int piece;
+	/* Index of the tail piece in file order, -1 for snapshot lines */
+	int lines;
+	/* Lines of the tail piece, counted when it is all looked at */
+	atomic_int done;
+	int found_y;
+	/* Match nearest the cursor, -1 for none. Counted from the start of
+	 * the piece for tail pieces */
+	int found_x;
+};
+
+struct regex_job {
+	struct buffer *buf;
+	struct snapshot snap;
+	int *starts;
+	/* First line of each snapshot block */
+	char pattern[SEARCH_MAX + 1];
+	int step;
+	/* 1 forward, -1 backward */
+	const char *tail;
+	size_t tail_size;
+	/* Part of the original file not split into lines when the snapshot
+	 * was taken. Its first line comes after the snapshot's last */
+	int tail_chunk;
+	int pieces;
+	/* Chunks of the tail, in the order the search goes */
+
+	struct regex_chunk *chunks;
+	int chunk_count;
+	int wrap_chunk;
+	/* First chunk past the end of the buffer */
+	int taken;
+	/* Chunks handed back so far, in order */
+	atomic_int next_chunk;
+	atomic_int cancel;
+	atomic_int running;
+	/* Threads not done yet */
+	pthread_t threads[REGEX_THREADS_MAX];
+	int thread_count;
+	int pipe[2];
+	/* Written to after each chunk, wakes up the main loop */
+
+	struct regex_job *next;
+	/* Jobs not freed yet, current and cancelled */
+};
+
+static struct regex_job *jobs;
+
+/* Pattern compiled for highlighting, and its source */
+static regex_t view_re;
+static char view_src[SEARCH_MAX + 1];
+static int view_state;
+/* 0 nothing compiled, 1 compiled, -1 does not compile */
+static char view_err[80];
+static char *view_buf;
+static int view_cap;
+
+/* The regex part of the search pattern, NUL terminated */
+static void regex_source(struct search *s, char *out)
+{
+	memcpy(out, s->pattern + 2, s->len - 2);
+	out[s->len - 2] = '\0';
+}
+
+/* Compiles the pattern for the main thread, if it changed. Returns 0 if
+ * it compiles */
+static int view_compile(struct editor *e)
+{
+	char src[SEARCH_MAX + 1];
+	regex_source(&e->search, src);
+	if (view_state && strcmp(src, view_src) == 0)
+		return (view_state > 0) ? 0 : -1;
+
+	if (view_state > 0)
+		regfree(&view_re);
+	strcpy(view_src, src);
+	int err = regcomp(&view_re, src, REG_EXTENDED);
+	if (err) {
+		regerror(err, &view_re, view_err, sizeof(view_err));
+		view_state = -1;
+		return -1;
+	}
+	view_state = 1;
+	return 0;
+}
+
+/* Why the pattern does not compile, or NULL if it does */
+const char *regex_error(struct editor *e)
+{
+	return view_compile(e) ? view_err : NULL;
+}
+
+/* First match of re in text[from..n) that starts before `to`. Returns
+ * its offset and sets *len, or -1 */
+static int match(regex_t *re, const char *text, int n, int from, int to,
+		 int *len)
+{
+	regmatch_t m = { .rm_so = from, .rm_eo = n };
+	int flags = REG_STARTEND | ((from > 0) ? REG_NOTBOL : 0);
+	if (regexec(re, text, 1, &m, flags) != 0 || m.rm_so >= to)
+		return -1;
+	*len = m.rm_eo - m.rm_so;
+	return m.rm_so;
+}
+
+/* Offset of the first match in line l that starts in from..to-1, or -1.
+ * Only a little past `to` is looked at, so highlighting a huge line does
+ * not match all of it */
+int regex_find(struct editor *e, struct line *l, int from, int to, int *len)
+{
+	if (e->search.len <= 2 || view_compile(e) || from >= to ||
+	    from > l->size)
+		return -1;
+
+	int n = l->size;
+	if (n - to > REGEX_VIEW_SLACK)
+		n = to + REGEX_VIEW_SLACK;
+	if (n - from >= view_cap) {
+		view_cap = n - from + 1;
+		view_buf = xrealloc(view_buf, view_cap);
+	}
+	line_read(l, from, n - from, view_buf);
+	view_buf[n - from] = '\0';
+
+	regmatch_t m = { .rm_so = 0, .rm_eo = n - from };
+	int flags = REG_STARTEND | ((from > 0) ? REG_NOTBOL : 0) |
+		    ((n < l->size) ? REG_NOTEOL : 0);
+	if (regexec(&view_re, view_buf, 1, &m, flags) != 0 ||
+	    from + m.rm_so >= to)
+		return -1;
+	*len = m.rm_eo - m.rm_so;
+	return from + m.rm_so;
+}
+
+/* Line y of the snapshot */
+static struct line *snapshot_line(struct regex_job *job, int y)
+{
+	int lo = 0;
+	int hi = job->snap.block_count - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (job->starts[mid] <= y)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return &job->snap.blocks[lo]->lines[y - job->starts[lo]];
+}
+
+/* Text of line l in one piece, copied to *buf if it is chunked */
+static const char *whole_line(struct line *l, char **buf, int *cap)
+{
+	int len;
+	const char *text = line_span(l, 0, &len);
+	if (len == l->size)
+		return text;
+	if (l->size >= *cap) {
+		*cap = l->size + 1;
+		*buf = xrealloc(*buf, *cap);
+	}
+	line_read(l, 0, l->size, *buf);
+	(*buf)[l->size] = '\0';
+	return *buf;
+}
+
+/* Finds the match nearest the start of chunk c */
+static void search_chunk(struct regex_job *job, struct regex_chunk *c,
+			 regex_t *re, char **buf, int *cap)
+{
+	int y = c->start;
+	int limit = c->limit;
+
+	for (int i = 1;; i++) {
+		struct line *l = snapshot_line(job, y);
+		const char *text = whole_line(l, buf, cap);
+		int len;
+		int at;
+		if (job->step > 0) {
+			at = match(re, text, l->size, limit, l->size + 1, &len);
+		} else {
+			/* Last match that starts before limit */
+			at = -1;
+			for (int from = 0, m;
+			     (m = match(re, text, l->size, from, limit, &len)) >= 0;
+			     from = m + 1) {
+				at = m;
+				if (m >= l->size)
+					break;
+			}
+		}
+		if (at >= 0) {
+			c->found_y = y;
+			c->found_x = at;
+			return;
+		}
+
+		if (y == c->end)
+			return;
+		y += job->step;
+		limit = (job->step > 0) ? 0 : INT_MAX;
+		if (i % REGEX_CANCEL_LINES == 0 && atomic_load(&job->cancel))
+			return;
+	}
+}
+
+/* Finds the match nearest the start of tail piece c, in the order the
+ * search goes, and counts its lines. Lines that start in the piece are
+ * its own, the last one may end past it */
+static void search_piece(struct regex_job *job, struct regex_chunk *c,
+			 regex_t *re)
+{
+	const char *end = job->tail + job->tail_size;
+	const char *p = job->tail + (size_t)c->piece * REGEX_TAIL_BYTES;
+	const char *stop = (end - p > REGEX_TAIL_BYTES) ? p + REGEX_TAIL_BYTES :
+							   end;
+	if (p > job->tail) {
+		/* The line going on from the piece before is not ours */
+		p = memchr(p - 1, '\n', end - p + 1);
+		p = p ? p + 1 : end;
+	}
+
+	int y = 0;
+	for (; p < stop; y++) {
+		const char *eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+		int size = eol - p;
+		while (size > 0 && p[size - 1] == '\r')
+			size--;
+
+		int len;
+		int at = -1;
+		for (int from = 0, m;
+		     (m = match(re, p, size, from, size + 1, &len)) >= 0;
+		     from = m + 1) {
+			at = m;
+			/* Forward takes the first, backward the last */
+			if (job->step > 0 || m >= size)
+				break;
+		}
+		if (at >= 0) {
+			c->found_y = y;
+			c->found_x = at;
+			if (job->step > 0)
+				return;
+		}
+
+		p = eol + 1;
+		if (y % REGEX_CANCEL_LINES == 0 && atomic_load(&job->cancel))
+			return;
+	}
+	c->lines = y;
+}
+
+static void *regex_thread(void *arg)
+{
+	struct regex_job *job = arg;
+	regex_t re;
+	char *buf = NULL;
+	int cap = 0;
+
+	/* regexec on a shared regex_t takes a lock, each thread gets its own */
+	int ok = regcomp(&re, job->pattern, REG_EXTENDED) == 0;
+	while (ok && !atomic_load(&job->cancel)) {
+		int i = atomic_fetch_add(&job->next_chunk, 1);
+		if (i >= job->chunk_count)
+			break;
+		if (job->chunks[i].piece >= 0)
+			search_piece(job, &job->chunks[i], &re);
+		else
+			search_chunk(job, &job->chunks[i], &re, &buf, &cap);
+		atomic_store(&job->chunks[i].done, 1);
+		/* A full pipe already has a wakeup in it */
+		(void)write(job->pipe[1], "", 1);
+	}
+	if (ok)
+		regfree(&re);
+	free(buf);
+
+	atomic_fetch_sub(&job->running, 1);
+	(void)write(job->pipe[1], "", 1);
+	return NULL;
+}
+
+/* Joins the threads of a job that are all done and frees it */
+static void job_free(struct regex_job *job)
+{
+	for (int i = 0; i < job->thread_count; i++)
+		pthread_join(job->threads[i], NULL);
+	event_unwatch(job->pipe[0]);
+	close(job->pipe[0]);
+	close(job->pipe[1]);
+	buffer_unfreeze(job->buf, &job->snap);
+
+	for (struct regex_job **p = &jobs; *p; p = &(*p)->next) {
+		if (*p == job) {
+			*p = job->next;
+			break;
+		}
+	}
+	free(job->starts);
+	free(job->chunks);
+	free(job);
+}
+
+/* Line number of the first line of tail piece k, or -1 while a piece
+ * before it is not done */
+static int piece_line(struct regex_job *job, int k)
+{
+	int y = job->snap.line_count;
+	for (int i = 0; i < k; i++) {
+		int at = job->tail_chunk +
+			 ((job->step > 0) ? i : job->pieces - 1 - i);
+		if (!atomic_load(&job->chunks[at].done))
+			return -1;
+		y += job->chunks[at].lines;
+	}
+	return y;
+}
+
+/* Hands back finished chunks in order until one has a match */
+static void regex_event(struct editor *e, void *data)
+{
+	struct regex_job *job = data;
+	char drain[256];
+	while (read(job->pipe[0], drain, sizeof(drain)) > 0)
+		;
+
+	if (e->search.job == job) {
+		while (job->taken < job->chunk_count &&
+		       atomic_load(&job->chunks[job->taken].done)) {
+			struct regex_chunk *c = &job->chunks[job->taken];
+			if (c->found_y >= 0) {
+				int y = c->found_y;
+				if (c->piece >= 0) {
+					/* Going backward the pieces before it
+					 * come later */
+					int first = piece_line(job, c->piece);
+					if (first < 0)
+						break;
+					y += first;
+				}
+				e->search.job = NULL;
+				atomic_store(&job->cancel, 1);
+				search_done(e, y, c->found_x,
+					    job->taken >= job->wrap_chunk);
+				break;
+			}
+			job->taken++;
+		}
+		if (job->taken == job->chunk_count) {
+			e->search.job = NULL;
+			search_done(e, -1, 0, 0);
+		}
+	}
+
+	if (atomic_load(&job->running) == 0)
+		job_free(job);
+}
+
+/* Splits lines from..to, walked by step, into chunks */
+static void add_chunks(struct regex_job *job, int from, int to, int limit)
+{
+	int count = (abs(to - from) + REGEX_CHUNK_LINES) / REGEX_CHUNK_LINES;
+	job->chunks = xrealloc(job->chunks, (job->chunk_count + count) *
+						    sizeof(*job->chunks));
+	for (int i = 0; i < count; i++) {
+		struct regex_chunk *c = &job->chunks[job->chunk_count++];
+		c->start = from + i * REGEX_CHUNK_LINES * job->step;
+		c->end = c->start + (REGEX_CHUNK_LINES - 1) * job->step;
+		if ((c->end - to) * job->step > 0)
+			c->end = to;
+		c->limit = i ? ((job->step > 0) ? 0 : INT_MAX) : limit;
+		c->piece = -1;
+		atomic_init(&c->done, 0);
+		c->found_y = -1;
+	}
+}
+
+/* Adds the pieces of the unsplit tail, in the order the search goes */
+static void add_pieces(struct regex_job *job)
+{
+	int count = (job->tail_size + REGEX_TAIL_BYTES - 1) / REGEX_TAIL_BYTES;
+	job->chunks = xrealloc(job->chunks, (job->chunk_count + count) *
+						    sizeof(*job->chunks));
+	job->tail_chunk = job->chunk_count;
+	job->pieces = count;
+	for (int i = 0; i < count; i++) {
+		struct regex_chunk *c = &job->chunks[job->chunk_count++];
+		c->piece = (job->step > 0) ? i : count - 1 - i;
+		c->lines = 0;
+		atomic_init(&c->done, 0);
+		c->found_y = -1;
+	}
+}
+
+/* Starts a regex search of the active buffer from the cursor, forward
+ * for step 1 and backward for -1. The result comes to search_done */
+void regex_start(struct editor *e, int step, int verbose)
+{
+	struct search *s = &e->search;
+	struct buffer *b = e->active_buf;
+
+	if (s->len <= 2) {
+		search_done(e, -1, 0, 0);
+		return;
+	}
+	if (view_compile(e)) {
+		if (verbose)
+			set_message(e, "Invalid pattern: %s", view_err);
+		return;
+	}
+
+	struct regex_job *job = xcalloc(1, sizeof(*job));
+	if (pipe(job->pipe) != 0) {
+		free(job);
+		set_message(e, "Err: cannot start search");
+		return;
+	}
+	fcntl(job->pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(job->pipe[1], F_SETFL, O_NONBLOCK);
+
+	job->buf = b;
+	buffer_freeze(b, &job->snap);
+	/* Never changed or unmapped while the buffer is open */
+	job->tail = b->orig + b->scanned;
+	job->tail_size = b->orig_size - b->scanned;
+	job->starts = xmalloc(job->snap.block_count * sizeof(int));
+	for (int i = 0, y = 0; i < job->snap.block_count; i++) {
+		job->starts[i] = y;
+		y += job->snap.counts[i];
+	}
+	regex_source(s, job->pattern);
+	job->step = step;
+
+	/* From the cursor to the end, then around to the cursor again */
+	int last = job->snap.line_count - 1;
+	if (step > 0) {
+		add_chunks(job, b->cy, last, b->cx + 1);
+		add_pieces(job);
+		job->wrap_chunk = job->chunk_count;
+		add_chunks(job, 0, b->cy, 0);
+	} else {
+		add_chunks(job, b->cy, 0, b->cx);
+		job->wrap_chunk = job->chunk_count;
+		add_pieces(job);
+		add_chunks(job, last, b->cy, INT_MAX);
+	}
+
+	job->next = jobs;
+	jobs = job;
+	s->job = job;
+	event_watch(job->pipe[0], regex_event, job);
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int want = (cpus > REGEX_THREADS_MAX) ? REGEX_THREADS_MAX :
+		   (cpus > 1) ? cpus : 1;
+	if (want > job->chunk_count)
+		want = job->chunk_count;
+	atomic_init(&job->running, want);
+	for (int i = 0; i < want; i++) {
+		if (pthread_create(&job->threads[i], NULL, regex_thread, job) !=
+		    0) {
+			atomic_fetch_sub(&job->running, want - i);
+			break;
+		}
+		job->thread_count++;
+	}
+
+	/* No threads, search here instead */
+	if (job->thread_count == 0) {
+		atomic_init(&job->running, 1);
+		regex_thread(job);
+	}
+}
+
+/* Cancels a search in flight. Its threads finish on their own */
+void regex_cancel(struct regex_job *job)
+{
+	atomic_store(&job->cancel, 1);
+}
+
+/* Stops all searches and waits for their threads, before quitting */
+void regex_wait(void)
+{
+	while (jobs) {
+		atomic_store(&jobs->cancel, 1);
+		job_free(jobs);
+	}
+	if (view_state > 0)
+		regfree(&view_re);
+	view_state = 0;
+}
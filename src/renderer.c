@@ -1,144 +1,240 @@
-#include <ncurses.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "kiuru.h"
+#include "screen.h"
+#include "util.h"
 
 static void draw_status_bar(struct editor *e)
 {
-	attron(A_REVERSE);
 	int width = e->screen_cols;
-
-	if (e->message[0] != '\0') {
-		mvprintw(e->screen_rows - 1, 0, "%s", e->message);
-
-		/* Clear the message immediately so it disappears on next render
-		 */
-		e->message[0] = '\0';
+	int y = e->screen_rows - 1;
+	int x;
+
+	if (e->mode == MODE_SEARCH) {
+		/* Prompt of a search being typed */
+		x = screen_print(y, 0, 0, "%c%.*s",
+				 (e->search.dir > 0) ? '/' : '?', e->search.len,
+				 e->search.pattern);
+		screen_clear_eol(y, x);
+		return;
+	} else if (e->message[0] != '\0') {
+		x = screen_print(y, 0, A_REVERSE, "%s", e->message);
+	} else if (e->latency_overlay) {
+		char stats[256];
+		latency_status(e->latency, stats, sizeof(stats));
+		x = screen_print(y, 0, A_REVERSE, "%s", stats);
 	} else {
-		mvprintw(e->screen_rows - 1, 0,
-			 " [%s] | %s | L: %d/%d C: %d-%d",
-			 (e->mode == MODE_NORMAL) ? "NORMAL" : "INSERT",
-			 (e->active_buf->path[0]) ? e->active_buf->path :
-						    "[No Name]",
-			 e->active_buf->cy + 1, e->active_buf->line_count,
-			 e->active_buf->cx + 1,
-			 cx_to_rx(e->active_buf->current, e->active_buf->cx) +
-				 1);
+		x = screen_print(
+			y, 0, A_REVERSE, " [%s] | %s | L: %d/%d%s C: %d-%d",
+			(e->mode == MODE_NORMAL) ? "NORMAL" : "INSERT",
+			(e->active_buf->path[0]) ? e->active_buf->path :
+						   "[No Name]",
+			e->active_buf->cy + 1, e->active_buf->line_count,
+			/* Huge file that is not split to the end yet */
+			(e->active_buf->scanned < e->active_buf->orig_size) ?
+				"+" :
+				"",
+			e->active_buf->cx + 1,
+			cx_to_rx(e->active_buf, e->active_buf->current,
+				 e->active_buf->cx) +
+				1);
 	}
 
 	/* Fill the rest of the line with whitespace */
-	int current_x = getcurx(stdscr);
-	while (current_x < width) {
-		addch(' ');
-		current_x++;
-	}
-
-	attroff(A_REVERSE);
+	screen_fill(y, x, width - x, ' ' | A_REVERSE);
 }
 
 static void update_gutter_width(struct editor *e)
 {
+	struct buffer *b = e->active_buf;
 	char buf[32];
+	long lines = b->line_count;
+
+	/* Guess the final line count of a partly split file from the lines
+	 * found so far, so the gutter does not grow while scrolling */
+	if (b->scanned > 0 && b->scanned < b->orig_size)
+		lines = (long)((double)lines * b->orig_size / b->scanned);
+
 	/* Chars needed for digits + 1 space padding */
-	e->active_buf->gutter_w =
-		snprintf(buf, sizeof(buf), "%d", e->active_buf->line_count) + 1;
+	b->gutter_w = snprintf(buf, sizeof(buf), "%ld", lines) + 1;
+}
+
+/* Screen row being built, reused for every row and drawn at once */
+static chtype *row_buf;
+static int row_cap;
+
+/* Fills row_buf with the part of line l from render column col_offset
+ * that fits in width columns, tabs expanded to spaces. Bytes the terminal
+ * can't show in one cell become '?', so text stays in its columns.
+ * Returns its length */
+static int expand_row(struct buffer *b, struct line *l, int col_offset,
+		      int width)
+{
+	if (width > row_cap) {
+		row_cap = width;
+		row_buf = xrealloc(row_buf, row_cap * sizeof(*row_buf));
+	}
+
+	/* Start at the char col_offset falls on, the line's rx index gets
+	 * there without walking all of a long line */
+	int rx;
+	int i = rx_to_cx(b, l, col_offset, &rx);
+	int len = 0;
+	while (i < l->size && len < width) {
+		int n;
+		const unsigned char *text =
+			(const unsigned char *)line_span(l, i, &n);
+		for (int j = 0; j < n && len < width; j++) {
+			unsigned char c = text[j];
+			if (c != '\t') {
+				if (rx++ >= col_offset)
+					row_buf[len++] =
+						(c >= 32 && c < 127) ? c : '?';
+				continue;
+			}
+
+			/* Only the part of a tab right of col_offset shows */
+			int next = rx + TAB_WIDTH - (rx % TAB_WIDTH);
+			if (rx < col_offset)
+				rx = col_offset;
+			for (; rx < next && len < width; rx++)
+				row_buf[len++] = ' ';
+		}
+		i += n;
+	}
+	return len;
+}
+
+/* Shows matches of the search pattern in the visible slice of line l,
+ * which is in row_buf */
+static void highlight_matches(struct editor *e, struct line *l, int len)
+{
+	struct buffer *b = e->active_buf;
+	int rx;
+	int from = rx_to_cx(b, l, b->col_offset, &rx) - e->search.len + 1;
+	int to = rx_to_cx(b, l, b->col_offset + len, &rx) + 1;
+	if (from < 0)
+		from = 0;
+
+	int n;
+	for (int at = from; (at = search_find(e, l, at, to, &n)) >= 0; at++) {
+		int start = cx_to_rx(b, l, at) - b->col_offset;
+		int end = cx_to_rx(b, l, at + n) - b->col_offset;
+		for (int x = (start > 0) ? start : 0; x < end && x < len; x++)
+			row_buf[x] |= A_REVERSE;
+	}
+}
+
+/* Draws screen row y, showing line l or ~ past the end of the buffer */
+static void draw_row(struct editor *e, int y, struct line *l)
+{
+	/* Add indicators to empty space */
+	if (!l) {
+		screen_print(y, 0, 0, "~");
+		screen_clear_eol(y, 1);
+		return;
+	}
+
+	/* Draw gutter */
+	screen_print(y, 0, COLOR_PAIR(1), "%*d ", e->active_buf->gutter_w - 1,
+		     e->active_buf->row_offset + y + 1);
+
+	/* Expand the visible slice of the line into the row buffer and
+	 * draw it at once, then clear what is left of the old row */
+	int width = e->screen_cols - e->active_buf->gutter_w;
+	int len = expand_row(e->active_buf, l, e->active_buf->col_offset,
+			     width);
+	if (e->search.highlight)
+		highlight_matches(e, l, len);
+	screen_put(y, e->active_buf->gutter_w, row_buf, len);
+	if (len < width)
+		screen_clear_eol(y, e->active_buf->gutter_w + len);
 }
 
+/* Draws what changed since the last call. Edits mark the lines they touch
+ * dirty, vertical scrolling moves the rows already on screen and only
+ * draws the ones it uncovers. Everything is redrawn after a resize, buffer
+ * switch or horizontal scroll */
 void draw_ui(struct editor *e)
 {
 	/* Sets the editor windown dimensions */
-	getmaxyx(stdscr, e->screen_rows, e->screen_cols);
+	screen_size(&e->screen_rows, &e->screen_cols);
 
 	if (e->mode == MODE_EXPLORER) {
 		draw_explorer(e);
+		screen_cursor(0, 0, 0);
+		e->drawn_buf = NULL;
+		return;
+	}
+	if (e->mode == MODE_GREP) {
+		draw_grep(e);
+		e->drawn_buf = NULL;
+		return;
+	}
+	if (e->mode == MODE_FINDER) {
+		draw_finder(e);
+		e->drawn_buf = NULL;
 		return;
 	}
 
+	struct buffer *b = e->active_buf;
+	int text_rows = e->screen_rows - 1;
 	update_gutter_width(e);
 
-	/* Navigate to the line at row_offset to start drawing */
-	struct line *iter = e->active_buf->head;
-
-	/* Fast forward to row_offset */
-	for (int i = 0; i < e->active_buf->row_offset && iter; i++)
-		iter = iter->next;
-
-	/* Draw file content on screen */
-	for (int y = 0; y < e->screen_rows - 1; y++) {
-		/* Move to start of the line and clear to the right */
-		move(y, 0);
-		clrtoeol();
-
-		/* Add indicators to empty space */
-		if (!iter) {
-			mvaddch(y, 0, '~');
-			continue;
+	int full = e->drawn_buf != b || e->drawn_rows != e->screen_rows ||
+		   e->drawn_cols != e->screen_cols ||
+		   e->drawn_col_offset != b->col_offset ||
+		   e->drawn_gutter_w != b->gutter_w;
+
+	/* Rows uncovered by scrolling, none if first > last */
+	int exposed_first = 0;
+	int exposed_last = -1;
+	int delta = b->row_offset - e->drawn_row_offset;
+	if (!full && delta != 0) {
+		if (abs(delta) >= text_rows) {
+			full = 1;
+		} else {
+			/* Status bar stays out of the scrolled region */
+			screen_scroll(0, text_rows - 1, delta);
+			if (delta > 0) {
+				exposed_first = text_rows - delta;
+				exposed_last = text_rows - 1;
+			} else {
+				exposed_last = -delta - 1;
+			}
 		}
+	}
 
-		/* Draw gutter */
-		attron(COLOR_PAIR(1));
-		mvprintw(y, 0, "%*d ", e->active_buf->gutter_w - 1,
-			 iter->lineno);
-		attroff(COLOR_PAIR(1));
-
-		/*  Draw text */
-		int cur_rx = 0;
-		for (int i = 0; i < iter->size; i++) {
-			int is_tab = (iter->data[i] == '\t');
-			int char_w =
-				is_tab ? (TAB_WIDTH - (cur_rx % TAB_WIDTH)) : 1;
-			/* Screen width, gutter_w + text with col offset
-			 * accounted for */
-			int sx = e->active_buf->gutter_w +
-				 (cur_rx - e->active_buf->col_offset);
-
-			/* Calculate width first, then skip if off-screen */
-			cur_rx += char_w;
-			if (sx < e->active_buf->gutter_w)
-				continue;
-			if (sx >= e->screen_cols)
-				break;
-
-			if (is_tab)
-				for (int s = 0;
-				     s < char_w && (sx + s) < e->screen_cols;
-				     s++)
-					mvaddch(y, sx + s, ' ');
-			else
-				mvaddch(y, sx, iter->data[i]);
-		}
-		iter = iter->next;
+	/* Start from the line at row_offset, kept up to date by scrolling */
+	struct line *iter = b->top;
+	for (int y = 0; y < text_rows; y++) {
+		int n = b->row_offset + y;
+		if (full || (y >= exposed_first && y <= exposed_last) ||
+		    (n >= b->dirty_from && n <= b->dirty_to))
+			draw_row(e, y, iter);
+		if (iter)
+			iter = buffer_next_line(b, iter);
 	}
+	b->dirty_from = INT_MAX;
+	b->dirty_to = -1;
+
+	e->drawn_buf = b;
+	e->drawn_rows = e->screen_rows;
+	e->drawn_cols = e->screen_cols;
+	e->drawn_row_offset = b->row_offset;
+	e->drawn_col_offset = b->col_offset;
+	e->drawn_gutter_w = b->gutter_w;
+
 	draw_status_bar(e);
-}
 
-void init_ncurses(struct editor *e)
-{
-	/* Initialise ncurses */
-	initscr();
-	/* Switch terminal to raw mode so every character goes through
-	 * uninterpreted, instead of generating signals */
-	raw();
-	/* Enable CR -> NL translation */
-	nl();
-	/* Enable capture of special keys (arrows, function keys), so
-	 * handle_input() can read them. Does not include ESC so defined
-	 * seperatly. This due to some historical stuff from Curses */
-	keypad(stdscr, TRUE);
-	/* Prevents ncurses from echoing typed keys, handled manually */
-	noecho();
-	/* By default Ncurses has delay for ESC. Leftovers from Curses as well
-	 */
-	set_escdelay(0);
-
-	/* Check and init colors, using only 16 bit colors to cover the biggest
-	 * range of terminal emulators. Maybe moving to 256 bit in the future or
-	 * even to TrueColor? And keeping 16 as fallback ofcourse */
-	if (has_colors()) {
-		start_color();
-		use_default_colors();
-		/* Gutter pair, gray */
-		init_pair(1, COLOR_BRIGHT_BLACK, COLOR_BLACK);
-	} else {
-		set_message(e, "Warn: No terminal color support");
+	/* Typing a search pattern, the cursor stays at the prompt */
+	if (e->mode == MODE_SEARCH) {
+		screen_cursor(e->screen_rows - 1, 1 + e->search.len, 1);
+		return;
 	}
-}
\ No newline at end of file
+
+	/* Cursor goes after the gutter and follows horizontal scroll */
+	int rx = cx_to_rx(b, b->current, b->cx);
+	screen_cursor(b->cy - b->row_offset, rx - b->col_offset + b->gutter_w,
+		      1);
+}
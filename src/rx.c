@@ -0,0 +1,205 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include "kiuru.h"
+#include "util.h"
+
+/*
+ * Render column (rx) index for long lines. Tabs make the screen column of a
+ * byte depend on everything before it, so instead of walking a long line
+ * from the start for every lookup, the index keeps the render column at
+ * every RX_STEP bytes. It is built as far as lookups need. An edit only
+ * drops the checkpoints after the first byte it changed, so typing in a
+ * long line rebuilds RX_STEP bytes or so. Lines up to RX_STEP bytes are
+ * just walked.
+ *
+ * Indexes are found by text pointer, or chunk table pointer for chunked
+ * lines. Edits in buffer.c move an index to the line's new text with
+ * rx_update, and freed text is forgotten.
+ */
+
+/* Bytes between checkpoints */
+#define RX_STEP 256
+/* Lines with an index at a time, a power of two */
+#define RX_CACHE_SIZE 256
+
+struct rx_index {
+	const char *text;
+	/* Text the index is for, NULL for a free slot */
+	int size;
+	int *cols;
+	/* Render column at byte k * RX_STEP */
+	int count;
+	/* Checkpoints filled so far */
+	int cap;
+};
+
+/* Render column after char c at column rx */
+static int step(char c, int rx)
+{
+	return (c == '\t') ? rx + TAB_WIDTH - (rx % TAB_WIDTH) : rx + 1;
+}
+
+/* Render column after bytes from..to of a line, starting from column rx */
+static int walk(struct line *l, int from, int to, int rx)
+{
+	while (from < to) {
+		int len;
+		const char *p = line_span(l, from, &len);
+		if (len > to - from)
+			len = to - from;
+		for (int i = 0; i < len; i++)
+			rx = step(p[i], rx);
+		from += len;
+	}
+	return rx;
+}
+
+static struct rx_index *slot_of(struct buffer *b, const char *text)
+{
+	if (!b->rx_cache)
+		b->rx_cache = xcalloc(RX_CACHE_SIZE, sizeof(*b->rx_cache));
+	uintptr_t h = (uintptr_t)text * (uintptr_t)0x9E3779B97F4A7C15ull;
+	return &b->rx_cache[(h >> (sizeof(h) * 8 - 16)) % RX_CACHE_SIZE];
+}
+
+/* Index of a long line, taking over its slot if another line had it */
+static struct rx_index *index_of(struct buffer *b, struct line *l)
+{
+	char *text = line_text(l);
+	struct rx_index *idx = slot_of(b, text);
+
+	if (idx->text != text || idx->size != l->size) {
+		idx->text = text;
+		idx->size = l->size;
+		idx->count = 1;
+		if (!idx->cols) {
+			idx->cap = 16;
+			idx->cols = xmalloc(idx->cap * sizeof(int));
+		}
+		idx->cols[0] = 0;
+	}
+	return idx;
+}
+
+/* Adds checkpoint k to the index of line l */
+static void index_extend(struct rx_index *idx, struct line *l)
+{
+	int k = idx->count;
+	if (k == idx->cap) {
+		idx->cap *= 2;
+		idx->cols = xrealloc(idx->cols, idx->cap * sizeof(int));
+	}
+	idx->cols[k] = walk(l, (k - 1) * RX_STEP, k * RX_STEP,
+			    idx->cols[k - 1]);
+	idx->count++;
+}
+
+/* Converts real mouse pos to rendered mouse pos */
+int cx_to_rx(struct buffer *b, struct line *line, int cx)
+{
+	if (!line)
+		return 0;
+	if (cx > line->size)
+		cx = line->size;
+	if (line->size <= RX_STEP)
+		return walk(line, 0, cx, 0);
+
+	struct rx_index *idx = index_of(b, line);
+	int k = cx / RX_STEP;
+	while (idx->count <= k)
+		index_extend(idx, line);
+	return walk(line, k * RX_STEP, cx, idx->cols[k]);
+}
+
+/* Finds the char that render column rx falls on, or line size if the line
+ * ends before it. *start is set to the column the char starts at */
+int rx_to_cx(struct buffer *b, struct line *line, int rx, int *start)
+{
+	int i = 0;
+	int col = 0;
+
+	if (line->size > RX_STEP) {
+		/* Last checkpoint at or before rx */
+		struct rx_index *idx = index_of(b, line);
+		int last = (line->size - 1) / RX_STEP;
+		while (idx->count <= last && idx->cols[idx->count - 1] <= rx)
+			index_extend(idx, line);
+
+		int lo = 0;
+		int hi = idx->count - 1;
+		while (lo < hi) {
+			int mid = (lo + hi + 1) / 2;
+			if (idx->cols[mid] <= rx)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		i = lo * RX_STEP;
+		col = idx->cols[lo];
+	}
+
+	while (i < line->size) {
+		int len;
+		const char *p = line_span(line, i, &len);
+		int j = 0;
+		for (; j < len && step(p[j], col) <= rx; j++)
+			col = step(p[j], col);
+		i += j;
+		if (j < len)
+			break;
+	}
+	*start = col;
+	return i;
+}
+
+/* Moves the index of old_text to line l, whose text was changed from byte
+ * from onwards. The text may have moved and changed size */
+void rx_update(struct buffer *b, const char *old_text, struct line *l,
+	       int from)
+{
+	if (!b->rx_cache)
+		return;
+	struct rx_index *idx = slot_of(b, old_text);
+	if (idx->text != old_text)
+		return;
+	idx->text = NULL;
+
+	char *text = line_text(l);
+	if (l->size <= RX_STEP)
+		return;
+
+	/* Swap the arrays so the checkpoints go along to the new slot */
+	struct rx_index *dst = slot_of(b, text);
+	if (dst != idx) {
+		struct rx_index tmp = *dst;
+		*dst = *idx;
+		*idx = tmp;
+		idx->text = NULL;
+	}
+	dst->text = text;
+	dst->size = l->size;
+
+	/* Checkpoint k covers bytes before k * RX_STEP */
+	if (dst->count > from / RX_STEP + 1)
+		dst->count = from / RX_STEP + 1;
+}
+
+/* Drops the index of text that is about to be freed */
+void rx_forget(struct buffer *b, const char *text)
+{
+	if (!b->rx_cache)
+		return;
+	struct rx_index *idx = slot_of(b, text);
+	if (idx->text == text)
+		idx->text = NULL;
+}
+
+void rx_cache_free(struct buffer *b)
+{
+	if (!b->rx_cache)
+		return;
+	for (int i = 0; i < RX_CACHE_SIZE; i++)
+		free(b->rx_cache[i].cols);
+	free(b->rx_cache);
+	b->rx_cache = NULL;
+}
@@ -0,0 +1,405 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "kiuru.h"
+#include "util.h"
+
+/* Most iovecs given to one writev call */
+#define SAVE_IOV_MAX 1024
+/* Text shorter than this is copied to the staging buffer, longer text is
+ * written from where it is */
+#define SAVE_COPY_MAX 256
+#define SAVE_STAGE_SIZE (256 * 1024)
+/* The unsplit tail of a mapped file is written this much at a time */
+#define SAVE_TAIL_CHUNK (8 * 1024 * 1024)
+/* How often the status bar follows a background save, in ms */
+#define SAVE_PROGRESS_MS 100
+
+/* Snapshot of a buffer being saved, and how the save is going */
+struct save_job {
+	char path[PATH_MAX];
+	/* Fields of the buffer the writer needs, copied so it never looks
+	 * at the buffer itself */
+	char *orig;
+	size_t orig_size;
+	size_t scanned;
+	int crlf;
+	/* Lines when the save started */
+	struct snapshot snap;
+
+	pthread_t thread;
+	/* Per mille written so far */
+	atomic_int progress;
+	atomic_int done;
+	/* Written to once done is set, wakes up the main loop. -1 if there
+	 * is no pipe, then the progress timer notices */
+	int done_pipe[2];
+	/* Results, read after done is set */
+	int err;
+	long lines;
+	size_t bytes;
+};
+
+/*
+ * Gathers the output for writev. Runs of unedited lines are written straight
+ * from the original file contents, newlines included, so an unedited region
+ * is a single iovec however many lines it has. Short edited lines are copied
+ * next to each other in a staging buffer.
+ */
+struct save_writer {
+	int fd;
+	struct iovec iov[SAVE_IOV_MAX];
+	int iov_count;
+	char *stage;
+	size_t stage_len;
+	/* Bytes written so far */
+	size_t bytes;
+	/* errno of the first failed write, later output is dropped */
+	int err;
+};
+
+/* Writes out everything gathered so far */
+static void writer_flush(struct save_writer *w)
+{
+	struct iovec *iov = w->iov;
+	int count = w->iov_count;
+
+	while (count > 0 && !w->err) {
+		ssize_t n = writev(w->fd, iov, count);
+		if (n < 0) {
+			if (errno != EINTR)
+				w->err = errno;
+			continue;
+		}
+		w->bytes += n;
+
+		/* Short write, skip what got written and go again */
+		while (count > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	w->iov_count = 0;
+	w->stage_len = 0;
+}
+
+/* Adds len bytes at p to the output. p must stay valid until the next
+ * flush unless the text is copied */
+static void writer_put(struct save_writer *w, const char *p, size_t len)
+{
+	if (len == 0)
+		return;
+
+	/* Continues the previous iovec, like the next line of an unedited
+	 * run */
+	struct iovec *last = w->iov_count ? &w->iov[w->iov_count - 1] : NULL;
+	if (last && (char *)last->iov_base + last->iov_len == p) {
+		last->iov_len += len;
+		return;
+	}
+
+	if (w->iov_count == SAVE_IOV_MAX ||
+	    (len < SAVE_COPY_MAX && w->stage_len + len > SAVE_STAGE_SIZE))
+		writer_flush(w);
+
+	if (len < SAVE_COPY_MAX) {
+		p = memcpy(&w->stage[w->stage_len], p, len);
+		w->stage_len += len;
+
+		last = w->iov_count ? &w->iov[w->iov_count - 1] : NULL;
+		if (last && (char *)last->iov_base + last->iov_len == p) {
+			last->iov_len += len;
+			return;
+		}
+	}
+	w->iov[w->iov_count].iov_base = (char *)p;
+	w->iov[w->iov_count].iov_len = len;
+	w->iov_count++;
+}
+
+/* Counts newlines in p[0..len) */
+static long count_newlines(const char *p, size_t len)
+{
+	uint32_t offs[1024];
+	long count = 0;
+
+	while (len > 0) {
+		int found = scan_newlines(p, len, offs, 1024);
+		count += found;
+		if (found < 1024)
+			break;
+		size_t next = offs[found - 1] + 1;
+		p += next;
+		len -= next;
+	}
+	return count;
+}
+
+/* Writes the snapshot's lines to fd, then the part of the file not split
+ * into lines yet as it is */
+static int write_lines(struct save_job *job, int fd)
+{
+	struct save_writer w = { .fd = fd };
+	const char *nl = job->crlf ? "\r\n" : "\n";
+	size_t nl_len = strlen(nl);
+	char *orig_end = job->orig + job->orig_size;
+	int lines_done = 0;
+
+	/* Progress is split between lines and the unsplit tail by how much
+	 * of the file each covers */
+	int lines_share = 1000;
+	if (job->orig_size)
+		lines_share = (double)job->scanned / job->orig_size * 1000;
+
+	w.stage = xmalloc(SAVE_STAGE_SIZE);
+	for (int i = 0; i < job->snap.block_count && !w.err; i++) {
+		struct line_block *blk = job->snap.blocks[i];
+		for (int j = 0; j < job->snap.counts[i]; j++) {
+			struct line *l = &blk->lines[j];
+			int len;
+			for (int off = 0; off < l->size; off += len) {
+				const char *p = line_span(l, off, &len);
+				writer_put(&w, p, len);
+			}
+
+			/* Always end the line (POSIX standard), the way the
+			 * file did when loaded. Unedited lines use the newline
+			 * that follows them so the run stays one iovec */
+			int shared = l->size > LINE_INLINE_MAX &&
+				     l->capacity == 0;
+			char *eol = shared ? l->data + l->size : NULL;
+			if (shared && (size_t)(orig_end - eol) >= nl_len &&
+			    memcmp(eol, nl, nl_len) == 0)
+				writer_put(&w, eol, nl_len);
+			else
+				writer_put(&w, nl, nl_len);
+		}
+		lines_done += job->snap.counts[i];
+		atomic_store(&job->progress,
+			     (long)lines_done * lines_share /
+				     job->snap.line_count);
+	}
+	job->lines = job->snap.line_count;
+
+	/* Tail of a mapped file, line endings are kept as they are */
+	char *tail = job->orig + job->scanned;
+	size_t tail_size = job->orig_size - job->scanned;
+	for (size_t off = 0; off < tail_size && !w.err;
+	     off += SAVE_TAIL_CHUNK) {
+		size_t len = tail_size - off;
+		if (len > SAVE_TAIL_CHUNK)
+			len = SAVE_TAIL_CHUNK;
+		writer_put(&w, tail + off, len);
+		writer_flush(&w);
+		job->lines += count_newlines(tail + off, len);
+		atomic_store(&job->progress,
+			     lines_share + (off + len) * (1000 - lines_share) /
+						   tail_size);
+	}
+	if (tail_size && tail[tail_size - 1] != '\n') {
+		writer_put(&w, nl, nl_len);
+		job->lines++;
+	}
+	writer_flush(&w);
+	free(w.stage);
+
+	job->bytes = w.bytes;
+	errno = w.err;
+	return w.err ? -1 : 0;
+}
+
+/* Flushes a rename to disk, the file itself is synced before it */
+static void sync_dir(const char *path)
+{
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof(dir), "%s", path);
+
+	int fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+}
+
+/* Id of the timer that shows save progress, 0 while no save runs */
+static int progress_timer;
+
+/* Tells the main loop the save is over */
+static void save_done(struct save_job *job)
+{
+	atomic_store(&job->done, 1);
+	if (job->done_pipe[1] >= 0)
+		(void)write(job->done_pipe[1], "", 1);
+}
+
+static void save_event(struct editor *e, void *data)
+{
+	save_poll(e);
+}
+
+/* Writes the file. The lines go to a new file next to the target, which is
+ * synced and renamed over it, so a crash or full disk leaves either the old
+ * or the new file and never half of one. Renaming also keeps the old file
+ * alive for lines still read from its mapping */
+static void *save_thread(void *arg)
+{
+	struct save_job *job = arg;
+
+	/* Write through symlinks instead of replacing them */
+	char target[PATH_MAX];
+	if (!realpath(job->path, target))
+		snprintf(target, sizeof(target), "%s", job->path);
+
+	char tmp_path[PATH_MAX + 8];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", target);
+	int fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		job->err = errno;
+		save_done(job);
+		return NULL;
+	}
+
+	/* mkstemp creates it private, keep the mode of the original or give
+	 * a new file the usual one */
+	struct stat sb;
+	mode_t mode;
+	if (stat(target, &sb) == 0) {
+		mode = sb.st_mode & 07777;
+	} else {
+		mode_t mask = umask(0);
+		umask(mask);
+		mode = 0666 & ~mask;
+	}
+	fchmod(fd, mode);
+
+	if (write_lines(job, fd) != 0 || fsync(fd) != 0)
+		job->err = errno;
+	if (close(fd) != 0 && !job->err)
+		job->err = errno;
+	if (!job->err && rename(tmp_path, target) != 0)
+		job->err = errno;
+	if (job->err)
+		unlink(tmp_path);
+	else
+		sync_dir(target);
+
+	save_done(job);
+	return NULL;
+}
+
+/* Starts saving the active buffer in the background. The writer gets a
+ * snapshot of the lines, editing goes on while it runs */
+void save_file(struct editor *e)
+{
+	struct buffer *b = e->active_buf;
+	if (!b->path[0])
+		return; /* Ignore no name, TODO: ask for filename and the save
+			 */
+	if (b->save) {
+		set_message(e, "\"%s\" is already being saved", b->path);
+		return;
+	}
+	struct save_job *job = xcalloc(1, sizeof(*job));
+	snprintf(job->path, sizeof(job->path), "%s", b->path);
+	job->orig = b->orig;
+	job->orig_size = b->orig_size;
+	job->scanned = b->scanned;
+	job->crlf = b->crlf;
+
+	/* The blocks and text the snapshot points to stay frozen until the
+	 * save is done */
+	buffer_freeze(b, &job->snap);
+	b->save = job;
+
+	if (pipe(job->done_pipe) == 0) {
+		event_watch(job->done_pipe[0], save_event, NULL);
+	} else {
+		job->done_pipe[0] = -1;
+		job->done_pipe[1] = -1;
+	}
+	if (!progress_timer)
+		progress_timer = event_timer(SAVE_PROGRESS_MS, 1, save_event,
+					     NULL);
+
+	if (pthread_create(&job->thread, NULL, save_thread, job) != 0) {
+		/* No thread, write it here instead */
+		save_thread(job);
+		job->thread = pthread_self();
+	}
+	set_message(e, "Saving \"%s\"...", b->path);
+}
+
+/* Joins a finished save and reports how it went */
+static void save_finish(struct editor *e, struct buffer *b)
+{
+	struct save_job *job = b->save;
+
+	if (!pthread_equal(job->thread, pthread_self()))
+		pthread_join(job->thread, NULL);
+	buffer_unfreeze(b, &job->snap);
+	b->save = NULL;
+	if (job->done_pipe[0] >= 0) {
+		event_unwatch(job->done_pipe[0]);
+		close(job->done_pipe[0]);
+		close(job->done_pipe[1]);
+	}
+
+	if (job->err)
+		set_message(e, "Err: \"%s\" not saved: %s", job->path,
+			    strerror(job->err));
+	else
+		set_message(e, "\"%s\" %ldL, %zuB written", job->path,
+			    job->lines, job->bytes);
+
+	free(job);
+}
+
+/* Finishes saves that are done and shows progress of the rest. Returns the
+ * number still running */
+int save_poll(struct editor *e)
+{
+	int running = 0;
+
+	for (struct buffer *b = e->buf_head; b; b = b->next) {
+		if (!b->save)
+			continue;
+		if (atomic_load(&b->save->done)) {
+			save_finish(e, b);
+			continue;
+		}
+		set_message(e, "Saving \"%s\"... %d%%", b->path,
+			    atomic_load(&b->save->progress) / 10);
+		running++;
+	}
+	if (!running && progress_timer) {
+		event_timer_cancel(progress_timer);
+		progress_timer = 0;
+	}
+	return running;
+}
+
+/* Waits for all saves, before quitting */
+void save_wait(struct editor *e)
+{
+	for (struct buffer *b = e->buf_head; b; b = b->next)
+		if (b->save)
+			save_finish(e, b);
+	if (progress_timer) {
+		event_timer_cancel(progress_timer);
+		progress_timer = 0;
+	}
+}
@@ -0,0 +1,112 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include "kiuru.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define HAVE_X86_SIMD
+#endif
+
+/*
+ * Newline scanner for splitting files into lines. The vector versions
+ * compare 16 or 32 bytes at a time and walk the match bits, so short lines
+ * don't pay for a memchr call each. All versions store offsets of '\n'
+ * bytes in p[0..len) to offs and stop when max are found.
+ */
+
+static int scan_newlines_scalar(const char *p, size_t len, uint32_t *offs,
+				int max)
+{
+	int n = 0;
+	const char *end = p + len;
+	const char *iter = p;
+
+	while (n < max && iter < end) {
+		const char *nl = memchr(iter, '\n', end - iter);
+		if (!nl)
+			break;
+		offs[n++] = nl - p;
+		iter = nl + 1;
+	}
+	return n;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2"))) static int
+scan_newlines_sse2(const char *p, size_t len, uint32_t *offs, int max)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	size_t i = 0;
+	int n = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(p + i));
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl));
+		while (mask) {
+			if (n == max)
+				return n;
+			offs[n++] = i + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+
+	/* Leftover tail */
+	for (; i < len && n < max; i++)
+		if (p[i] == '\n')
+			offs[n++] = i;
+	return n;
+}
+
+__attribute__((target("avx2"))) static int
+scan_newlines_avx2(const char *p, size_t len, uint32_t *offs, int max)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	size_t i = 0;
+	int n = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i *)(p + i));
+		unsigned mask =
+			_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, nl));
+		while (mask) {
+			if (n == max)
+				return n;
+			offs[n++] = i + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+
+	/* Leftover tail, offsets from there are relative to i */
+	if (n < max && i < len) {
+		int tail = scan_newlines_sse2(p + i, len - i, offs + n,
+					      max - n);
+		for (int j = n; j < n + tail; j++)
+			offs[j] += i;
+		n += tail;
+	}
+	return n;
+}
+#endif
+
+static int (*scan)(const char *, size_t, uint32_t *, int);
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+/* Picks the widest scanner the CPU has */
+static void scan_pick(void)
+{
+	scan = scan_newlines_scalar;
+#ifdef HAVE_X86_SIMD
+	if (__builtin_cpu_supports("avx2"))
+		scan = scan_newlines_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		scan = scan_newlines_sse2;
+#endif
+}
+
+/* Picked once, callers may be in several threads */
+int scan_newlines(const char *p, size_t len, uint32_t *offs, int max)
+{
+	pthread_once(&scan_once, scan_pick);
+	return scan(p, len, offs, max);
+}
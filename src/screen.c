@@ -0,0 +1,371 @@
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "kiuru.h"
+#include "screen.h"
+#include "util.h"
+
+/*
+ * Screen backends. The editor draws rows of cells and reads keys through
+ * the active backend: ncurses on a terminal, or the in-memory screen of
+ * headless.c that replays a key script, for measuring and replaying
+ * sessions without a terminal.
+ */
+
+/* A paste that stops this long before its end marker is taken as done */
+#define PASTE_TIMEOUT_MS 1000
+
+static const struct screen_ops *screen = &curses_screen;
+
+/* Cells built by screen_print and screen_fill */
+static chtype *cell_buf;
+static int cell_cap;
+
+static chtype *cells(int n)
+{
+	if (n > cell_cap) {
+		cell_cap = n;
+		cell_buf = xrealloc(cell_buf, cell_cap * sizeof(*cell_buf));
+	}
+	return cell_buf;
+}
+
+void screen_use(const struct screen_ops *ops)
+{
+	screen = ops;
+}
+
+void screen_size(int *rows, int *cols)
+{
+	screen->size(rows, cols);
+}
+
+/* Writes n cells from column x of row y, the part past the right edge is
+ * cut off */
+void screen_put(int y, int x, const chtype *cells, int n)
+{
+	int rows, cols;
+	screen->size(&rows, &cols);
+	if (y < 0 || y >= rows || x >= cols)
+		return;
+	if (n > cols - x)
+		n = cols - x;
+	if (n > 0)
+		screen->put(y, x, cells, n);
+}
+
+/* Writes formatted text from column x of row y with attributes attr. Bytes
+ * the terminal can't show in one cell become '?'. Returns the column after
+ * the text */
+int screen_print(int y, int x, chtype attr, const char *fmt, ...)
+{
+	char small[256];
+	char *text = small;
+	va_list ap;
+
+	va_start(ap, fmt);
+	int n = vsnprintf(small, sizeof(small), fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return x;
+	if (n >= (int)sizeof(small)) {
+		text = xmalloc(n + 1);
+		va_start(ap, fmt);
+		vsnprintf(text, n + 1, fmt, ap);
+		va_end(ap);
+	}
+
+	chtype *row = cells(n);
+	for (int i = 0; i < n; i++) {
+		unsigned char c = text[i];
+		row[i] = ((c >= 32 && c < 127) ? c : '?') | attr;
+	}
+	screen_put(y, x, row, n);
+
+	if (text != small)
+		free(text);
+	int rows, cols;
+	screen->size(&rows, &cols);
+	return (x + n < cols) ? x + n : cols;
+}
+
+/* Writes n copies of cell from column x of row y */
+void screen_fill(int y, int x, int n, chtype cell)
+{
+	if (n <= 0)
+		return;
+	chtype *row = cells(n);
+	for (int i = 0; i < n; i++)
+		row[i] = cell;
+	screen_put(y, x, row, n);
+}
+
+void screen_clear_eol(int y, int x)
+{
+	screen->clear_eol(y, x);
+}
+
+void screen_scroll(int top, int bottom, int n)
+{
+	screen->scroll_rows(top, bottom, n);
+}
+
+void screen_erase(void)
+{
+	screen->erase_all();
+}
+
+void screen_cursor(int y, int x, int visible)
+{
+	screen->cursor(y, x, visible);
+}
+
+void screen_flush(void)
+{
+	screen->flush();
+}
+
+int screen_fd(void)
+{
+	return screen->fd;
+}
+
+int screen_key(int timeout_ms)
+{
+	return screen->key(timeout_ms);
+}
+
+/* Reads the text of a paste, after KEY_PASTE_START was read. Returns it
+ * as allocated bytes, newlines as they came */
+char *screen_paste(size_t *len)
+{
+	if (screen->paste)
+		return screen->paste(len);
+
+	size_t cap = 4096;
+	char *text = xmalloc(cap);
+	*len = 0;
+	for (;;) {
+		int c = screen->key(-1);
+		if (c == KEY_PASTE_END || c == KEY_EOF)
+			break;
+		if (c < 0 || c > 255)
+			continue;
+		if (*len == cap) {
+			cap *= 2;
+			text = xrealloc(text, cap);
+		}
+		text[(*len)++] = c;
+	}
+	return text;
+}
+
+int screen_suspend(void)
+{
+	return screen->suspend();
+}
+
+void screen_resume(void)
+{
+	screen->resume();
+}
+
+void screen_end(void)
+{
+	screen->end();
+}
+
+/* ncurses backend */
+
+static void curses_size(int *rows, int *cols)
+{
+	getmaxyx(stdscr, *rows, *cols);
+}
+
+static void curses_put(int y, int x, const chtype *cells, int n)
+{
+	/* Copied to the screen as they are, without going through addch
+	 * one by one */
+	mvaddchnstr(y, x, cells, n);
+}
+
+static void curses_clear_eol(int y, int x)
+{
+	move(y, x);
+	clrtoeol();
+}
+
+static void curses_scroll(int top, int bottom, int n)
+{
+	setscrreg(top, bottom);
+	scrollok(stdscr, TRUE);
+	scrl(n);
+	scrollok(stdscr, FALSE);
+}
+
+static void curses_erase(void)
+{
+	erase();
+}
+
+static void curses_cursor(int y, int x, int visible)
+{
+	curs_set(visible);
+	if (visible)
+		move(y, x);
+}
+
+static void curses_flush(void)
+{
+	refresh();
+}
+
+static int curses_key(int timeout_ms)
+{
+	timeout(timeout_ms);
+	return getch();
+}
+
+/* Pasted text comes between ESC [200~ and ESC [201~ */
+static void bracketed_paste(int on)
+{
+	fputs(on ? "\033[?2004h" : "\033[?2004l", stdout);
+	fflush(stdout);
+}
+
+/* Reads the rest of a paste straight from the terminal in big reads,
+ * getch would take it a byte at a time. ncurses reads keys a byte at a
+ * time too, so it has nothing past the start marker it just matched */
+static char *curses_paste(size_t *len)
+{
+	static const char end_mark[] = "\033[201~";
+	size_t mark_len = sizeof(end_mark) - 1;
+	size_t cap = 64 * 1024;
+	char *text = xmalloc(cap);
+	size_t n = 0;
+	size_t after = 0;
+
+	for (;;) {
+		if (cap - n < 4096) {
+			cap *= 2;
+			text = xrealloc(text, cap);
+		}
+		struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+		if (poll(&pfd, 1, PASTE_TIMEOUT_MS) <= 0)
+			break;
+		ssize_t got = read(STDIN_FILENO, text + n, cap - n);
+		if (got <= 0)
+			break;
+
+		/* The marker may have started in the last read */
+		size_t from = (n > mark_len) ? n - mark_len : 0;
+		n += got;
+		char *p = text + from;
+		while ((p = memchr(p, '\033', text + n - p))) {
+			if ((size_t)(text + n - p) >= mark_len &&
+			    memcmp(p, end_mark, mark_len) == 0)
+				break;
+			p++;
+		}
+		if (p) {
+			after = n - (p - text) - mark_len;
+			n = p - text;
+			break;
+		}
+	}
+
+	/* Keys typed right after the paste go back to ncurses */
+	for (size_t i = after; i > 0; i--)
+		ungetch((unsigned char)text[n + mark_len + i - 1]);
+
+	/* Terminals send line breaks as CR */
+	for (size_t i = 0; i < n; i++)
+		if (text[i] == '\r' && (i + 1 == n || text[i + 1] != '\n'))
+			text[i] = '\n';
+	*len = n;
+	return text;
+}
+
+static int curses_suspend(void)
+{
+	/* Save terminal state */
+	bracketed_paste(0);
+	def_prog_mode();
+	endwin();
+	return 0;
+}
+
+static void curses_resume(void)
+{
+	/* Restore terminal state */
+	reset_prog_mode();
+	refresh();
+	bracketed_paste(1);
+}
+
+static void curses_end(void)
+{
+	bracketed_paste(0);
+	endwin();
+}
+
+const struct screen_ops curses_screen = {
+	.size = curses_size,
+	.put = curses_put,
+	.clear_eol = curses_clear_eol,
+	.scroll_rows = curses_scroll,
+	.erase_all = curses_erase,
+	.cursor = curses_cursor,
+	.flush = curses_flush,
+	.fd = STDIN_FILENO,
+	.key = curses_key,
+	.paste = curses_paste,
+	.suspend = curses_suspend,
+	.resume = curses_resume,
+	.end = curses_end,
+};
+
+void init_ncurses(struct editor *e)
+{
+	/* Initialise ncurses */
+	initscr();
+	/* Switch terminal to raw mode so every character goes through
+	 * uninterpreted, instead of generating signals */
+	raw();
+	/* Enable CR -> NL translation */
+	nl();
+	/* Enable capture of special keys (arrows, function keys), so
+	 * handle_input() can read them. Does not include ESC so defined
+	 * seperatly. This due to some historical stuff from Curses */
+	keypad(stdscr, TRUE);
+	/* Prevents ncurses from echoing typed keys, handled manually */
+	noecho();
+	/* By default Ncurses has delay for ESC. Leftovers from Curses as well
+	 */
+	set_escdelay(0);
+	/* Let scrolling use the terminal's insert/delete line, draw_ui scrolls
+	 * rows already on screen instead of drawing them again */
+	idlok(stdscr, TRUE);
+	/* Let pastes come in as one piece of text instead of keys, so they
+	 * are inserted at once and not taken as commands */
+	define_key("\033[200~", KEY_PASTE_START);
+	define_key("\033[201~", KEY_PASTE_END);
+	bracketed_paste(1);
+
+	/* Check and init colors, using only 16 bit colors to cover the biggest
+	 * range of terminal emulators. Maybe moving to 256 bit in the future or
+	 * even to TrueColor? And keeping 16 as fallback ofcourse */
+	if (has_colors()) {
+		start_color();
+		use_default_colors();
+		/* Gutter pair, gray */
+		init_pair(1, COLOR_BRIGHT_BLACK, COLOR_BLACK);
+	} else {
+		set_message(e, "Warn: No terminal color support");
+	}
+
+	screen_use(&curses_screen);
+}
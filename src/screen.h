@@ -0,0 +1,69 @@
+#ifndef SCREEN_H
+#define SCREEN_H
+
+#include <stdio.h>
+/* Cells are ncurses chtypes, a char with A_* attributes and a color pair,
+ * and keys are ncurses key codes, whichever backend is in use */
+#include <ncurses.h>
+
+/* Key given by a backend that has no more input, like a replayed key
+ * script that ran out */
+#define KEY_EOF (KEY_MAX + 1)
+/* Start and end of text pasted with bracketed paste */
+#define KEY_PASTE_START (KEY_MAX + 2)
+#define KEY_PASTE_END (KEY_MAX + 3)
+
+/* Terminal, or what stands in for one. Drawing and key reads go through
+ * the backend set with screen_use, see screen.c */
+struct screen_ops {
+	void (*size)(int *rows, int *cols);
+	void (*put)(int y, int x, const chtype *cells, int n);
+	/* Writes n cells from column x of row y, they fit the row */
+	void (*clear_eol)(int y, int x);
+	void (*scroll_rows)(int top, int bottom, int n);
+	/* Moves rows top..bottom up by n, down if n < 0, and blanks the
+	 * rows uncovered */
+	void (*erase_all)(void);
+	void (*cursor)(int y, int x, int visible);
+	void (*flush)(void);
+	/* Shows what was drawn since the last flush */
+	int fd;
+	/* Where keys come from, for waiting on them with poll. -1 if the
+	 * next key is always ready */
+	int (*key)(int timeout_ms);
+	/* Next key, ERR if none came in timeout_ms. -1 waits for one */
+	char *(*paste)(size_t *len);
+	/* Reads pasted text after KEY_PASTE_START up to its end. NULL to
+	 * take it key by key */
+	int (*suspend)(void);
+	/* Hands the terminal to another program, -1 if there is none */
+	void (*resume)(void);
+	void (*end)(void);
+};
+
+extern const struct screen_ops curses_screen;
+extern const struct screen_ops headless_screen;
+
+void screen_use(const struct screen_ops *ops);
+void screen_size(int *rows, int *cols);
+void screen_put(int y, int x, const chtype *cells, int n);
+int screen_print(int y, int x, chtype attr, const char *fmt, ...)
+	__attribute__((format(printf, 4, 5)));
+void screen_fill(int y, int x, int n, chtype cell);
+void screen_clear_eol(int y, int x);
+void screen_scroll(int top, int bottom, int n);
+void screen_erase(void);
+void screen_cursor(int y, int x, int visible);
+void screen_flush(void);
+int screen_fd(void);
+int screen_key(int timeout_ms);
+char *screen_paste(size_t *len);
+int screen_suspend(void);
+void screen_resume(void);
+void screen_end(void);
+
+void headless_open(int rows, int cols, const char *script, size_t len);
+const chtype *headless_row(int y);
+void headless_dump(FILE *f);
+
+#endif
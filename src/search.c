@@ -0,0 +1,448 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kiuru.h"
+#include "screen.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define HAVE_X86_SIMD
+#endif
+
+/*
+ * Search for a literal pattern with / and ?, n and N. Lines are searched
+ * with a vector filter that compares the first and last byte of the
+ * pattern 16 or 32 positions at a time, and only the positions where both
+ * match are compared in full.
+ *
+ * A pattern that starts with \v is a regex instead, see regex.c.
+ *
+ * Typing at the prompt searches again from where the cursor was after
+ * every key. A search gets SEARCH_KEY_NS of the key's time, the rest of a
+ * long one goes on in idle time and is dropped by the next key.
+ */
+
+/* Time a search may take out of a key before it goes on in idle time */
+#define SEARCH_KEY_NS 1000000
+/* Lines searched between looks at the clock */
+#define SEARCH_CLOCK_LINES 256
+/* Lines of a mapped file split between looks at the clock, going around
+ * the top to the end */
+#define SEARCH_SCAN_LINES 4096
+
+/* Copy of a line that is not in one piece */
+static char *flat_buf;
+static int flat_cap;
+
+static int find_scalar(const char *text, int n, const char *pat, int m)
+{
+	const char *p = text;
+	const char *last = text + n - m;
+	while (p <= last && (p = memchr(p, pat[0], last - p + 1))) {
+		if (memcmp(p + 1, pat + 1, m - 1) == 0)
+			return p - text;
+		p++;
+	}
+	return -1;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2"))) static int
+find_sse2(const char *text, int n, const char *pat, int m)
+{
+	const __m128i first = _mm_set1_epi8(pat[0]);
+	const __m128i last = _mm_set1_epi8(pat[m - 1]);
+	int i = 0;
+
+	for (; i + m - 1 + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(text + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(text + i + m - 1));
+		unsigned mask = _mm_movemask_epi8(
+			_mm_and_si128(_mm_cmpeq_epi8(a, first),
+				      _mm_cmpeq_epi8(b, last)));
+		while (mask) {
+			int at = i + __builtin_ctz(mask);
+			if (memcmp(text + at + 1, pat + 1, m - 2) == 0)
+				return at;
+			mask &= mask - 1;
+		}
+	}
+
+	/* Leftover tail */
+	int at = find_scalar(text + i, n - i, pat, m);
+	return (at < 0) ? -1 : i + at;
+}
+
+__attribute__((target("avx2"))) static int
+find_avx2(const char *text, int n, const char *pat, int m)
+{
+	const __m256i first = _mm256_set1_epi8(pat[0]);
+	const __m256i last = _mm256_set1_epi8(pat[m - 1]);
+	int i = 0;
+
+	for (; i + m - 1 + 32 <= n; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(text + i));
+		__m256i b = _mm256_loadu_si256(
+			(const __m256i *)(text + i + m - 1));
+		unsigned mask = _mm256_movemask_epi8(
+			_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+					 _mm256_cmpeq_epi8(b, last)));
+		while (mask) {
+			int at = i + __builtin_ctz(mask);
+			if (memcmp(text + at + 1, pat + 1, m - 2) == 0)
+				return at;
+			mask &= mask - 1;
+		}
+	}
+
+	int at = find_sse2(text + i, n - i, pat, m);
+	return (at < 0) ? -1 : i + at;
+}
+#endif
+
+static int (*find_best)(const char *, int, const char *, int);
+static pthread_once_t find_once = PTHREAD_ONCE_INIT;
+
+/* Picks the widest filter the CPU has */
+static void find_pick(void)
+{
+	find_best = find_scalar;
+#ifdef HAVE_X86_SIMD
+	if (__builtin_cpu_supports("avx2"))
+		find_best = find_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		find_best = find_sse2;
+#endif
+}
+
+/* Offset of the first pat in text[0..n), or -1. The filter is picked
+ * once, grep and regex workers call this too. A single byte is left to
+ * memchr */
+int search_bytes(const char *text, int n, const char *pat, int m)
+{
+	if (n < m)
+		return -1;
+	if (m == 1) {
+		const char *p = memchr(text, pat[0], n);
+		return p ? p - text : -1;
+	}
+	/* Too short for a vector, most lines are */
+	if (n < 16 + m - 1)
+		return find_scalar(text, n, pat, m);
+	pthread_once(&find_once, find_pick);
+	return find_best(text, n, pat, m);
+}
+
+/* n bytes of line l from byte from in one piece, copied if they are
+ * chunked or across the gap */
+static const char *flat_text(struct line *l, int from, int n)
+{
+	int len;
+	const char *text = line_span(l, from, &len);
+	if (len >= n)
+		return text;
+
+	if (n > flat_cap) {
+		flat_cap = n;
+		flat_buf = xrealloc(flat_buf, flat_cap);
+	}
+	line_read(l, from, n, flat_buf);
+	return flat_buf;
+}
+
+/* The pattern is a regex, \v and then the regex */
+static int is_regex(struct search *s)
+{
+	return s->len >= 2 && s->pattern[0] == '\\' && s->pattern[1] == 'v';
+}
+
+/* Offset of the first match in line l that starts in from..to-1, or -1,
+ * and its length in *len. Only the bytes such a match can cover are
+ * looked at */
+int search_find(struct editor *e, struct line *l, int from, int to, int *len)
+{
+	struct search *s = &e->search;
+	if (is_regex(s))
+		return regex_find(e, l, from, to, len);
+	if (s->len == 0)
+		return -1;
+	*len = s->len;
+	if (to > l->size - s->len + 1)
+		to = l->size - s->len + 1;
+	if (from >= to)
+		return -1;
+
+	int n = to - from + s->len - 1;
+	int at = search_bytes(flat_text(l, from, n), n, s->pattern, s->len);
+	return (at < 0) ? -1 : from + at;
+}
+
+/* Offset of the last match in line l that starts before `before`, or -1 */
+static int find_last(struct editor *e, struct line *l, int before)
+{
+	struct search *s = &e->search;
+	int to = l->size - s->len + 1;
+	if (before < to)
+		to = before;
+	if (to <= 0)
+		return -1;
+
+	int n = to + s->len - 1;
+	const char *text = flat_text(l, 0, n);
+	int last = -1;
+	for (int from = 0; from < to; from = last + 1) {
+		int at = search_bytes(text + from, n - from, s->pattern,
+				      s->len);
+		if (at < 0)
+			break;
+		last = from + at;
+	}
+	return last;
+}
+
+/* Moves the cursor to a match and scrolls it into view */
+static void jump(struct editor *e, int y, int x)
+{
+	struct buffer *b = e->active_buf;
+	buffer_gap_close(b);
+	b->cy = y;
+	b->cx = x;
+	b->current = buffer_line(b, y);
+	scroll_to_cursor(e);
+}
+
+/* Ends a search with the match at line y and byte x, or with none if y
+ * is -1. wrapped tells it went around the end of the buffer */
+void search_done(struct editor *e, int y, int x, int wrapped)
+{
+	struct search *s = &e->search;
+	s->buf = NULL;
+	s->found = (y >= 0);
+	if (y < 0) {
+		if (s->verbose)
+			set_message(e, "Pattern not found: %.*s", s->len,
+				    s->pattern);
+		return;
+	}
+	if (s->verbose && wrapped)
+		set_message(e, (s->step > 0) ?
+				       "search hit BOTTOM, continuing at TOP" :
+				       "search hit TOP, continuing at BOTTOM");
+	jump(e, y, x);
+}
+
+/* Splits the rest of a mapped file into lines until deadline. Returns 1
+ * once it is all split */
+static int scan_to_end(struct buffer *b, uint64_t deadline)
+{
+	while (b->scanned < b->orig_size) {
+		if (clock_ns() >= deadline)
+			return 0;
+		buffer_scan(b, b->line_count + SEARCH_SCAN_LINES);
+	}
+	return 1;
+}
+
+/* Goes on with the running search until deadline. Returns 1 once it is
+ * over, found or not */
+static int search_run(struct editor *e, uint64_t deadline)
+{
+	struct search *s = &e->search;
+	struct buffer *b = s->buf;
+
+	/* Went around the top, the end of a mapped file is still being
+	 * split to find the last line */
+	if (s->y < 0) {
+		if (!scan_to_end(b, deadline))
+			return 0;
+		s->y = b->line_count - 1;
+	}
+	struct line *l = buffer_line(b, s->y);
+
+	for (int i = 1;; i++) {
+		int len;
+		int at = (s->step > 0) ? search_find(e, l, s->x, l->size, &len) :
+					 find_last(e, l, s->x);
+		if (at >= 0) {
+			search_done(e, s->y, at, s->wrapped);
+			return 1;
+		}
+
+		/* On to the next line, around the ends once */
+		if (s->step > 0) {
+			l = buffer_next_line(b, l);
+			s->y++;
+			s->x = 0;
+			if (!l && !s->wrapped) {
+				l = buffer_line(b, 0);
+				s->y = 0;
+				s->wrapped = 1;
+			}
+		} else {
+			l = buffer_prev_line(b, l);
+			s->y--;
+			s->x = INT_MAX;
+			if (!l && !s->wrapped) {
+				/* The end of a mapped file may not be split,
+				 * that goes on in idle time if it takes long */
+				s->wrapped = 1;
+				if (!scan_to_end(b, deadline))
+					return 0;
+				s->y = b->line_count - 1;
+				l = buffer_line(b, s->y);
+			}
+		}
+		if (!l ||
+		    (s->wrapped && s->y * s->step > s->start_y * s->step)) {
+			search_done(e, -1, 0, 0);
+			return 1;
+		}
+
+		if (i % SEARCH_CLOCK_LINES == 0 && clock_ns() >= deadline)
+			return 0;
+	}
+}
+
+static int search_idle(struct editor *e, void *data, uint64_t deadline)
+{
+	struct search *s = &e->search;
+	if (!s->buf)
+		return 0;
+	return !search_run(e, deadline);
+}
+
+/* Starts searching for the pattern from the cursor, after it or before
+ * it by step. What does not fit in the key's time goes on in idle time */
+static void search_start(struct editor *e, int step, int verbose)
+{
+	struct search *s = &e->search;
+	struct buffer *b = e->active_buf;
+
+	search_cancel(e);
+	s->found = 0;
+	s->step = step;
+	s->verbose = verbose;
+	if (is_regex(s)) {
+		regex_start(e, step, verbose);
+		return;
+	}
+	if (s->len == 0)
+		return;
+	s->buf = b;
+	s->y = b->cy;
+	s->x = (step > 0) ? b->cx + 1 : b->cx;
+	s->start_y = b->cy;
+	s->wrapped = 0;
+	if (!search_run(e, clock_ns() + SEARCH_KEY_NS))
+		event_idle(search_idle, NULL);
+}
+
+/* Drops a search still running in idle time or in worker threads. Keys
+ * call this before they move the cursor or change text under it */
+void search_cancel(struct editor *e)
+{
+	struct search *s = &e->search;
+	s->buf = NULL;
+	if (s->job) {
+		regex_cancel(s->job);
+		s->job = NULL;
+	}
+}
+
+/* Opens the prompt for a search forward, or backward if dir is -1 */
+void search_open(struct editor *e, int dir)
+{
+	struct search *s = &e->search;
+	struct buffer *b = e->active_buf;
+
+	memcpy(s->prev, s->pattern, s->len);
+	s->prev_len = s->len;
+	s->len = 0;
+	s->dir = dir;
+	s->highlight = 1;
+	s->origin_cy = b->cy;
+	s->origin_cx = b->cx;
+	s->origin_row_offset = b->row_offset;
+	e->mode = MODE_SEARCH;
+	e->drawn_buf = NULL;
+}
+
+/* Searches for the last pattern again, dir 1 the way it went and -1 the
+ * other way */
+void search_next(struct editor *e, int dir)
+{
+	struct search *s = &e->search;
+	if (s->len == 0) {
+		set_message(e, "No previous search");
+		return;
+	}
+	if (!s->highlight) {
+		s->highlight = 1;
+		e->drawn_buf = NULL;
+	}
+	search_start(e, s->dir * dir, 1);
+}
+
+/* Puts the cursor back where the prompt opened */
+static void back_to_origin(struct editor *e)
+{
+	struct search *s = &e->search;
+	struct buffer *b = e->active_buf;
+	b->cy = s->origin_cy;
+	b->cx = s->origin_cx;
+	b->current = buffer_line(b, b->cy);
+	buffer_scroll(b, s->origin_row_offset);
+}
+
+/* Typing at the search prompt. Every change of the pattern searches
+ * again from where the cursor was when the prompt opened */
+void handle_search_input(struct editor *e, int c)
+{
+	struct search *s = &e->search;
+
+	switch (c) {
+	case KEY_ESCAPE:
+		search_cancel(e);
+		memcpy(s->pattern, s->prev, s->prev_len);
+		s->len = s->prev_len;
+		s->highlight = 0;
+		back_to_origin(e);
+		e->mode = MODE_NORMAL;
+		e->drawn_buf = NULL;
+		return;
+	case KEY_RETURN:
+		e->mode = MODE_NORMAL;
+		if (s->len == 0) {
+			/* Empty pattern searches for the last one */
+			memcpy(s->pattern, s->prev, s->prev_len);
+			s->len = s->prev_len;
+			e->drawn_buf = NULL;
+			search_next(e, 1);
+		} else if (s->buf || s->job) {
+			/* Still running, it tells how it went */
+			s->verbose = 1;
+		} else if (is_regex(s) && regex_error(e)) {
+			set_message(e, "Invalid pattern: %s", regex_error(e));
+		} else if (!s->found) {
+			set_message(e, "Pattern not found: %.*s", s->len,
+				    s->pattern);
+		}
+		return;
+	case KEY_BACKSPACE:
+		if (s->len == 0) {
+			handle_search_input(e, KEY_ESCAPE);
+			return;
+		}
+		s->len--;
+		break;
+	default:
+		if (c < 32 || c > 255 || c == 127 || s->len == SEARCH_MAX)
+			return;
+		s->pattern[s->len++] = c;
+		break;
+	}
+
+	back_to_origin(e);
+	e->drawn_buf = NULL;
+	search_start(e, s->dir, 0);
+}
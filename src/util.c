@@ -3,23 +3,11 @@
 #include <string.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <time.h>
+#include <sys/mman.h>
 #include "kiuru.h"
 #include "util.h"
 
-/* Converts real mouse pos to rendered mouse pos */
-int cx_to_rx(struct line *line, int cx)
-{
-	if (!line)
-		return 0;
-	int rx = 0;
-	for (int i = 0; i < cx && i < line->size; i++)
-		if (line->data[i] == '\t')
-			rx += TAB_WIDTH - (rx % TAB_WIDTH);
-		else
-			rx++;
-	return rx;
-}
-
 /* Sets status bar message */
 void set_message(struct editor *e, const char *fmt, ...)
 {
@@ -47,12 +35,12 @@ char *get_word_under_cursor(struct editor *e)
 
 	/* Find start of word */
 	int start = cx;
-	while (start > 0 && is_word_char(l->data[start - 1]))
+	while (start > 0 && is_word_char(line_byte(l, start - 1)))
 		start--;
 
 	/* Find end of word */
 	int end = cx;
-	while (end < l->size && is_word_char(l->data[end]))
+	while (end < l->size && is_word_char(line_byte(l, end)))
 		end++;
 
 	int len = end - start;
@@ -60,11 +48,68 @@ char *get_word_under_cursor(struct editor *e)
 		return NULL;
 
 	char *word = xmalloc(len + 1);
-	memcpy(word, &l->data[start], len);
+	line_read(l, start, len, word);
 	word[len] = '\0';
 	return word;
 }
 
+/*
+ * Fenwick tree over n counts, used as an order statistic index. tree has
+ * n + 1 slots and slot 0 is unused. Entries are 0 based in the interface.
+ */
+
+/* Turns plain counts in tree[1..n] into a Fenwick tree, O(n) */
+void fenwick_init(int *tree, int n)
+{
+	for (int i = 1; i <= n; i++) {
+		int parent = i + (i & -i);
+		if (parent <= n)
+			tree[parent] += tree[i];
+	}
+}
+
+/* Adds delta to entry i */
+void fenwick_add(int *tree, int n, int i, int delta)
+{
+	for (i++; i <= n; i += i & -i)
+		tree[i] += delta;
+}
+
+/* Sum of the first i entries */
+int fenwick_sum(const int *tree, int i)
+{
+	int sum = 0;
+	for (; i > 0; i -= i & -i)
+		sum += tree[i];
+	return sum;
+}
+
+/* Finds the entry that holds unit k (0 based) of the total and leaves the
+ * offset inside that entry to k. Returns n if k is past the end */
+int fenwick_find(const int *tree, int n, int *k)
+{
+	int pos = 0;
+	int step = 1;
+	while (step * 2 <= n)
+		step *= 2;
+
+	for (; step > 0; step /= 2) {
+		if (pos + step <= n && tree[pos + step] <= *k) {
+			pos += step;
+			*k -= tree[pos];
+		}
+	}
+	return pos;
+}
+
+/* Monotonic time in ns */
+uint64_t clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 void die(const char *err, ...)
 {
 	char msg[4096];
@@ -100,6 +145,138 @@ void *xrealloc(void *ptr, size_t size)
 	return new_ptr;
 }
 
+/*
+ * Arena allocator. Small sizes are rounded up to a power of two and come
+ * from per class pools, so an item of size 2^n is also aligned to 2^n (up to
+ * the page size). Callers pass the size back when freeing.
+ */
+
+/* First and last chunk size of a pool */
+#define ARENA_CHUNK_MIN (64 * 1024)
+#define ARENA_CHUNK_MAX (8 * 1024 * 1024)
+
+static int arena_class(size_t size)
+{
+	int c = 0;
+	while (((size_t)1 << (c + ARENA_MIN_SHIFT)) < size)
+		c++;
+	return c;
+}
+
+static void *arena_chunk_new(struct arena *a, size_t size)
+{
+	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		die("Out of memory (mmap failed for %zu bytes)\n", size);
+
+	a->chunks = xrealloc(a->chunks,
+			     (a->chunk_count + 1) * sizeof(*a->chunks));
+	a->chunks[a->chunk_count].ptr = ptr;
+	a->chunks[a->chunk_count].size = size;
+	a->chunk_count++;
+	a->reserved += size;
+	return ptr;
+}
+
+void *xarena_alloc(struct arena *a, size_t size)
+{
+	int c = arena_class(size);
+
+	if (c >= ARENA_CLASSES) {
+		struct arena_big *big = xmalloc(sizeof(*big) + size);
+		big->size = size;
+		big->prev = NULL;
+		big->next = a->big;
+		if (a->big)
+			a->big->prev = big;
+		a->big = big;
+		a->used += size;
+		a->reserved += size;
+		return big + 1;
+	}
+
+	struct arena_pool *pool = &a->pools[c];
+	size_t item = (size_t)1 << (c + ARENA_MIN_SHIFT);
+	a->used += item;
+
+	if (pool->free_list) {
+		void *ptr = pool->free_list;
+		pool->free_list = *(void **)ptr;
+		return ptr;
+	}
+
+	if (pool->bump == pool->end) {
+		if (pool->chunk_size == 0)
+			pool->chunk_size = ARENA_CHUNK_MIN;
+		else if (pool->chunk_size < ARENA_CHUNK_MAX)
+			pool->chunk_size *= 2;
+		pool->bump = arena_chunk_new(a, pool->chunk_size);
+		pool->end = pool->bump + pool->chunk_size;
+	}
+
+	void *ptr = pool->bump;
+	pool->bump += item;
+	return ptr;
+}
+
+void xarena_free(struct arena *a, void *ptr, size_t size)
+{
+	if (!ptr)
+		return;
+
+	int c = arena_class(size);
+	if (c >= ARENA_CLASSES) {
+		struct arena_big *big = (struct arena_big *)ptr - 1;
+		if (big->prev)
+			big->prev->next = big->next;
+		else
+			a->big = big->next;
+		if (big->next)
+			big->next->prev = big->prev;
+		a->used -= big->size;
+		a->reserved -= big->size;
+		free(big);
+		return;
+	}
+
+	*(void **)ptr = a->pools[c].free_list;
+	a->pools[c].free_list = ptr;
+	a->used -= (size_t)1 << (c + ARENA_MIN_SHIFT);
+}
+
+void *xarena_realloc(struct arena *a, void *ptr, size_t old_size,
+		     size_t new_size)
+{
+	/* Same class, the item already has room */
+	if (ptr && arena_class(old_size) == arena_class(new_size) &&
+	    arena_class(new_size) < ARENA_CLASSES)
+		return ptr;
+
+	void *new_ptr = xarena_alloc(a, new_size);
+	if (ptr) {
+		memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+		xarena_free(a, ptr, old_size);
+	}
+	return new_ptr;
+}
+
+/* Gives everything in the arena back, one call per chunk */
+void arena_release(struct arena *a)
+{
+	for (int i = 0; i < a->chunk_count; i++)
+		munmap(a->chunks[i].ptr, a->chunks[i].size);
+	free(a->chunks);
+
+	struct arena_big *iter = a->big;
+	while (iter) {
+		struct arena_big *next = iter->next;
+		free(iter);
+		iter = next;
+	}
+	memset(a, 0, sizeof(*a));
+}
+
 char *xstrdup(const char *s)
 {
 	if (!s)
@@ -1,16 +1,71 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 struct editor;
 struct line;
 
+/* Arena size classes go from 16 bytes up to 64K in powers of two, bigger
+ * allocations are made one by one but still freed with the arena */
+#define ARENA_MIN_SHIFT 4
+#define ARENA_CLASSES 13
+
+/* Items of one size class, carved from chunks that only hold that class */
+struct arena_pool {
+	char *bump;
+	/* Next never used item in the newest chunk */
+	char *end;
+	size_t chunk_size;
+	/* Size of the newest chunk, doubles up to a limit */
+	void *free_list;
+	/* Freed items, linked through their first bytes */
+};
+
+/* Allocation outside the size classes */
+struct arena_big {
+	struct arena_big *prev;
+	struct arena_big *next;
+	size_t size;
+};
+
+struct arena_chunk {
+	void *ptr;
+	size_t size;
+};
+
+/* Memory that is handed out in small pieces and given back to the system
+ * all at once */
+struct arena {
+	struct arena_pool pools[ARENA_CLASSES];
+	struct arena_chunk *chunks;
+	int chunk_count;
+	struct arena_big *big;
+
+	/* Bytes handed out and not freed */
+	size_t used;
+	/* Bytes taken from the system */
+	size_t reserved;
+};
+
+uint64_t clock_ns(void);
 void die(const char *err, ...);
 void *xmalloc(size_t size);
 void *xcalloc(size_t nmemb, size_t size);
 void *xrealloc(void *ptr, size_t size);
 char *xstrdup(const char *s);
+void *xarena_alloc(struct arena *a, size_t size);
+void *xarena_realloc(struct arena *a, void *ptr, size_t old_size,
+		     size_t new_size);
+void xarena_free(struct arena *a, void *ptr, size_t size);
+void arena_release(struct arena *a);
+
+void fenwick_init(int *tree, int n);
+void fenwick_add(int *tree, int n, int i, int delta);
+int fenwick_sum(const int *tree, int i);
+int fenwick_find(const int *tree, int n, int *k);
 
-int cx_to_rx(struct line *line, int cx);
 void set_message(struct editor *e, const char *fmt, ...);
 char *get_word_under_cursor(struct editor *e);
 